@@ -151,6 +151,8 @@ int Car::init(PwmServoConfig* pSteeringConfig,
 	pi->getPin(7)->setValue(HIGH);
 #endif	
 
+	i2c->setClockHz(pBoardConfig->bus_hz);
+
 	if (pwm) delete pwm;
 	pwm = 	new PCA9685 	(i2c, pBoardConfig->i2c_address, servoConfig.frequency);
 	delay(25);
@@ -298,6 +300,41 @@ void 	Car::setThrottle(float percent)
 	esc->set(percent);
 }
 
+int 	Car::setControls(float steering, float throttle)
+{
+	if (! pwm->isReady()) return 0;
+
+	int channels[2];
+	int values[2];
+	int written[2];
+	int count = 0;
+	int iThrottle = -1;
+
+	int steerPwm = servo->isReady() ? servo->pwmFor(steering) : -1;
+	int throttlePwm = esc->pwmFor(throttle);
+
+	if (steerPwm >= 0)
+	{
+		channels[count] = servo->getCfg().channel;
+		values[count++] = steerPwm;
+	}
+
+	if (throttlePwm >= 0)
+	{
+		iThrottle = count;
+		channels[count] = esc->getChannel();
+		values[count++] = throttlePwm;
+	}
+
+	if (count == 0 || pwm->setPwms(channels, values, count, written) <= 0)
+		return 0;
+
+	if (steerPwm >= 0) servo->onPwmWritten(steerPwm);
+	if (throttlePwm >= 0) esc->onPwmWritten(throttlePwm);
+
+	return iThrottle >= 0 && written[iThrottle];
+}
+
 
 
 
@@ -24,10 +24,12 @@ struct PWMBoardConfig
 	PWMBoardConfig() {
 		i2c_address = 0x40;
 		device_file = "/dev/i2c-0";
+		bus_hz = 100000;
 	}
 
 	int i2c_address;
 	std::string device_file;
+	int bus_hz;				// only to report how busy the bus is
 };
 
 class Car
@@ -49,6 +51,11 @@ public:
 	//-1.0f full reverse, 1.0f full forward. 0.0f idle
 	void 	setThrottle(float percent);
 
+	//both at once, in one bus transfer, so they change on the same pwm frame.
+	//Returns 1 when the throttle went out on the bus, 0 when the chip already
+	//had it or the write failed.
+	int 	setControls(float steering, float throttle);
+
 	// managing direction
 	int 	turnRightPct (int percent);
 	int 	turnLeftPct (int percent);
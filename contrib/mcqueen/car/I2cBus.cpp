@@ -10,6 +10,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <time.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
 #if ENABLE_WIRING_PI 
 	#include <wiringPi.h>
 	#include <wiringPiI2C.h>
@@ -21,12 +24,22 @@
 
 using namespace std;
 
+static double monotonic_seconds (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 /**********************************************************/
 I2cBus::I2cBus(const char* device_filename)
 {
 	currentSlave = -1;
 	fd = -1;
 	ready = 0;
+	blockWrites = 0;
+	clockHz = 100000;
+	resetStats();
 	init(device_filename);
 }
 
@@ -64,7 +77,11 @@ int I2cBus::init(const char* device_filename)
 	if ((fd = open (i2cPath.c_str(), O_RDWR)) >= 0)
 		ready = 1;
 
-	printf("I2cBus::ready: %s\n", ready == 1 ? "yes": "no");
+	// SMBus only adapters can't do I2C_RDWR. Those get a register at a time.
+	unsigned long funcs = 0;
+	blockWrites = (ready && ioctl (fd, I2C_FUNCS, &funcs) >= 0 && (funcs & I2C_FUNC_I2C)) ? 1 : 0;
+
+	printf("I2cBus::ready: %s, block writes: %s\n", ready == 1 ? "yes": "no", blockWrites ? "yes" : "no");
 	
 	return ready;
 }
@@ -92,6 +109,7 @@ int I2cBus::read8 (int address, int reg)
 	if (fd < 0) return -1;
 	if (address != currentSlave) setSlave(address);
 	int data = wiringPiI2CReadReg8 (fd, reg);
+	countTransfer (2, 4, data);
 	// cout << "Read8 addr=0x" << hex << address << " register=0x" << reg << " value=0x" << data << dec << endl;
 	return data;
 }
@@ -103,6 +121,7 @@ int I2cBus::read16 (int address, int reg)
 	if (fd < 0) return -1;
 	if (address != currentSlave) setSlave(address);
 	int data = wiringPiI2CReadReg16 (fd, reg);
+	countTransfer (2, 5, data);
 	// cout << "Read16 addr=0x" << hex << address << " register=0x" << reg << " value=0x" << data << dec << endl;
 	return data;
 }
@@ -114,7 +133,9 @@ int I2cBus::write8 (int address, int reg, int data)
 	if (! ready) return -1;
 	if (fd < 0) return -1;
 	if (address != currentSlave) setSlave(address);
-	return wiringPiI2CWriteReg8 (fd, reg, data);
+	int result = wiringPiI2CWriteReg8 (fd, reg, data);
+	countTransfer (1, 3, result);
+	return result;
 }
 
 /**********************************************************/
@@ -124,7 +145,94 @@ int I2cBus::write16 (int address, int reg, int data)
 	if (! ready) return -1;
 	if (fd < 0) return -1;
 	if (address != currentSlave) setSlave(address);
-	return wiringPiI2CWriteReg8 (fd, reg, data);
+	int result = wiringPiI2CWriteReg8 (fd, reg, data);
+	countTransfer (1, 3, result);
+	return result;
+}
+
+/**********************************************************/
+int I2cBus::writeBlock (int address, int reg, const unsigned char *data, int length)
+{
+	I2cBlock block;
+	block.reg = reg;
+	block.data = data;
+	block.length = length;
+	return writeBlocks (address, &block, 1);
+}
+
+/**********************************************************/
+int I2cBus::writeBlocks (int address, const I2cBlock *blocks, int count)
+{
+	if (! ready) return -1;
+	if (fd < 0) return -1;
+	if (count <= 0 || count > I2C_MAX_BLOCKS) return -1;
+
+	if (! blockWrites)
+	{
+		for (int i = 0; i < count; i++)
+			for (int j = 0; j < blocks[i].length; j++)
+				if (write8 (address, blocks[i].reg + j, blocks[i].data[j]) < 0)
+					return -1;
+		return 0;
+	}
+
+	// one message per run, each the register then the data. The kernel sends
+	// them back to back with repeated starts, and a single stop at the end.
+	unsigned char buf[I2C_MAX_BLOCKS][I2C_MAX_BLOCK_LEN + 1];
+	struct i2c_msg msgs[I2C_MAX_BLOCKS];
+	int bytes = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (blocks[i].length <= 0 || blocks[i].length > I2C_MAX_BLOCK_LEN) return -1;
+		buf[i][0] = (unsigned char) blocks[i].reg;
+		memcpy (&buf[i][1], blocks[i].data, blocks[i].length);
+		msgs[i].addr = (unsigned short) address;
+		msgs[i].flags = 0;
+		msgs[i].len = (unsigned short) (blocks[i].length + 1);
+		msgs[i].buf = buf[i];
+		bytes += msgs[i].len + 1;
+	}
+
+	struct i2c_rdwr_ioctl_data xfer;
+	xfer.msgs = msgs;
+	xfer.nmsgs = count;
+
+	int result = ioctl (fd, I2C_RDWR, &xfer) < 0 ? -1 : 0;
+	countTransfer (count, bytes, result);
+	return result;
+}
+
+/**********************************************************/
+void I2cBus::countTransfer (int messages, int bytes, int result)
+{
+	stats.transfers++;
+	stats.messages += messages;
+	stats.bytes += bytes;
+	if (result < 0) stats.errors++;
+
+	// 9 clocks a byte with the ack, and about one each for the starts and the stop
+	stats.busSeconds += (double) (bytes * 9 + messages + 1) / clockHz;
+}
+
+/**********************************************************/
+void I2cBus::setClockHz (int hz)
+{
+	if (hz > 0) clockHz = hz;
+}
+
+/**********************************************************/
+void I2cBus::getStats (I2cStats &out)
+{
+	out = stats;
+	out.seconds = monotonic_seconds() - statsStart;
+}
+
+/**********************************************************/
+void I2cBus::resetStats (void)
+{
+	memset (&stats, 0, sizeof(stats));
+	statsStart = monotonic_seconds();
 }
 
 /**********************************************************/
@@ -137,6 +245,7 @@ void I2cBus::printStatus (void)
 	cout << "System path           : " << i2cPath << endl;
 	cout << "File Descriptor       : " << fd << endl;
 	cout << "Current Slave Address : 0x" << hex << currentSlave << dec << endl;
+	cout << "Block Writes          : " << (blockWrites ? "Yes" : "No") << endl;
 	cout << endl;
 }
 
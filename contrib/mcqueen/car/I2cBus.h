@@ -11,6 +11,28 @@
 #define I2C_SLAVE	0x0703
 #include <string.h>
 
+#define I2C_MAX_BLOCKS		8		// register runs in one writeBlocks transfer
+#define I2C_MAX_BLOCK_LEN	64		// bytes in one run, after the register
+
+// What has gone over the bus since resetStats.
+struct I2cStats
+{
+	unsigned long long transfers;	// start to stop, each a system call
+	unsigned long long messages;	// addressed parts of a transfer
+	unsigned long long bytes;		// on the wire, address bytes included
+	unsigned long long errors;
+	double seconds;					// since resetStats
+	double busSeconds;				// the bus was busy, at clockHz
+};
+
+// A run of registers for writeBlocks. The device auto-increments from reg.
+struct I2cBlock
+{
+	int reg;
+	const unsigned char *data;
+	int length;
+};
+
 class I2cBus
 {
 public:
@@ -25,12 +47,24 @@ public:
 	int read16 (int address, int reg);
 	int write8 (int address, int reg, int data);
 	int write16 (int address, int reg, int data);
+	int writeBlock (int address, int reg, const unsigned char *data, int length);	// reg, then data, in one transaction
+	int writeBlocks (int address, const I2cBlock *blocks, int count);			// several runs in one transfer, with repeated starts
+
+	void setClockHz (int hz);					// bus speed, to work out how busy it is
+	void getStats (I2cStats &out);
+	void resetStats (void);
 
 private:
 	int ready;
 	int fd;
 	std::string i2cPath;
 	int currentSlave;
+	int blockWrites;		// adapter takes plain I2C messages through I2C_RDWR
+
+	void countTransfer (int messages, int bytes, int result);
+	int clockHz;
+	I2cStats stats;
+	double statsStart;
 };
 
 
@@ -35,6 +35,7 @@ PCA9685::PCA9685 (I2cBus *i2cBus, int addr, int freq)
 /********************************************************/
 PCA9685::~PCA9685(void)
 {
+	pthread_mutex_destroy(&mutex);
 }
 
 /********************************************************/
@@ -47,13 +48,23 @@ void PCA9685::reset (void)
 /********************************************************/
 void PCA9685::printStatus (void)
 {
+	// the control thread may be writing, so take what we print from the
+	// shadow, under its lock, rather than off the bus
+	pthread_mutex_lock(&mutex);
+	if (i2c && shadowMode1 < 0) shadowMode1 = i2c->read8(address, MODE1_REG);
+	int mode1 = shadowMode1;
+	unsigned long long skips = channelSkips;
+	unsigned long long writes = channelWrites;
+	pthread_mutex_unlock(&mutex);
+
 	cout << "PCA9685 PWM CONTROLLER STATUS" << endl;
 	cout << "-----------------------------" << endl;
 	cout << "Is Ready           : " << (isReady() ? "Yes" : "No") << endl;
 	cout << "Is asleep          : " << (isAsleep() ? "Yes" : "No") << endl;
 	cout << "Address on I2C Bus : 0x" << hex << address << dec << endl;
 	cout << "PWM frequency      : " << getFrequency() << "Hz" << endl;
-	cout << "Mode1 Register     : 0x" << hex << i2c->read8(address, MODE1_REG) << dec << endl;
+	cout << "Mode1 Register     : 0x" << hex << mode1 << dec << endl;
+	cout << "Writes skipped     : " << skips << " of " << writes << endl;
 	cout << endl;
 }
 
@@ -61,24 +72,32 @@ void PCA9685::printStatus (void)
 void PCA9685::sleep (void)
 {
 	if (! i2c) return;
-	i2c->write8(address, MODE1_REG, MODE1_SLEEP);
+	pthread_mutex_lock(&mutex);
+	shadowMode1 = i2c->write8(address, MODE1_REG, MODE1_SLEEP) < 0 ? -1 : MODE1_SLEEP;
+	pthread_mutex_unlock(&mutex);
 }
 
 /********************************************************/
 void PCA9685::wakeUp (void)
 {
 	if (! i2c) return;
-	i2c->write8(address, MODE1_REG, MODE1_AI);
+	pthread_mutex_lock(&mutex);
+	shadowMode1 = i2c->write8(address, MODE1_REG, MODE1_AI) < 0 ? -1 : MODE1_AI;
+	pthread_mutex_unlock(&mutex);
 }
 
 /********************************************************/
 void PCA9685::setAllOff ()
 {
 	if (! i2c) return;
-	i2c->write8(address, LED_ALL_ON, 0);
-	i2c->write8(address, LED_ALL_ON + 1, 0);
-	i2c->write8(address, LED_ALL_ON + 2, 0);
-	i2c->write8(address, LED_ALL_ON + 3, 0);
+	const unsigned char off[4] = { 0, 0, 0, 0 };
+	pthread_mutex_lock(&mutex);
+	i2c->writeBlock(address, LED_ALL_ON, off, 4);
+
+	// goes to every channel, but only by way of ALL_LED
+	for (int i = 0; i < NUM_CHANNELS; i++)
+		shadowOff[i] = -1;
+	pthread_mutex_unlock(&mutex);
 }
 
 
@@ -93,17 +112,29 @@ int PCA9685::isReady (void)
 int PCA9685::isAsleep (void)
 {
 	if (! i2c) return -1;
-	return (i2c->read8(address, MODE1_REG) & MODE1_SLEEP);
+	pthread_mutex_lock(&mutex);
+	if (shadowMode1 < 0) shadowMode1 = i2c->read8(address, MODE1_REG);
+	int mode1 = shadowMode1;
+	pthread_mutex_unlock(&mutex);
+	return (mode1 & MODE1_SLEEP);
 }
 
 /********************************************************/
 int PCA9685::getPwm (int channel)
 {
 	if (! i2c) return -1;
-	channel = (channel * 4) + 6;
-	int regLo = i2c->read8 (address, channel + 2);
-	int regHi = i2c->read8 (address, channel + 3);
-	return (regHi << 8) + regLo;
+	if (channel < 0 || channel >= NUM_CHANNELS) return -1;
+	pthread_mutex_lock(&mutex);
+	if (shadowOff[channel] < 0)
+	{
+		int reg = LED0_ON_L + channel * 4;
+		int regLo = i2c->read8 (address, reg + 2);
+		int regHi = i2c->read8 (address, reg + 3);
+		if (regLo >= 0 && regHi >= 0) shadowOff[channel] = (regHi << 8) + regLo;
+	}
+	int value = shadowOff[channel];
+	pthread_mutex_unlock(&mutex);
+	return value;
 }
 
 /********************************************************/
@@ -116,10 +147,13 @@ int PCA9685::getAddress (void)
 int PCA9685::getFrequency (void)
 {
 	if (! i2c) return -1;
-	int scale = i2c->read8 (address, PRESCALE_REG);
+	pthread_mutex_lock(&mutex);
+	if (shadowPrescale < 0) shadowPrescale = i2c->read8 (address, PRESCALE_REG);
+	int scale = shadowPrescale;
+	pthread_mutex_unlock(&mutex);
 
 	//avoid divide by zero when PCA9685 is absent or not working.	
-	if(scale == -1)
+	if(scale < 0)
 		return -1;
 
 	return (25000000 / (scale + 1)) / 4096;
@@ -140,16 +174,88 @@ int PCA9685::getResolution (void)
 /********************************************************/
 int PCA9685::setPwm (int channel, int data)
 {
+	return setPwms (&channel, &data, 1);
+}
+
+/********************************************************/
+int PCA9685::setPwms (const int *channels, const int *values, int count, int *written)
+{
+	if (written)
+		for (int i = 0; i < count; i++) written[i] = 0;
+
 	if (! i2c) return -1;
-	int regLo = data & 0x00ff;
-	int regHi = data >> 8;
-	int reg = (channel * 4) + 6;
-	//cout << "Setting PWM for channel " << channel << " registers starting 0x" << hex << reg << " total value of 0x" << data << " in 2 bytes: 0x" << regHi << " & 0x" << regLo << dec << endl;
-	i2c->write8 (address, reg, 0x00);
-	i2c->write8 (address, reg + 1, 0x00);
-	i2c->write8 (address, reg + 2, regLo);
-	i2c->write8 (address, reg + 3, regHi);
-	return 1;
+	if (count <= 0 || count > NUM_CHANNELS) return 0;
+
+	for (int i = 0; i < count; i++)
+		if (channels[i] < 0 || channels[i] >= NUM_CHANNELS) return 0;
+
+	pthread_mutex_lock(&mutex);
+	channelWrites += count;
+
+	// in channel order, so neighbours go out as one run of registers. Leave
+	// out what the chip already has.
+	int order[NUM_CHANNELS];
+	int numChanged = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (shadowOff[channels[i]] == values[i])
+		{
+			channelSkips++;
+			continue;
+		}
+		int j = numChanged++;
+		for (; j > 0 && channels[order[j - 1]] > channels[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	count = numChanged;
+
+	// ON is always 0, OFF is the value. Auto-increment, set by wakeUp, walks
+	// the four LEDn registers of each channel and on into the next.
+	unsigned char data[NUM_CHANNELS * 4];
+	I2cBlock blocks[NUM_CHANNELS];
+	int numBlocks = 0;
+
+	for (int k = 0; k < count; k++)
+	{
+		int i = order[k];
+		unsigned char *p = data + k * 4;
+		p[0] = 0x00;
+		p[1] = 0x00;
+		p[2] = values[i] & 0x00ff;
+		p[3] = (values[i] >> 8) & 0x00ff;
+
+		if (numBlocks > 0 && channels[i] == channels[order[k - 1]] + 1
+			&& blocks[numBlocks - 1].length + 4 <= I2C_MAX_BLOCK_LEN)
+		{
+			blocks[numBlocks - 1].length += 4;
+		}
+		else
+		{
+			blocks[numBlocks].reg = LED0_ON_L + channels[i] * 4;
+			blocks[numBlocks].data = p;
+			blocks[numBlocks].length = 4;
+			numBlocks++;
+		}
+	}
+
+	// the outputs change on the stop, which comes once at the end of a transfer
+	int success = 1;
+	for (int iBlock = 0; iBlock < numBlocks && success; iBlock += I2C_MAX_BLOCKS)
+	{
+		int n = numBlocks - iBlock < I2C_MAX_BLOCKS ? numBlocks - iBlock : I2C_MAX_BLOCKS;
+		if (i2c->writeBlocks (address, blocks + iBlock, n) < 0) success = 0;
+	}
+
+	// after a failure we don't know what made it, so the next write goes out
+	for (int k = 0; k < count; k++)
+	{
+		shadowOff[channels[order[k]]] = success ? values[order[k]] : -1;
+		if (written) written[order[k]] = success;
+	}
+
+	pthread_mutex_unlock(&mutex);
+	return success;
 }
 
 /********************************************************/
@@ -157,6 +263,7 @@ void PCA9685::setAddress (int addr)
 {
 	setAllOff();
 	address = addr;
+	invalidate();
 	reset();
 }
 
@@ -166,7 +273,9 @@ void PCA9685::setFrequency (int freq)
 	if (! i2c) return;
 	int reg = (25000000 / (4096 * freq)) - 1;
 	sleep();
-	i2c->write8 (address, PRESCALE_REG, reg);
+	pthread_mutex_lock(&mutex);
+	shadowPrescale = i2c->write8 (address, PRESCALE_REG, reg) < 0 ? -1 : reg;
+	pthread_mutex_unlock(&mutex);
 	wakeUp();
 }
 
@@ -175,9 +284,42 @@ void PCA9685::setI2cBus (I2cBus *i2cBus)
 {
 	setAllOff();
 	i2c = i2cBus;
+	invalidate();
 	reset();
 }
 
+/********************************************************/
+void PCA9685::printStats (void)
+{
+	if (! i2c) return;
+	I2cStats stats;
+	i2c->getStats(stats);
+	printf("i2c: %llu transfers, %llu bytes, %llu errors, bus %.2f%% busy. pwm: %llu of %llu channel writes skipped as unchanged\n",
+		stats.transfers, stats.bytes, stats.errors, stats.seconds > 0.0 ? 100.0 * stats.busSeconds / stats.seconds : 0.0,
+		channelSkips, channelWrites);
+}
+
+/********************************************************/
+void PCA9685::resetStats (void)
+{
+	if (i2c) i2c->resetStats();
+	pthread_mutex_lock(&mutex);
+	channelWrites = 0;
+	channelSkips = 0;
+	pthread_mutex_unlock(&mutex);
+}
+
+/********************************************************/
+void PCA9685::invalidate (void)
+{
+	pthread_mutex_lock(&mutex);
+	for (int i = 0; i < NUM_CHANNELS; i++)
+		shadowOff[i] = -1;
+	shadowMode1 = -1;
+	shadowPrescale = -1;
+	pthread_mutex_unlock(&mutex);
+}
+
 
 
 
@@ -190,9 +332,15 @@ int PCA9685::init (I2cBus *i2cBus, int addr, int freq, int res, int clock)
 	address = addr;
 	resolution = res;
 	oscClock = clock;
+	channelWrites = 0;
+	channelSkips = 0;
+	pthread_mutex_init(&mutex, NULL);
+	invalidate();
 	setFrequency(freq);
 	if (i2c) ready = 1;
 
+	// read it back, rather than trust the shadow, to be sure the chip is there
+	invalidate();
 	if(getFrequency() == -1)
 		ready = 0;
 
@@ -10,12 +10,15 @@
 #ifndef PCA9685_H_
 #define PCA9685_H_
 
+#include <pthread.h>
 #include "I2cBus.h"
 
 #define OSC_CLOCK 			25000000
 #define RESOLUTION			4096
 #define PRESCALE_REG		0xfe
 #define LED_ALL_ON			0xfa
+#define LED0_ON_L			0x06
+#define NUM_CHANNELS		16
 
 #define DEFAULT_PCA9685_ADDRESS		0x40
 #define DEFAULT_PCA9685_FREQUENCY	50		// Hz
@@ -55,12 +58,27 @@ public:
 	int getResolution (void);					// Returns the resolution of the PWM (12-bit for the PCA9685, which is 4096)
 
 	int setPwm (int channel, int data);		// Sets the start & stop PWM value for me (still figure out meRef)
+	int setPwms (const int *channels, const int *values, int count, int *written = NULL);	// Sets several channels in one bus transfer, so they change together. written[i] is 1 when channel i went out, 0 when it was unchanged or failed
 	void setAddress (int address);
 	void setFrequency (int frequency);
 	void setI2cBus (I2cBus *i2c);
 
+	void printStats (void);						// bus use, and channel writes skipped, since resetStats
+	void resetStats (void);
+
 private:
 	int init (I2cBus *i2cBus, int addr, int res, int freq, int clock); 	// initializes the controller
+	void invalidate (void);						// forget the shadow registers, when we can't be sure of the chip
+
+	// Shadow of the registers we write. Writes that wouldn't change a channel
+	// are skipped, and reads are served from here. -1 is not known yet.
+	int shadowOff[NUM_CHANNELS];
+	int shadowMode1;
+	int shadowPrescale;
+	unsigned long long channelWrites;
+	unsigned long long channelSkips;
+	pthread_mutex_t mutex;						// the robot thread and the status led share the chip
+
 	int ready;
 	I2cBus *i2c;
 	int address;
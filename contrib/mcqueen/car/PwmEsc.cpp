@@ -268,6 +268,14 @@ int PwmEsc::setPwm (int value)
 
 //-1.0f full reverse, 1.0f full forward. 0.0f idle
 void PwmEsc::set(float a)
+{
+	int val = pwmFor(a);
+
+	if (val >= 0)
+		setPwm(val);
+}
+
+int PwmEsc::pwmFor(float a)
 {
 	if( a >= -1.0f && a < 1.0f)
 	{
@@ -277,23 +285,28 @@ void PwmEsc::set(float a)
 
 		if( a == 0.0f)
 		{
-			setPwm(mid);
+			return mid;
 		}
 		else if( a > 0.0f)
 		{
 			float delta = (float)(hi - mid);
 			float dval = delta * a;
-			int val = (int)(mid + dval);
-			setPwm(val);
+			return (int)(mid + dval);
 		}
-		else if( a < 0.0f )
+		else
 		{
 			float delta = (float)(mid - low);
 			float dval = delta * -a;
-			int val = (int)(mid - dval);
-			setPwm(val);
+			return (int)(mid - dval);
 		}
 	}
+
+	return -1;
+}
+
+void PwmEsc::onPwmWritten(int value)
+{
+	lastPwm = value;
 }
 
 
@@ -54,6 +54,9 @@ public:
 	void	printStatus(void);
 
 	void set(float percent);
+	int pwmFor(float percent);		// the value set would write, -1 when out of range
+	void onPwmWritten(int value);		// someone else wrote our channel, as Car::setControls does
+	int getChannel (void) { return cfg.channel; }
 	int forwardPct (int percent);
 	int reversePct (int percent);
 	int stop (void);
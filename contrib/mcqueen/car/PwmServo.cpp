@@ -228,6 +228,14 @@ int PwmServo::setPwm (int value)
 
 //-1.0f full left, 1.0f full right. 0.0f center
 void PwmServo::set(float a)
+{
+	int val = pwmFor(a);
+
+	if (val >= 0)
+		setPwm(val);
+}
+
+int PwmServo::pwmFor(float a)
 {
 	if( a >= -1.0f && a <= 1.0f)
 	{
@@ -237,23 +245,28 @@ void PwmServo::set(float a)
 
 		if( a == 0.0f)
 		{
-			setPwm(mid);
+			return mid;
 		}
 		else if( a > 0.0f)
 		{
 			float delta = (float)(hi - mid);
 			float dval = delta * a;
-			int val = (int)(mid + dval);
-			setPwm(val);
+			return (int)(mid + dval);
 		}
-		else if( a < 0.0f )
+		else
 		{
 			float delta = (float)(mid - low);
 			float dval = delta * -a;
-			int val = (int)(mid - dval);
-			setPwm(val);
+			return (int)(mid - dval);
 		}
 	}
+
+	return -1;
+}
+
+void PwmServo::onPwmWritten(int value)
+{
+	currentPos = value;
 }
 
 
@@ -55,6 +55,8 @@ public:
 	void	printStatus(void);
 
 	void set(float percent);
+	int pwmFor(float percent);		// the value set would write, -1 when out of range
+	void onPwmWritten(int value);		// someone else wrote our channel, as Car::setControls does
 	int leftPct (int percent);
 	int rightPct (int percent);
 	int straight (void);
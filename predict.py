@@ -73,10 +73,12 @@ def go(model_path, pred_address, pred_control_address):
             '''
             we have an image
             '''
-            img_str = socket.recv()
+            #temporal models get the last N frames as a multipart message,
+            #oldest first. We stack them along the channel axis.
+            frames = socket.recv_multipart()
             #print('got an image')
-            lin_arr = np.fromstring(img_str, dtype=np.uint8)
-            img = lin_arr.reshape(_row, _col, _ch)
+            imgs = [np.fromstring(img_str, dtype=np.uint8).reshape(_row, _col, _ch) for img_str in frames]
+            img = np.concatenate(imgs, axis=2) if len(imgs) > 1 else imgs[0]
             
             if model is not None:
                 count, h, w, ch = model.inputs[0].get_shape()
@@ -0,0 +1,201 @@
+// history.h
+//
+// A time indexed history of records. Like the RingBuffer, one producer thread
+// writes while any number of consumers read. On top of the latest record, it keeps
+// a configurable depth of older records so consumers can look one up by time stamp,
+// or take the last K records as a batch, without making their own copies.
+
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stdint.h>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//Type must have a uint64_t tick member. Ticks are expected to increase with
+//each write. Records older than the retention window, relative to the latest
+//record, are treated as expired and are not returned by lookups.
+
+template<class Type>
+class HistoryBuffer
+{
+    public:
+
+    HistoryBuffer()
+    {
+        m_iWritten = 0;
+        m_RetainTicks = 0;
+        Init(3, 0);
+    }
+
+    //depth is the number of records kept. One slot is always reserved for the
+    //writer, so depth - 1 records are visible to readers.
+    //retainTicks of zero keeps records regardless of age.
+    void Init(int depth, uint64_t retainTicks)
+    {
+        if(depth < 3)
+            depth = 3;
+
+        m_Buffer.resize(depth);
+        m_RetainTicks = retainTicks;
+        m_iWritten = 0;
+    }
+
+    //Step one of a two step write. Returns the slot to fill in. This is
+    //always the oldest record, so readers never see it until FinishWrite.
+    Type& BeginWrite()
+    {
+        return m_Buffer[m_iWritten % m_Buffer.size()];
+    }
+
+    //Step two of the two step write. Publishes the record to readers.
+    void FinishWrite()
+    {
+        m_iWritten = m_iWritten + 1;
+    }
+
+    //Write will deep copy your record into the history
+    void Write(const Type& record)
+    {
+        BeginWrite() = record;
+        FinishWrite();
+    }
+
+    //this read makes a deep copy of the latest record for the user.
+    bool Read(Type& record)
+    {
+        Type* pRec = ReadRef();
+
+        if(pRec != NULL)
+            record = *pRec;
+
+        return pRec != NULL;
+    }
+
+    //this returns a reference to the latest record, or NULL when empty.
+    Type* ReadRef()
+    {
+        uint64_t iWritten = m_iWritten;
+
+        if(iWritten == 0)
+            return NULL;
+
+        return &At(iWritten, 0);
+    }
+
+    int Size()
+    {
+        return (int)m_Buffer.size();
+    }
+
+    //Number of records readers may currently see, newest first.
+    int Count()
+    {
+        return Count(m_iWritten);
+    }
+
+    //Fills batch with pointers to the last k records, ordered oldest to newest,
+    //and returns how many were available. The records are not copied. They stay
+    //valid until the writer comes back around, Size() - k writes later.
+    int GetLatest(int k, Type** batch)
+    {
+        uint64_t iWritten = m_iWritten;
+        int available = Count(iWritten);
+
+        if(k > available)
+            k = available;
+
+        for(int iRec = 0; iRec < k; iRec++)
+            batch[k - 1 - iRec] = &At(iWritten, iRec);
+
+        return k;
+    }
+
+    //Binary search for the record with the tick closest to the one given.
+    //Returns NULL when there are no unexpired records.
+    Type* FindNearest(uint64_t tick)
+    {
+        uint64_t iWritten = m_iWritten;
+        int count = Count(iWritten);
+
+        if(count == 0)
+            return NULL;
+
+        //records are indexed by age, 0 is newest. ticks decrease with age.
+        int lo = 0;
+        int hi = count - 1;
+
+        if(tick >= At(iWritten, 0).tick)
+            return &At(iWritten, 0);
+
+        if(tick <= At(iWritten, hi).tick)
+            return &At(iWritten, hi);
+
+        //find the pair that brackets our tick: At(lo).tick > tick >= At(hi).tick
+        while(hi - lo > 1)
+        {
+            int mid = (lo + hi) / 2;
+
+            if(At(iWritten, mid).tick > tick)
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        Type& newer = At(iWritten, lo);
+        Type& older = At(iWritten, hi);
+
+        if(newer.tick - tick < tick - older.tick)
+            return &newer;
+
+        return &older;
+    }
+
+    protected:
+
+    //record by age, where 0 is the latest written.
+    Type& At(uint64_t iWritten, int age)
+    {
+        return m_Buffer[(iWritten - 1 - age) % m_Buffer.size()];
+    }
+
+    int Count(uint64_t iWritten)
+    {
+        uint64_t maxCount = m_Buffer.size() - 1;
+        int count = (int)(iWritten < maxCount ? iWritten : maxCount);
+
+        if(count == 0 || m_RetainTicks == 0)
+            return count;
+
+        //drop records that fell out of the retention window.
+        uint64_t latest = At(iWritten, 0).tick;
+
+        if(latest - At(iWritten, count - 1).tick <= m_RetainTicks)
+            return count;
+
+        //binary search for the oldest record still inside the window.
+        int lo = 0;
+        int hi = count - 1;
+
+        while(hi - lo > 1)
+        {
+            int mid = (lo + hi) / 2;
+
+            if(latest - At(iWritten, mid).tick <= m_RetainTicks)
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        return lo + 1;
+    }
+
+    public:
+
+    volatile uint64_t m_iWritten;
+    uint64_t m_RetainTicks;
+
+    std::vector<Type> m_Buffer;
+};
+
+#endif //__HISTORY_H__
@@ -1,6 +1,88 @@
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
 #include "lidar.h"
+#include "timing.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Sin and cos at each of the 720 half degree bins, with one extra entry so
+// we can interpolate past the last bin without wrapping.
+
+struct LidarTrigTable
+{
+    enum Constants
+    {
+        NUM_BINS = LidarRetSet::NUM_LIDAR_RETURNS,
+        BINS_PER_DEGREE = NUM_BINS / 360,
+    };
+
+    LidarTrigTable()
+    {
+        const double deg_to_rad = 3.14159265358979323846 / 180.0;
+
+        for(int iBin = 0; iBin <= NUM_BINS; iBin++)
+        {
+            double theta = ((double)iBin / BINS_PER_DEGREE) * deg_to_rad;
+            m_Cos[iBin] = (float)cos(theta);
+            m_Sin[iBin] = (float)sin(theta);
+        }
+    }
+
+    float m_Cos[NUM_BINS + 1];
+    float m_Sin[NUM_BINS + 1];
+};
+
+static const LidarTrigTable g_LidarTrig;
+
+void LidarScanToSoA(const LidarRetSet& set, LidarScanSoA& soa)
+{
+    const int count = set.m_Count < LidarScanSoA::MAX_RETURNS ? set.m_Count : LidarScanSoA::MAX_RETURNS;
+
+    soa.m_Count = count;
+
+    //unpack the fixed point fields. angle is q6 degrees above the check bit,
+    //distance is q2 mm, quality is above the two sync bits.
+    for(int iRet = 0; iRet < count; iRet++)
+    {
+        const LidarRet& ret = set.m_Returns[iRet];
+        soa.m_Angle[iRet] = (float)(ret.angle >> 1) * (1.0f / 64.0f);
+        soa.m_Range[iRet] = (float)ret.distance * 0.25f;
+        soa.m_Quality[iRet] = ret.quality >> 2;
+    }
+
+    //polar to cartesian, interpolating between the half degree table entries.
+    const float maxBin = (float)LidarTrigTable::NUM_BINS;
+    const float* pCos = g_LidarTrig.m_Cos;
+    const float* pSin = g_LidarTrig.m_Sin;
+
+    for(int iRet = 0; iRet < count; iRet++)
+    {
+        float fBin = soa.m_Angle[iRet] * (float)LidarTrigTable::BINS_PER_DEGREE;
+
+        //angles are 0 to 360, but guard against anything odd from the device.
+        if(fBin >= maxBin)
+            fBin -= maxBin;
+
+        if(fBin < 0.0f || fBin >= maxBin)
+            fBin = 0.0f;
+
+        int iBin = (int)fBin;
+        float t = fBin - (float)iBin;
+        float c = pCos[iBin] + (pCos[iBin + 1] - pCos[iBin]) * t;
+        float s = pSin[iBin] + (pSin[iBin + 1] - pSin[iBin]) * t;
+
+        soa.m_X[iRet] = c * soa.m_Range[iRet];
+        soa.m_Y[iRet] = s * soa.m_Range[iRet];
+    }
+
+    //the lidar sweeps at a near constant rate, so angle stands in for time.
+    float duration = (set.m_EndTick > set.m_StartTick) ? (float)(set.m_EndTick - set.m_StartTick) * 1e-6f : 0.0f;
+    float secPerDegree = duration / 360.0f;
+
+    for(int iRet = 0; iRet < count; iRet++)
+        soa.m_Time[iRet] = (soa.m_Angle[iRet] - 360.0f) * secPerDegree;
+}
 
 #if ENABLE_RPLIDAR
 
@@ -12,6 +94,10 @@
 
 using namespace rp::standalone::rplidar;
 
+//we hand our own buffers to the driver, so the layouts must match exactly.
+static_assert(sizeof(LidarRet) == sizeof(rplidar_response_measurement_node_t),
+    "LidarRet must match the rplidar measurement node layout");
+
 // the driver instance
 struct RPLidarMan
 {
@@ -19,12 +105,23 @@ struct RPLidarMan
         m_pDrv = NULL;
         m_bVerboseLidarOutput = false;
         m_pUserData = NULL;
+        m_bStreamSectors = false;
+        m_SectorDegrees = 30.0f;
+        m_pAssembling = NULL;
+        m_LastScanTick = 0;
     }
 
     RPlidarDriver * m_pDrv;
     bool m_bVerboseLidarOutput;
     void* m_pUserData;
-    LidarRetSet m_Set;
+
+    //streaming mode
+    bool m_bStreamSectors;
+    float m_SectorDegrees;
+    LidarRetSet* m_pAssembling;     //full scan being filled in, from begin()
+    LidarSector m_Sector;           //slice being filled in
+
+    uint64_t m_LastScanTick;        //end of the previous full scan
 };
 
 RPLidarMan g_Lidar;
@@ -63,6 +160,11 @@ bool InitLidar(Config* conf, void* userData)
     u_result     op_result;
 
     g_Lidar.m_bVerboseLidarOutput = conf->GetInt("lidar_verbose_output", 0);
+    g_Lidar.m_bStreamSectors = conf->GetInt("lidar_stream_sectors", 0) != 0;
+    g_Lidar.m_SectorDegrees = conf->GetFloat("lidar_sector_degrees", 30.0f);
+
+    if(g_Lidar.m_SectorDegrees < 1.0f || g_Lidar.m_SectorDegrees > 360.0f)
+        g_Lidar.m_SectorDegrees = 30.0f;
 
     // create the driver instance
     g_Lidar.m_pDrv = RPlidarDriver::CreateDriver(RPlidarDriver::DRIVER_TYPE_SERIALPORT);
@@ -132,57 +234,190 @@ bool InitLidar(Config* conf, void* userData)
     return !problems;
 }
 
-void UpdateLidar(process_lidar_cb cb)
+static void print_lidar_nodes(const rplidar_response_measurement_node_t* nodes, int count)
+{
+    for (int pos = 0; pos < count ; ++pos) 
+    {
+        printf("%s theta: %03.2f Dist: %08.2f Q: %d \n", 
+            (nodes[pos].sync_quality & RPLIDAR_RESP_MEASUREMENT_SYNCBIT) ?"S ":"  ", 
+            (nodes[pos].angle_q6_checkbit >> RPLIDAR_RESP_MEASUREMENT_ANGLE_SHIFT)/64.0f,
+            nodes[pos].distance_q2/4.0f,
+            nodes[pos].sync_quality >> RPLIDAR_RESP_MEASUREMENT_QUALITY_SHIFT);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Streaming mode. Rather than block in grabScanData for the whole revolution,
+// we take whatever the driver has buffered so far. Returns are cut into angular
+// sectors for the low latency consumers, and also appended to the full scan,
+// which is handed off when the sync bit marks the start of the next revolution.
+
+static void FinishSector(process_lidar_sector_cb sector_cb)
+{
+    LidarSector& sector = g_Lidar.m_Sector;
+
+    if(sector.m_Count > 0 && sector_cb != NULL)
+        sector_cb(&sector, g_Lidar.m_pUserData);
+
+    sector.m_Count = 0;
+}
+
+static void AddToSector(const LidarRet& ret, uint64_t tick, process_lidar_sector_cb sector_cb)
+{
+    LidarSector& sector = g_Lidar.m_Sector;
+    int iSector = (int)(ret.GetAngle() / g_Lidar.m_SectorDegrees);
+
+    if(sector.m_Count > 0 && iSector != sector.m_Index)
+        FinishSector(sector_cb);
+
+    if(sector.m_Count == 0)
+    {
+        sector.m_Index = iSector;
+        sector.m_StartAngle = iSector * g_Lidar.m_SectorDegrees;
+        sector.m_EndAngle = sector.m_StartAngle + g_Lidar.m_SectorDegrees;
+        sector.m_FirstTick = tick;
+
+        if(sector.m_EndAngle > 360.0f)
+            sector.m_EndAngle = 360.0f;
+    }
+
+    if(sector.m_Count < LidarSector::MAX_RETURNS)
+        sector.m_Returns[sector.m_Count++] = ret;
+
+    sector.m_LastTick = tick;
+}
+
+static void FinishScan(LidarRetSet* pSet, process_lidar_cb cb)
+{
+    rplidar_response_measurement_node_t* nodes = (rplidar_response_measurement_node_t*)pSet->m_Returns;
+    size_t count = pSet->m_Count;
+
+    if(count > 0)
+        g_Lidar.m_pDrv->ascendScanData(nodes, count);
+
+    pSet->m_Count = (int)count;
+
+    if(g_Lidar.m_bVerboseLidarOutput)
+        print_lidar_nodes(nodes, (int)count);
+
+    cb(pSet, g_Lidar.m_pUserData);
+}
+
+static bool UpdateLidarStreaming(begin_lidar_cb begin, process_lidar_cb cb, process_lidar_sector_cb sector_cb)
+{
+    if(g_Lidar.m_pAssembling == NULL)
+    {
+        g_Lidar.m_pAssembling = begin(g_Lidar.m_pUserData);
+        g_Lidar.m_pAssembling->m_Count = 0;
+    }
+
+    LidarRetSet* pSet = g_Lidar.m_pAssembling;
+
+    //without a sync bit, we'd never hand off the scan. Cut it here instead.
+    if(pSet->m_Count >= LidarRetSet::NUM_LIDAR_RETURNS)
+    {
+        FinishSector(sector_cb);
+        pSet->m_EndTick = g_Lidar.m_LastScanTick = get_time_usec();
+        FinishScan(pSet, cb);
+        g_Lidar.m_pAssembling = NULL;
+        return true;
+    }
+
+    //the driver appends straight onto the scan being assembled.
+    rplidar_response_measurement_node_t* nodes = (rplidar_response_measurement_node_t*)&pSet->m_Returns[pSet->m_Count];
+    size_t count = LidarRetSet::NUM_LIDAR_RETURNS - pSet->m_Count;
+
+    u_result op_result = g_Lidar.m_pDrv->getScanDataWithInterval(nodes, count);
+
+    if(IS_FAIL(op_result) || count == 0)
+    {
+        //nothing buffered yet. At 10hz a half degree is about 140us, so this
+        //still gives us sectors well inside a millisecond of the sweep.
+        usleep(500);
+        return false;
+    }
+
+    uint64_t now = get_time_usec();
+    const LidarRet* rets = (const LidarRet*)nodes;
+    int iNode = 0;
+
+    for(; iNode < (int)count; iNode++)
+    {
+        bool bSync = (rets[iNode].quality & RPLIDAR_RESP_MEASUREMENT_SYNCBIT) != 0;
+
+        if(bSync && pSet->m_Count + iNode > 0)
+            break;
+
+        AddToSector(rets[iNode], now, sector_cb);
+    }
+
+    if(pSet->m_Count == 0)
+        pSet->m_StartTick = now;
+
+    pSet->m_Count += iNode;
+
+    if(iNode == (int)count)
+        return false;
+
+    //new revolution started part way through this batch. Ship the old one and
+    //move the remaining returns over to the next set.
+    FinishSector(sector_cb);
+    pSet->m_EndTick = g_Lidar.m_LastScanTick = now;
+
+    int remaining = (int)count - iNode;
+    LidarRet carry[LidarRetSet::NUM_LIDAR_RETURNS];
+    memcpy(carry, &rets[iNode], remaining * sizeof(LidarRet));
+
+    FinishScan(pSet, cb);
+
+    pSet = g_Lidar.m_pAssembling = begin(g_Lidar.m_pUserData);
+    memcpy(pSet->m_Returns, carry, remaining * sizeof(LidarRet));
+    pSet->m_Count = remaining;
+    pSet->m_StartTick = now;
+
+    for(iNode = 0; iNode < remaining; iNode++)
+        AddToSector(pSet->m_Returns[iNode], now, sector_cb);
+
+    return true;
+}
+
+bool UpdateLidar(begin_lidar_cb begin, process_lidar_cb cb, process_lidar_sector_cb sector_cb)
 {
    if(g_Lidar.m_pDrv == NULL)
-        return;
+        return false;
 
-    rplidar_response_measurement_node_t nodes[360*2];
-    size_t   count = _countof(nodes);
+    if(g_Lidar.m_bStreamSectors)
+        return UpdateLidarStreaming(begin, cb, sector_cb);
+
+    //the driver writes the scan directly into the consumer's buffer.
+    LidarRetSet* pSet = begin(g_Lidar.m_pUserData);
+    rplidar_response_measurement_node_t* nodes = (rplidar_response_measurement_node_t*)pSet->m_Returns;
+    size_t   count = LidarRetSet::NUM_LIDAR_RETURNS;
 
-    memset(nodes, 0, sizeof(nodes));
-    
     u_result op_result = g_Lidar.m_pDrv->grabScanData(nodes, count);
 
     if (IS_OK(op_result)) 
     {
+        //grabScanData returns once the revolution is complete, and the lidar
+        //scans continuously, so this one started about when the last one ended.
+        uint64_t now = get_time_usec();
+
+        pSet->m_EndTick = now;
+        pSet->m_StartTick = g_Lidar.m_LastScanTick != 0 ? g_Lidar.m_LastScanTick : now - 100000;
+        g_Lidar.m_LastScanTick = now;
+
         g_Lidar.m_pDrv->ascendScanData(nodes, count);
+
+        pSet->m_Count = (int)count;
     
         if(g_Lidar.m_bVerboseLidarOutput)
-        {
-            for (int pos = 0; pos < (int)count ; ++pos) 
-            {
-                printf("%s theta: %03.2f Dist: %08.2f Q: %d \n", 
-                    (nodes[pos].sync_quality & RPLIDAR_RESP_MEASUREMENT_SYNCBIT) ?"S ":"  ", 
-                    (nodes[pos].angle_q6_checkbit >> RPLIDAR_RESP_MEASUREMENT_ANGLE_SHIFT)/64.0f,
-                    nodes[pos].distance_q2/4.0f,
-                    nodes[pos].sync_quality >> RPLIDAR_RESP_MEASUREMENT_QUALITY_SHIFT);
-            }
-        }
+            print_lidar_nodes(nodes, (int)count);
 
-        //reurn size doesn't quite match my structure size yet. TODO.. probably because of the __atribute__ packed. figure
-        //this out and do a memcpy. Probably much faster. Though on the jetson, this doesn't add any appreciable delay.
-        if(sizeof(nodes) == sizeof(g_Lidar.m_Set.m_Returns))
-        {
-            memcpy(&g_Lidar.m_Set.m_Returns[0], &nodes[0], sizeof(nodes));
-        }
-        else
-        {
-            //do a slower element by element copy
-            g_Lidar.m_Set.m_Count = count;
-
-            for (int pos = 0; pos < (int)count ; ++pos) 
-            {
-                LidarRet& ret = g_Lidar.m_Set.m_Returns[pos];
-                rplidar_response_measurement_node_t& n = nodes[pos];
-                ret.quality = n.sync_quality;
-                ret.angle = n.angle_q6_checkbit;
-                ret.distance = n.distance_q2;
-            }
-        }
-
-        cb(&g_Lidar.m_Set, g_Lidar.m_pUserData);
+        cb(pSet, g_Lidar.m_pUserData);
+        return true;
     }
+
+    return false;
 }
 
 void ShutdownLidar()
@@ -199,7 +434,7 @@ void ShutdownLidar()
 #else //ENABLE_RPLIDAR
 
 bool InitLidar(Config* conf, void* userdata) { return false; }
-void UpdateLidar(process_lidar_cb cb){}
+bool UpdateLidar(begin_lidar_cb begin, process_lidar_cb cb, process_lidar_sector_cb sector_cb){ return false; }
 void ShutdownLidar(){}
 
 #endif //ENABLE_RPLIDAR
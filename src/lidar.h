@@ -1,10 +1,13 @@
 #ifndef __LIDAR_H__
 #define __LIDAR_H__
 
+#include <stdint.h>
 #include "SharkConfig.h"
 #include "config.h"
 
-//Modelled after rplidar return
+//Modelled after rplidar return. Packed so it has the same 5 byte layout as the
+//driver's rplidar_response_measurement_node_t, which lets the driver write scans
+//straight into our buffers.
 struct LidarRet
 {
     unsigned char quality;
@@ -14,7 +17,7 @@ struct LidarRet
     float GetDistance() const { return distance / 4.0f; }
     float GetAngle() const { return (angle >> 1) / 64.0f; }
     int GetQuality() const { return (quality >> 2); }
-};
+} __attribute__((packed));
 
 struct LidarRetSet
 {
@@ -23,20 +26,90 @@ struct LidarRetSet
         NUM_LIDAR_RETURNS = 360 * 2,
     };
 
-    LidarRetSet() : m_Count(NUM_LIDAR_RETURNS) 
+    LidarRetSet() : m_Count(NUM_LIDAR_RETURNS), m_StartTick(0), m_EndTick(0)
     {
 
     }
 
     int m_Count;
+
+    //get_time_usec() when the first and last returns of the revolution came in.
+    uint64_t m_StartTick;
+    uint64_t m_EndTick;
+
     LidarRet m_Returns[NUM_LIDAR_RETURNS];
 };
 
-//user callback to process a frame.
-typedef void (*process_lidar_cb)(const LidarRetSet *p, void* userData);
+//An angular slice of a revolution, published as soon as the lidar has swept
+//past it rather than waiting for the whole scan. Returns are in the order
+//they arrived, so angles increase except where the slice wraps past 0.
+struct LidarSector
+{
+    enum Constants
+    {
+        MAX_RETURNS = LidarRetSet::NUM_LIDAR_RETURNS,
+    };
+
+    LidarSector() : m_Count(0), m_Index(0), m_StartAngle(0.0f), m_EndAngle(0.0f),
+        m_FirstTick(0), m_LastTick(0) {}
+
+    int m_Count;
+    int m_Index;            //which slice of the revolution, 0 starts at 0 degrees
+    float m_StartAngle;     //degrees covered by the slice
+    float m_EndAngle;
+
+    //get_time_usec() when the first and last returns of the slice came in.
+    uint64_t m_FirstTick;
+    uint64_t m_LastTick;
+
+    LidarRet m_Returns[MAX_RETURNS];
+};
+
+//Structure of arrays companion to a LidarRetSet. The integer to float shifts
+//and the polar to cartesian conversion are done once per scan here, so every
+//lidar consumer can share the result instead of redoing it per return.
+//x and y are in mm in the lidar frame, x along 0 degrees, y along 90.
+struct LidarScanSoA
+{
+    enum Constants
+    {
+        MAX_RETURNS = LidarRetSet::NUM_LIDAR_RETURNS,
+    };
+
+    LidarScanSoA() : m_Count(0) {}
+
+    int m_Count;
+    float m_Angle[MAX_RETURNS];    //degrees
+    float m_Range[MAX_RETURNS];    //mm
+    float m_X[MAX_RETURNS];
+    float m_Y[MAX_RETURNS];
+    float m_Time[MAX_RETURNS];     //seconds relative to the end of the scan, <= 0
+    unsigned char m_Quality[MAX_RETURNS];
+};
+
+//Fill soa from the raw returns in set. Uses lookup tables of sin and cos at
+//each half degree rather than calling the trig functions per return.
+//Capture times are interpolated by angle between the start and end ticks of
+//the set, as the revolution starts at the sync bit near 0 degrees.
+void LidarScanToSoA(const LidarRetSet& set, LidarScanSoA& soa);
+
+//user callback that hands out the set the next scan is written into. Normally
+//this is the next slot of the ring buffer consumers read from.
+typedef LidarRetSet* (*begin_lidar_cb)(void* userData);
+
+//user callback to process a frame, once the driver has filled in the set from begin.
+//Not called when the scan fails, in which case the same set is handed out again.
+typedef void (*process_lidar_cb)(LidarRetSet *p, void* userData);
+
+//user callback to process a sector. Only called when lidar_stream_sectors is set.
+//The sector is only valid for the duration of the call.
+typedef void (*process_lidar_sector_cb)(const LidarSector *p, void* userData);
 
 bool InitLidar(Config* pConfig, void* userData = NULL);
-void UpdateLidar(process_lidar_cb cb);
+
+//Returns true when a full scan was handed to cb. In streaming mode this returns
+//after each batch of returns from the driver, so call it in a tight loop.
+bool UpdateLidar(begin_lidar_cb begin, process_lidar_cb cb, process_lidar_sector_cb sector_cb = NULL);
 void ShutdownLidar();
 
 
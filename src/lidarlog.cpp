@@ -0,0 +1,226 @@
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lidarlog.h"
+
+static const char LIDAR_LOG_MAGIC[8] = "SHRKLID";
+
+struct LidarLogScanPayload
+{
+    uint64_t m_StartTick;
+    uint64_t m_EndTick;
+    uint32_t m_Count;
+} __attribute__((packed));
+
+struct LidarLogControlPayload
+{
+    float m_Throttle;
+    float m_Steering;
+};
+
+LidarLogWriter::LidarLogWriter()
+{
+    m_fp = NULL;
+}
+
+LidarLogWriter::~LidarLogWriter()
+{
+    Close();
+}
+
+bool LidarLogWriter::Open(const char* filename)
+{
+    Close();
+
+    m_fp = fopen(filename, "wb");
+
+    if(m_fp == NULL)
+    {
+        printf("couldn't open lidar log %s\n", filename);
+        return false;
+    }
+
+    LidarLogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_Magic, LIDAR_LOG_MAGIC, sizeof(header.m_Magic));
+    header.m_Version = LidarLogHeader::VERSION;
+
+    fwrite(&header, sizeof(header), 1, m_fp);
+
+    return true;
+}
+
+void LidarLogWriter::Close()
+{
+    if(m_fp != NULL)
+        fclose(m_fp);
+
+    m_fp = NULL;
+}
+
+void LidarLogWriter::WriteScan(const LidarRetSet& scan, uint64_t tick)
+{
+    if(m_fp == NULL)
+        return;
+
+    int count = scan.m_Count < LidarRetSet::NUM_LIDAR_RETURNS ? scan.m_Count : LidarRetSet::NUM_LIDAR_RETURNS;
+
+    LidarLogScanPayload payload;
+    payload.m_StartTick = scan.m_StartTick;
+    payload.m_EndTick = scan.m_EndTick;
+    payload.m_Count = count;
+
+    LidarLogRecord rec;
+    rec.m_Type = LidarLogRecord::SCAN;
+    rec.m_Bytes = sizeof(payload) + count * sizeof(LidarRet);
+    rec.m_Tick = tick;
+
+    fwrite(&rec, sizeof(rec), 1, m_fp);
+    fwrite(&payload, sizeof(payload), 1, m_fp);
+    fwrite(scan.m_Returns, sizeof(LidarRet), count, m_fp);
+}
+
+void LidarLogWriter::WriteControl(float throttle, float steering, uint64_t tick)
+{
+    if(m_fp == NULL)
+        return;
+
+    LidarLogControlPayload payload;
+    payload.m_Throttle = throttle;
+    payload.m_Steering = steering;
+
+    LidarLogRecord rec;
+    rec.m_Type = LidarLogRecord::CONTROL;
+    rec.m_Bytes = sizeof(payload);
+    rec.m_Tick = tick;
+
+    fwrite(&rec, sizeof(rec), 1, m_fp);
+    fwrite(&payload, sizeof(payload), 1, m_fp);
+}
+
+LidarLogReader::LidarLogReader()
+{
+    m_pData = NULL;
+    m_Bytes = 0;
+    m_Offset = 0;
+}
+
+LidarLogReader::~LidarLogReader()
+{
+    Close();
+}
+
+bool LidarLogReader::Open(const char* filename)
+{
+    Close();
+
+    int fd = open(filename, O_RDONLY);
+
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(LidarLogHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* pData = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(pData == MAP_FAILED)
+        return false;
+
+    m_pData = (const unsigned char*)pData;
+    m_Bytes = st.st_size;
+
+    const LidarLogHeader* pHeader = (const LidarLogHeader*)m_pData;
+
+    if(memcmp(pHeader->m_Magic, LIDAR_LOG_MAGIC, sizeof(pHeader->m_Magic)) != 0 ||
+        pHeader->m_Version != LidarLogHeader::VERSION)
+    {
+        printf("%s isn't a lidar log we can read.\n", filename);
+        Close();
+        return false;
+    }
+
+    Rewind();
+
+    return true;
+}
+
+void LidarLogReader::Close()
+{
+    if(m_pData != NULL)
+        munmap((void*)m_pData, m_Bytes);
+
+    m_pData = NULL;
+    m_Bytes = 0;
+    m_Offset = 0;
+}
+
+bool LidarLogReader::Next(LidarLogEntry& entry)
+{
+    while(m_pData != NULL && m_Offset + sizeof(LidarLogRecord) <= m_Bytes)
+    {
+        LidarLogRecord rec;
+        memcpy(&rec, m_pData + m_Offset, sizeof(rec));
+
+        const unsigned char* pPayload = m_pData + m_Offset + sizeof(rec);
+
+        if(m_Offset + sizeof(rec) + rec.m_Bytes > m_Bytes)
+            return false;
+
+        m_Offset += sizeof(rec) + rec.m_Bytes;
+
+        entry.m_Type = rec.m_Type;
+        entry.m_Tick = rec.m_Tick;
+
+        if(rec.m_Type == LidarLogRecord::SCAN && rec.m_Bytes >= sizeof(LidarLogScanPayload))
+        {
+            LidarLogScanPayload payload;
+            memcpy(&payload, pPayload, sizeof(payload));
+
+            if(payload.m_Count > LidarRetSet::NUM_LIDAR_RETURNS ||
+                sizeof(payload) + payload.m_Count * sizeof(LidarRet) > rec.m_Bytes)
+                continue;
+
+            entry.m_Offset = pPayload - m_pData;
+
+            return true;
+        }
+
+        if(rec.m_Type == LidarLogRecord::CONTROL && rec.m_Bytes >= sizeof(LidarLogControlPayload))
+        {
+            LidarLogControlPayload payload;
+            memcpy(&payload, pPayload, sizeof(payload));
+
+            entry.m_Throttle = payload.m_Throttle;
+            entry.m_Steering = payload.m_Steering;
+
+            return true;
+        }
+
+        //skip records from a newer writer that we don't know.
+    }
+
+    return false;
+}
+
+void LidarLogReader::ReadScan(const LidarLogEntry& entry, LidarRetSet& scan) const
+{
+    //Next already checked the payload fits.
+    const unsigned char* pPayload = m_pData + entry.m_Offset;
+
+    LidarLogScanPayload payload;
+    memcpy(&payload, pPayload, sizeof(payload));
+
+    scan.m_Count = payload.m_Count;
+    scan.m_StartTick = payload.m_StartTick;
+    scan.m_EndTick = payload.m_EndTick;
+    memcpy(scan.m_Returns, pPayload + sizeof(payload), payload.m_Count * sizeof(LidarRet));
+}
@@ -0,0 +1,105 @@
+// lidarlog.h
+//
+// Lidar scans and the controls applied while they were taken, recorded so the
+// SLAM pipeline can be run again offline by shark_mapper. The file starts with
+// a LidarLogHeader, then records one after another, each a LidarLogRecord and
+// m_Bytes of payload:
+//
+//   SCAN     uint64 start tick, uint64 end tick, uint32 count, LidarRet x count
+//   CONTROL  float throttle, float steering
+//
+// Ticks are get_time_usec() on the car. Returns are kept in the driver's
+// packed 5 byte layout, so a scan costs about 3.6k.
+
+#ifndef __LIDAR_LOG_H__
+#define __LIDAR_LOG_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "lidar.h"
+
+struct LidarLogHeader
+{
+    enum Constants
+    {
+        VERSION = 1,
+    };
+
+    char m_Magic[8];        //"SHRKLID"
+    uint32_t m_Version;
+    uint32_t m_Reserved;
+};
+
+struct LidarLogRecord
+{
+    enum Type
+    {
+        SCAN = 1,
+        CONTROL = 2,
+    };
+
+    uint32_t m_Type;
+    uint32_t m_Bytes;       //of payload after this record
+    uint64_t m_Tick;
+};
+
+//one record read back from a log. A scan's returns stay in the mapped log
+//until ReadScan, so an index of the whole log is cheap to keep.
+struct LidarLogEntry
+{
+    int m_Type;
+    uint64_t m_Tick;
+    size_t m_Offset;        //SCAN only, of the payload in the log
+    float m_Throttle;       //CONTROL only
+    float m_Steering;
+};
+
+class LidarLogWriter
+{
+  public:
+
+    LidarLogWriter();
+    ~LidarLogWriter();
+
+    bool Open(const char* filename);
+    void Close();
+
+    bool IsOpen() const { return m_fp != NULL; }
+
+    void WriteScan(const LidarRetSet& scan, uint64_t tick);
+    void WriteControl(float throttle, float steering, uint64_t tick);
+
+  protected:
+
+    FILE* m_fp;
+};
+
+class LidarLogReader
+{
+  public:
+
+    LidarLogReader();
+    ~LidarLogReader();
+
+    //map the whole log. Records are read from it in order with Next.
+    bool Open(const char* filename);
+    void Close();
+
+    //false at the end of the log, or at a record cut short by a crash.
+    bool Next(LidarLogEntry& entry);
+
+    //copy out the returns of a SCAN entry. Only reads the mapping, so runs
+    //on other threads can share the reader.
+    void ReadScan(const LidarLogEntry& entry, LidarRetSet& scan) const;
+
+    void Rewind() { m_Offset = sizeof(LidarLogHeader); }
+
+  protected:
+
+    const unsigned char* m_pData;
+    size_t m_Bytes;
+    size_t m_Offset;
+};
+
+#endif //__LIDAR_LOG_H__
@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
+#include <memory>
 #include <zmq.h>
 #include <czmq.h>
 #include <termios.h>
@@ -21,6 +22,23 @@
 #include "lidar.h"
 #include "tmath.h"
 #include "path.h"
+#include "timing.h"
+#include "history.h"
+#include "scanstream.h"
+#include "odometry.h"
+#include "scanfilter.h"
+#include "obstacle.h"
+#include "scanslam.h"
+#include "maprender.h"
+#include "mapfile.h"
+#include "pathfile.h"
+#include "rateloop.h"
+#include "trace.h"
+#include "rmhc.h"
+#include "lidarlog.h"
+#include "poseekf.h"
+#include "posegraph.h"
+#include "mcl.h"
 
 #define TJE_IMPLEMENTATION
 #include "tiny_jpeg/tiny_jpeg.h"
@@ -109,6 +127,17 @@ struct AxisRecord
     uint64_t tick;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// The throttle and steering actually applied to the car, -1 to 1
+
+struct ControlRecord
+{
+    ControlRecord() : throttle(0.0f), steering(0.0f), tick(0) {}
+    float throttle;
+    float steering;
+    uint64_t tick;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // A record of the last button input, -1 means not set
 
@@ -150,6 +179,8 @@ struct ImageRecord
 struct LidarRecord
 {
     LidarRetSet m_Set;
+    LidarScanSoA m_Soa;
+    LidarBinnedScan m_Bins;     //filtered, one range per half degree
     uint64_t tick;
 };
 
@@ -162,6 +193,10 @@ struct SLAMRecord
     double m_posX_mm;
     double m_posY_mm;
     double m_theta_deg;
+    float m_speed_mm_s;         //motion used to de-skew the scan
+    float m_yaw_rate_deg_s;
+    float m_cov[3][3];          //x, y mm, theta deg. zero when the backend has none
+    float m_score;              //match quality 0 to 1, 1 when the backend has none
     uint64_t tick;
 };
 
@@ -251,8 +286,14 @@ RingBuffer<ButtonRecord, 10> g_ButtonInput;
 //Ring buffer of axis inputs for predictions
 RingBuffer<AxisRecord, 10> g_PredInput;
 
-//Our ring buffer of images
-RingBuffer<ImageRecord, 3> g_Images;
+//Our time indexed history of images
+HistoryBuffer<ImageRecord> g_Images;
+
+//History of the controls applied to the car, for odometry
+HistoryBuffer<ControlRecord> g_Controls;
+
+//Throttle override tripped by the lidar, applied by the robot thread
+ObstacleLatch g_ObstacleLatch;
 
 //Our ring buffer of lidar
 RingBuffer<LidarRecord, 3> g_LidarInput;
@@ -260,11 +301,31 @@ RingBuffer<LidarRecord, 3> g_LidarInput;
 //SLAM position output
 RingBuffer<SLAMRecord, 3> g_SLAMOutput;
 
+//Pose filter output, at a much higher rate than SLAM. Kept as a history so
+//consumers can ask where the car was, or will be, at a given tick.
+HistoryBuffer<PoseEstimate> g_PoseOutput;
+
+//Occupancy map built by whichever SLAM backend is running
+OccupancyMap g_OccupancyMap;
+
+//true when the map came from slam_map_file, and the car has to be found in it
+bool g_bSavedMapLoaded = false;
+
+//where the saved map says the car was left, to start looking for it there.
+ScanPose g_SavedMapStart;
+
+//Pose graph back end, and the map it redraws from key scans at their
+//optimized poses. When it runs, published poses are in its frame, so that's
+//the map to show and save.
+LoopCloser g_LoopCloser;
+OccupancyMap g_CorrectedMap;
+OccupancyMap* g_pSlamMap = &g_OccupancyMap;
+
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
 ///////////////////////////////////////////////////////////////////////////////
-// set max image size
+// set image history depth and max image size
 
 void InitImageRecordSize(Config& conf)
 {
@@ -275,6 +336,19 @@ void InitImageRecordSize(Config& conf)
 
     uint64_t len = (rows * cols * ch);
 
+    //keep enough history for the deepest stack a consumer asks for, plus
+    //a couple of frames so the writer doesn't lap a batch being read.
+    int depth = conf.GetInt("image_history_depth", 32);
+    int stack = conf.GetInt("predict_stack_frames", 1);
+
+    if(depth < stack + 2)
+        depth = stack + 2;
+
+    uint64_t retain_usec = (uint64_t)conf.GetInt("image_history_window_ms", 1000) * 1000;
+
+    //must happen before images are allocated, as the history owns the records.
+    g_Images.Init(depth, retain_usec);
+
     for(int iR = 0; iR < g_Images.Size(); iR++ )
         g_Images.m_Buffer[iR].InitImage(len);
 }
@@ -404,6 +478,8 @@ void* ProcessJoyStick(void* args)
 
     Joystick joystick;
 
+    TraceSetThreadName("js");
+
     const char* js_path = conf->GetStr("js_path", "/dev/input/js0");
 
     //set debug flag to see all output from js echoed to console
@@ -461,7 +537,7 @@ void* ProcessJoyStick(void* args)
                 r.state = event.value;
                 r.tick = clock();
                 g_ButtonInput.Write(r);
-                printf("Button %u is %s\n", event.number, event.value == 0 ? "up" : "down");
+                TRACE(TRACE_DEBUG, "Button %u is %s\n", event.number, event.value == 0 ? "up" : "down");
             }
             else if (event.isAxis() && 
                 !doIgnoreAxis(ignoreAxis, numIgnoreAxis, event.number))
@@ -469,7 +545,7 @@ void* ProcessJoyStick(void* args)
                 if(event.number == axisSteer)
                 {
                     if(bVerbose)
-                        printf("steer: %d\n", event.value);
+                        TRACE(TRACE_INFO, "steer: %d\n", event.value);
     
                     record.steer = event.value * axisSteerMult;
                     record.tick = clock();
@@ -478,7 +554,7 @@ void* ProcessJoyStick(void* args)
                 else if(event.number == axisThrottle)
                 {
                     if(bVerbose)
-                        printf("throttle: %d\n", event.value);
+                        TRACE(TRACE_INFO, "throttle: %d\n", event.value);
     
                     //we reverse the throttle so Up is forward.
                     record.throttle = event.value * -1;
@@ -490,7 +566,7 @@ void* ProcessJoyStick(void* args)
 
         if(!joystick.isFound())
         {
-            printf("we lost the joystick!\n");
+            TRACE(TRACE_ERROR, "we lost the joystick!\n");
         }
 
         if(bShowFPS)
@@ -615,7 +691,7 @@ void* ProcessRaspiCamera(void* args)
                 }
 
                 //stamp image with time stamp
-                img.tick = clock();
+                img.tick = get_time_usec();
                 
                 //advance the read head
                 g_Images.FinishWrite();
@@ -827,7 +903,7 @@ void process_image(const void *p, int size, void* userData)
        
     }
 
-    v4lImage.tick = clock();
+    v4lImage.tick = get_time_usec();
 
     g_Images.FinishWrite();
 
@@ -938,7 +1014,7 @@ void process_pg_image(const void *p, int size, void* userData)
             pDestImage[iDest].b = pSrcImage[iSrc].r;
         }
 
-    pgCamImage.tick = clock();
+    pgCamImage.tick = get_time_usec();
 
     g_Images.FinishWrite();
 
@@ -1048,6 +1124,30 @@ void ensureLogDir(const char* logDir)
 ///////////////////////////////////////////////////////////////////////////////
 // Save images and axis input pairs. 
 
+//write the scans and controls that came in since the last call.
+void log_lidar_and_controls(LidarLogWriter& lidarLog, uint64_t& last_scan, uint64_t& last_control,
+    std::vector<ControlRecord*>& controls)
+{
+    int numControls = g_Controls.GetLatest((int)controls.size(), &controls[0]);
+
+    for(int iC = 0; iC < numControls; iC++)
+    {
+        if(controls[iC]->tick <= last_control)
+            continue;
+
+        lidarLog.WriteControl(controls[iC]->throttle, controls[iC]->steering, controls[iC]->tick);
+        last_control = controls[iC]->tick;
+    }
+
+    LidarRecord* pScan = g_LidarInput.ReadRef();
+
+    if(pScan != NULL && pScan->tick != last_scan)
+    {
+        last_scan = pScan->tick;
+        lidarLog.WriteScan(pScan->m_Set, pScan->tick);
+    }
+}
+
 void* ProcessLogger(void * args)
 {
     Config* conf = (Config*)args;
@@ -1085,6 +1185,14 @@ void* ProcessLogger(void * args)
     float loggerFpsLimit = 1.0f / conf->GetInt("logger_fps_limit", 60);
     uint64_t lastLog = 0;
 
+    //lidar scans and controls, for building maps offline with shark_mapper.
+    bool bLogLidar = conf->GetInt("log_lidar", 0);
+    LidarLogWriter lidarLog;
+    char lidarLogFilename[MAX_PATH_LEN];
+    uint64_t last_lidar_log = 0;
+    uint64_t last_control_log = 0;
+    std::vector<ControlRecord*> controls(g_Controls.Size());
+
     while (programRunning)
     {
         // Restrict rate
@@ -1155,7 +1263,25 @@ void* ProcessLogger(void * args)
             if(bShowFPS)
                 profile.OnFrameIter();  
         }
-        
+
+        if(bLogLidar)
+        {
+            //a new log each time recording is switched on.
+            if(doRecord && !lidarLog.IsOpen())
+            {
+                sprintf(lidarLogFilename, "%s/lidar_%08d.bin", logDir, iRecord);
+
+                if(lidarLog.Open(lidarLogFilename))
+                    printf("logging lidar to %s\n", lidarLogFilename);
+            }
+            else if(!doRecord && lidarLog.IsOpen())
+            {
+                lidarLog.Close();
+            }
+
+            if(lidarLog.IsOpen())
+                log_lidar_and_controls(lidarLog, last_lidar_log, last_control_log, controls);
+        }
     }
 
     return NULL;
@@ -1194,6 +1320,7 @@ void LoadCarConfigs(Config* conf,
 
     boardConfig.i2c_address = hex_str_to_int(conf->GetStr("pwm_ic2_address", "0x40"));
     boardConfig.device_file = conf->GetStr("pwm_device_file", boardConfig.device_file.c_str());
+    boardConfig.bus_hz = conf->GetInt("pwm_i2c_bus_hz", boardConfig.bus_hz);
 }
 
 int getkey() {
@@ -1337,6 +1464,8 @@ void* ProcessRobot(void * args)
     }
     
 
+    TraceSetThreadName("robot");
+
     Car car;
     PwmServoConfig steeringConfig;
     PwmEscConfig escConfig;
@@ -1358,12 +1487,28 @@ void* ProcessRobot(void * args)
     //scale inputs from joystick on this axis range
     float axisRange = conf->GetFloat("js_axis_scale", 32767.0f);
 
-    //while this is non zero, we are letting the prediction steer
-    int predSteer = 0;
-    int predThrottle = 0;
+    //until these ticks, we are letting the prediction steer. By time, not
+    //passes, since an obstacle stop can wake the loop early.
+    uint64_t predHoldUsec = (uint64_t)(conf->GetFloat("robot_pred_hold_ms", 600.0f) * 1000.0f);
+    uint64_t predSteerUntil = 0;
+    uint64_t predThrottleUntil = 0;
+
+    //what we last sent to the car
+    ControlRecord control;
+
+    //throttle asked for by the user or prediction, before any obstacle stop
+    float requestedThrottle = 0.0f;
 
     Profiler profile("Robot", 300);
 
+    RateLoop loop;
+    loop.Init("Robot", conf->GetFloat("robot_period_ms", 10.0f), conf->GetFloat("debug_loop_stats_s", 10.0f));
+
+    //how busy we keep the i2c bus, printed along with the loop stats.
+    float busStatsSec = conf->GetFloat("debug_loop_stats_s", 10.0f);
+    uint64_t lastBusStats = get_time_usec();
+    car.getPCA9685()->resetStats();
+
     if(bCarBootStatus)
         car.printStatus();
 
@@ -1371,48 +1516,66 @@ void* ProcessRobot(void * args)
     {
         while(programRunning)
         {
-             // Restrict rate
-            usleep(10000);
+            // Hold the rate. An obstacle stop wakes us early.
+            g_ObstacleLatch.WaitUntil(loop.BeginWait());
+            loop.EndWait();
+
+            uint64_t now = get_time_usec();
 
             if(g_PredInput.Read(pred) && lastPred != pred.tick)
             {
                 lastPred = pred.tick;
 
                 float steering = (float)pred.steer / axisRange;
-                printf("pred_steering: %f\n", steering);
-                car.setSteering(steering);
+                TRACE(TRACE_DEBUG, "pred_steering: %f\n", steering);
+                control.steering = steering;
 
-                predSteer = 60;
+                predSteerUntil = now + predHoldUsec;
 
                 float throttle = (float)pred.throttle / axisRange;
-                printf("pred_throttle: %f\n", throttle);
-                car.setThrottle(throttle);
+                TRACE(TRACE_DEBUG, "pred_throttle: %f\n", throttle);
+                requestedThrottle = throttle;
 
                 //zero throttle means user can interact
                 if( throttle != 0.0f)
-                    predThrottle = 60;
+                    predThrottleUntil = now + predHoldUsec;
             }
 
-            if(predSteer > 0)
-                predSteer--;
-            if(predThrottle > 0)
-                predThrottle--;
-
             if(g_AxisInput.Read(axis))
             {
                 float throttle = (float)axis.throttle / axisRange;
                 float steering = (float)axis.steer / axisRange;
 
                 //allow prediction to win when steering.
-                if(predSteer == 0)
-                    car.setSteering(steering);
+                if(now >= predSteerUntil)
+                {
+                    control.steering = steering;
+                }
 
                 //we always control throttle for now.
-                if(predThrottle == 0)
+                if(now >= predThrottleUntil)
                 {  
-                    car.setThrottle(throttle);
+                    requestedThrottle = throttle;
                 }
             }
+
+            //all throttle goes through here, so the obstacle stop can't be missed.
+            //Steering goes with it, in the same bus transfer.
+            now = get_time_usec();
+            control.throttle = g_ObstacleLatch.Limit(requestedThrottle, now);
+            //a stop only lands when the throttle register really changes.
+            if(car.setControls(control.steering, control.throttle))
+                g_ObstacleLatch.OnThrottleWritten(get_time_usec());
+
+            control.tick = now;
+            g_Controls.Write(control);
+
+            if(busStatsSec > 0.0f && get_sec_diff_usec(now, lastBusStats) >= busStatsSec)
+            {
+                car.getPCA9685()->printStats();
+                car.getPCA9685()->resetStats();
+                lastBusStats = now;
+            }
             
             if(bShowFPS)
                 profile.OnFrameIter();
@@ -1438,10 +1601,18 @@ void* ProcessKerasPredictions(void * args)
 
     AxisRecord axis;
     ButtonRecord button;
-    ImageRecord image;
     uint64_t last_button = 0;
     uint64_t last_image = 0;
 
+    //temporal models take the last N frames stacked. We send them straight
+    //out of the image history as one multipart message, without copying.
+    int num_stack = conf->GetInt("predict_stack_frames", 1);
+
+    if(num_stack < 1)
+        num_stack = 1;
+
+    std::vector<ImageRecord*> stack(num_stack);
+
     int img_port = conf->GetInt("keras_predict_server_img_port", 9090);
     void *context = zmq_ctx_new ();
     void *socket = zmq_socket (context, ZMQ_REQ);
@@ -1511,13 +1682,17 @@ void* ProcessKerasPredictions(void * args)
             }
         }
 
-        if(doPredict && g_Images.Read(image) && image.tick != last_image)
+        if(doPredict && g_Images.GetLatest(num_stack, &stack[0]) == num_stack 
+            && stack[num_stack - 1]->tick != last_image)
         {
             //keep track of last image read
-            last_image = image.tick;
+            last_image = stack[num_stack - 1]->tick;
+
+            //send images to predictor, oldest first. The last frame ends the message.
+            for(int iFrame = 0; iFrame < num_stack - 1; iFrame++)
+                zmq_send(socket, stack[iFrame]->image, max_image_len, ZMQ_SNDMORE);
 
-            //send image to predictor
-            send_message(socket, image.image, max_image_len);
+            send_message(socket, stack[num_stack - 1]->image, max_image_len);
 
             //receive steering and throttle. This will block.
             int count = zmq_recv (socket, buffer, 1024, 0);
@@ -1553,7 +1728,20 @@ void* ProcessKerasPredictions(void * args)
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// Reply to webserver with updates from our camera
+// JPEG encode into a memory buffer, so it can be sent without touching disk
+
+void jpeg_write_to_buffer(void* context, void* data, int size)
+{
+    std::vector<unsigned char>* pBuffer = (std::vector<unsigned char>*)context;
+    const unsigned char* pData = (const unsigned char*)data;
+    pBuffer->insert(pBuffer->end(), pData, pData + size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publish camera updates to any number of web viewers.
+// Each new frame is JPEG encoded once and pushed out on a PUB socket. The socket
+// conflates and keeps a high water mark of one, so a viewer that can't keep up
+// just misses frames. A slow client never holds up the robot.
 
 void* ProcessWebUpdate(void * args)
 {
@@ -1564,73 +1752,95 @@ void* ProcessWebUpdate(void * args)
     if(bVerboseWeb)
         printf("verbose web integration messages enabled.\n");
 
-    ImageRecord image;
     uint64_t last_image = 0;
+    uint64_t last_publish = 0;
     int web_img_port = conf->GetInt("web_image_port", 9191);
     void *context = zmq_ctx_new ();
-    void *socket = zmq_socket (context, ZMQ_REP);
+    void *socket = zmq_socket (context, ZMQ_PUB);
+
+    //only ever queue the latest frame for each subscriber.
+    int one = 1;
+    int linger = 0;
+    zmq_setsockopt(socket, ZMQ_SNDHWM, &one, sizeof(one));
+    zmq_setsockopt(socket, ZMQ_CONFLATE, &one, sizeof(one));
+    zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+
     char connection[MAX_STR_LEN];
     sprintf(connection, "tcp://*:%d", web_img_port);
-    printf("listening for web image requests on: %s\n", connection);
+    printf("publishing web images on: %s\n", connection);
     zmq_bind(socket, connection);
-    char buffer [1024];
 
     //Init image dimensions
     const int rows = conf->GetInt("row", 120);
     const int cols = conf->GetInt("col", 160);
     const int ch = conf->GetInt("ch", 3);
-    const int max_image_len = rows * cols * ch;
 
+    //cap the rate we encode at. Viewers rarely need the full camera rate.
+    int max_fps = conf->GetInt("web_stream_max_fps", 30);
+    uint64_t min_publish_usec = max_fps > 0 ? 1000000 / max_fps : 0;
+
+    //tiny jpeg quality: 1, 2 or 3 where 3 is highest.
+    int quality = conf->GetInt("web_stream_jpeg_quality", 2);
+
+    std::vector<unsigned char> jpeg;
+    jpeg.reserve(rows * cols * ch);
 
     while(programRunning)
     {
-        //this just blocks until it gets a request.
-        int count = zmq_recv (socket, buffer, 1024, 0);
+        // Restrict rate
+        usleep(1000);
 
-        if(bVerboseWeb)
-            printf("got web request for image\n");
+        ImageRecord* pImage = g_Images.ReadRef();
 
-        //wait for a new image. not likely very long, unless
-        //camera is down.
-        while(!g_Images.Read(image))
-        {
-            usleep(10000);
+        if(pImage == NULL || pImage->tick == last_image)
+            continue;
 
-            if(bVerboseWeb)
-                printf("web request waiting for image\n");
+        uint64_t now = get_time_usec();
 
-        }
+        if(now - last_publish < min_publish_usec)
+            continue;
 
         //keep track of last image read
-        last_image = image.tick;
+        last_image = pImage->tick;
+        last_publish = now;
 
-        if(bVerboseWeb)
-            printf("web request sending image\n");
+        jpeg.clear();
 
-        //send image to web server
-        send_message(socket, image.image, max_image_len);
+        if(!tje_encode_with_func(jpeg_write_to_buffer, &jpeg, quality, cols, rows, ch, 
+            (const unsigned char*)pImage->image))
+        {
+            fprintf(stderr, "Could not encode web JPEG\n");
+            continue;
+        }
+
+        //never block. When no one is listening, the message is dropped.
+        zmq_send(socket, &jpeg[0], jpeg.size(), ZMQ_DONTWAIT);
 
         if(bVerboseWeb)
-            printf("web request sent image\n");
+            printf("web published image %d bytes\n", (int)jpeg.size());
     }
+
+    zmq_close(socket);
+    zmq_ctx_destroy(context);
+
+    return NULL;
 }
 
 void LidarReturnToImage(const LidarRecord& lidarReturn, unsigned char* pImage, int width, int height, int depth)
 {
     memset(pImage, 0, width * height * depth);
 
+    const LidarScanSoA& soa = lidarReturn.m_Soa;
     int centerX = width / 2;
     int centerY = height / 2;
     float longestReturn = 0.0f;
     static float scale = 1.0f;
     int end_image = width * height * depth;
     
-    for(int iRec = 0; iRec < lidarReturn.m_Set.m_Count; iRec++)
+    for(int iRec = 0; iRec < soa.m_Count; iRec++)
     {
-        const LidarRet& ret = lidarReturn.m_Set.m_Returns[iRec];
-
-        if(ret.GetDistance() > longestReturn)
-            longestReturn = ret.GetDistance();
+        if(soa.m_Range[iRec] > longestReturn)
+            longestReturn = soa.m_Range[iRec];
     }
 
     //set the scale such that we can handle the longest return value
@@ -1639,24 +1849,14 @@ void LidarReturnToImage(const LidarRecord& lidarReturn, unsigned char* pImage, i
     if (scale == 1.0f)
         scale = centerX / (longestReturn + 1.0);
 
-    //convert degrees to radians
-    const float deg_to_rad = PI / 180.0f;
-
-    //the image looks better when forward returns are up in the image, not to the right.
-    const float theta_offset = -90.0f * deg_to_rad;
-
-    //transform polar coordinates to image coordinates
+    //transform lidar coordinates to image coordinates. The image looks better
+    //when forward returns are up in the image, not to the right. So we rotate
+    //by -90 degrees, which is just a swap of x and y.
 
-    for(int iRec = 0; iRec < lidarReturn.m_Set.m_Count; iRec++)
+    for(int iRec = 0; iRec < soa.m_Count; iRec++)
     {
-        const LidarRet& ret = lidarReturn.m_Set.m_Returns[iRec];
-
-        float d = ret.GetDistance() * scale;
-
-        float theta = ret.GetAngle() * deg_to_rad + theta_offset;
-
-        int x = cosf(theta) * d;
-        int y = sinf(theta) * d;
+        int x = soa.m_Y[iRec] * scale;
+        int y = -soa.m_X[iRec] * scale;
 
         int offset = ((centerX + x) + (centerY + y) * width) * depth;
 
@@ -1701,14 +1901,146 @@ const int lidar_image_ch = 3;//conf->GetInt("ch", 3);
 const int lidar_image_max_image_len = lidar_image_rows * lidar_image_cols * lidar_image_ch;
 unsigned char lidar_image[lidar_image_max_image_len];
 
-Path* g_pPID_Path = NULL;
+//the PID thread's path, as a copy other threads can hold on to while the
+//PID thread carries on changing its own. A new copy is swapped in after
+//every change and never touched after, so readers need no lock.
+std::shared_ptr<const Path> g_PublishedPath;
+
+void publish_path(const Path& path)
+{
+    std::shared_ptr<const Path> snapshot;
+
+    if(!path.m_nodes.empty())
+        snapshot = std::make_shared<const Path>(path);
+
+    std::atomic_store(&g_PublishedPath, snapshot);
+}
+
+//draw the slam map, with the car and the path, into the lidar web image.
+void RenderSlamDebugMap(MapRenderer& renderer, unsigned char* pImage)
+{
+    SLAMRecord sr;
+    bool bHavePose = g_SLAMOutput.Read(sr);
+
+    //wait for slam to tell us where the car started.
+    if(!renderer.HasCenter())
+    {
+        if(!bHavePose)
+        {
+            memset(pImage, 0, lidar_image_max_image_len);
+            return;
+        }
+
+        renderer.SetCenter((float)sr.m_posX_mm, (float)sr.m_posY_mm);
+    }
+
+    renderer.Update(*g_pSlamMap);
+    renderer.ToRGB(pImage);
+
+    //draw path. Ours to keep until we let go of it.
+    std::shared_ptr<const Path> pPath = std::atomic_load(&g_PublishedPath);
+
+    if(pPath && pPath->m_nodes.size() > 1)
+    {
+        int numNodes = (int)pPath->m_nodes.size();
+
+        for(int iP = 0; iP < numNodes - 1; iP++)
+        {
+            const PathNode& a = pPath->m_nodes[iP];
+            const PathNode& b = pPath->m_nodes[iP + 1];
+            Vector2 pt = a.pos;
+            int steps = 2;
+            Vector2 delta = (b.pos - a.pos) * (1.0f / steps);
+
+            for(int iStep = 0; iStep < steps; iStep++)
+            {
+                renderer.Plot(pImage, pt.x, pt.y, 0, 255, 0);
+                pt = pt + delta;
+            }
+        }
+    }
+
+    //a red point for the robot location
+    if(bHavePose)
+        renderer.Plot(pImage, (float)sr.m_posX_mm, (float)sr.m_posY_mm, 255, 0, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publish the compact polar scan for the browser to draw. A small fraction of
+// the bytes of the rendered image, and no rasterizing on the robot.
+
+void PublishWebLidarScans(Config* conf)
+{
+    int web_lidar_port = conf->GetInt("web_lidar_port", 9192);
+    void *context = zmq_ctx_new ();
+    void *socket = zmq_socket (context, ZMQ_PUB);
+
+    //deltas need every message, so allow a short queue. A client that falls
+    //further behind than this drops messages and waits for a keyframe.
+    int hwm = 32;
+    int linger = 0;
+    zmq_setsockopt(socket, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+    zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+
+    char connection[MAX_STR_LEN];
+    sprintf(connection, "tcp://*:%d", web_lidar_port);
+    printf("publishing web lidar scans on: %s\n", connection);
+    zmq_bind(socket, connection);
+
+    ScanStreamEncoder encoder;
+    encoder.SetParams(conf->GetInt("web_lidar_range_quant_mm", 10),
+        conf->GetInt("web_lidar_keyframe_interval", 10));
+
+    std::vector<unsigned char> msg;
+    uint64_t last_scan = 0;
+
+    while(programRunning)
+    {
+        LidarRecord* pScan = g_LidarInput.ReadRef();
+
+        if(pScan == NULL || pScan->tick == last_scan)
+        {
+            usleep(5000);
+            continue;
+        }
+
+        last_scan = pScan->tick;
+
+        //send the slam pose along when we have one.
+        SLAMRecord sr;
+        ScanStreamPose pose;
+        ScanStreamPose* pPose = NULL;
+
+        if(g_SLAMOutput.Read(sr))
+        {
+            pose.x_mm = (float)sr.m_posX_mm;
+            pose.y_mm = (float)sr.m_posY_mm;
+            pose.theta_deg = (float)sr.m_theta_deg;
+            pPose = &pose;
+        }
+
+        encoder.Encode(pScan->m_Bins, pScan->tick, pPose, msg);
 
-//are we hijacking the lidar web image to write our SLAM map..
-bool bSlamToLidarImage = false;
+        zmq_send(socket, &msg[0], msg.size(), ZMQ_DONTWAIT);
+    }
+
+    zmq_close(socket);
+    zmq_ctx_destroy(context);
+}
 
 void* ProcessWebLidar(void * args)
 {
     Config* conf = (Config*)args;  
+
+    //"scan" sends the compact polar scan. "image" renders a 512x512 image here.
+    const char* mode = conf->GetStr("web_lidar_stream_mode", "image");
+
+    if(strcmp(mode, "scan") == 0)
+    {
+        PublishWebLidarScans(conf);
+        return NULL;
+    }
+
     LidarRecord lidarReturn;
     uint64_t last_image = 0;
     int web_lidar_port = conf->GetInt("web_lidar_port", 9192);
@@ -1720,6 +2052,14 @@ void* ProcessWebLidar(void * args)
     zmq_bind(socket, connection);
     char buffer [1024];
 
+    //when we have slam, its map takes over the lidar web image. It's only
+    //drawn when asked for, and then only the parts that changed.
+    bool bSlamMap = conf->GetInt("slam_output_debug_map", 0);
+    MapRenderer renderer;
+
+    if(bSlamMap)
+        renderer.Init(conf, *g_pSlamMap, lidar_image_cols, lidar_image_rows);
+
     //Init image dimensions
     while(programRunning)
     {
@@ -1736,7 +2076,11 @@ void* ProcessWebLidar(void * args)
         //keep track of last image read
         last_image = lidarReturn.tick;
 
-        if(!bSlamToLidarImage)
+        if(bSlamMap)
+        {
+            RenderSlamDebugMap(renderer, lidar_image);
+        }
+        else
         {
             //Transform lidar return into an image
             LidarReturnToImage(lidarReturn, lidar_image, lidar_image_rows, lidar_image_cols, lidar_image_ch);
@@ -1745,263 +2089,556 @@ void* ProcessWebLidar(void * args)
         //send image to web server
         send_message(socket, lidar_image, lidar_image_max_image_len);
     }
+
+    return NULL;
 }
 
-#if ENABLE_BRZY_SLAM
+///////////////////////////////////////////////////////////////////////////////
+// Shared by the SLAM backends
 
-#include <BreezySLAM/Position.hpp>
-#include <BreezySLAM/Velocities.hpp>
-#include <BreezySLAM/Laser.hpp>
-#include <BreezySLAM/algorithms.hpp>
+//wait for a scan newer than last_tick
+void wait_for_slam_scan(LidarRecord& lidarReturn, uint64_t& last_tick)
+{
+    while(!g_LidarInput.Read(lidarReturn) || last_tick == lidarReturn.tick)
+    {
+        usleep(10000);
+    }
 
-//We define a RPLidar object from the base Laser to provide
-//specifics about our scanning hardware.
+    last_tick = lidarReturn.tick;
+}
 
-class RPLidar : public Laser
+//motion over the scan, from the controls applied during it and the pose history.
+MotionEstimate estimate_scan_motion(const LidarRecord& lidarReturn, const OdometryEstimator& odometry,
+    std::vector<ControlRecord*>& controls)
 {
-    public:
+    //average the controls applied over the revolution.
+    float throttle = 0.0f, steering = 0.0f;
+    int numControls = g_Controls.GetLatest((int)controls.size(), &controls[0]);
+    int numInScan = 0;
 
-    enum constants
+    for(int iC = 0; iC < numControls; iC++)
     {
-        NUM_RAYS_PER_SCAN = 360 * 2, //half angle per ray
-        SCAN_RATE_HZ = 10,  //data rate depends on motor speed. this is about right for default.
-        DETECTION_ANGLE_DEGREES = 360, //Some lidars scan just a portion, this scans 360
-        DISTANCE_NO_DETECTION_MM = 10000, //6M according to RobotShop. Seems longer.
-        WALL_THICKNESS = 300, //Affects the width of returns when making the map.
-    };
+        if(controls[iC]->tick < lidarReturn.m_Set.m_StartTick || controls[iC]->tick > lidarReturn.tick)
+            continue;
 
-    RPLidar(int detection_margin = 0, float offset_mm = 0) : 
-        Laser(NUM_RAYS_PER_SCAN,
-         SCAN_RATE_HZ, 
-         DETECTION_ANGLE_DEGREES, 
-         DISTANCE_NO_DETECTION_MM, 
-         detection_margin, offset_mm) { }
-    
-};
+        throttle += controls[iC]->throttle;
+        steering += controls[iC]->steering;
+        numInScan++;
+    }
 
-#endif
+    if(numInScan > 0)
+    {
+        throttle /= numInScan;
+        steering /= numInScan;
+    }
+    else if(numControls > 0)
+    {
+        throttle = controls[numControls - 1]->throttle;
+        steering = controls[numControls - 1]->steering;
+    }
 
-//x and y in mm
-void plotToLidarDebugMap(double x_mm, double y_mm, Color8 col, double map_size_meters)
+    return odometry.Estimate(throttle, steering);
+}
+
+//what the backends keep between scans to get the next one ready to match.
+struct SlamScanPrep
 {
-    //plot a red point for the robot location
-    int px = (int)(((x_mm / 1000.0f) / map_size_meters)  *  lidar_image_cols);
-    int py = (int)(((y_mm / 1000.0f) / map_size_meters)  *  lidar_image_rows);
+    bool bDeskew;
 
-    int iPixel = ((py * lidar_image_rows) + px);
+    //de-skewing moves returns between bins, so then we filter our own copy.
+    ScanFilter filter;
+    LidarBinnedScan deskewed;
 
-    if(iPixel < (lidar_image_rows * lidar_image_cols))
-    {
-        Pixel* pLidarMap = (Pixel*)lidar_image;
-        Pixel* pPos = pLidarMap + iPixel;
+    OdometryEstimator odometry;
+    std::vector<ControlRecord*> controls;
 
-        pPos->r = col.r;
-        pPos->g = col.g;
-        pPos->b = col.b;
-    }
-}
+    uint64_t last_tick;
+    uint64_t last_scan;
+};
 
-///////////////////////////////////////////////////////////////////////////////
-// Process Lidar to product map - SLAM
+void init_slam_scan_prep(Config* conf, SlamScanPrep& prep)
+{
+    //correct for the car moving during the revolution
+    prep.bDeskew = conf->GetInt("slam_deskew", 1);
+    prep.filter.Init(conf);
+    prep.odometry.Init(conf);
+    prep.controls.resize(g_Controls.Size());
+    prep.last_tick = 0;
+    prep.last_scan = 0;
+}
 
-void* ProcessSLAM(void * args)
+//wait for the next scan and get it ready to match. Gives the motion over the
+//scan and the time since the last one, and returns the bins to match, either
+//lidarReturn's own or the de-skewed copy.
+const LidarBinnedScan& next_slam_scan(SlamScanPrep& prep, LidarRecord& lidarReturn, MotionEstimate& motion, float& dt)
 {
-#if ENABLE_BRZY_SLAM
+    wait_for_slam_scan(lidarReturn, prep.last_tick);
 
-//https://github.com/simondlevy/BreezySLAM
+    motion = estimate_scan_motion(lidarReturn, prep.odometry, prep.controls);
+    const LidarBinnedScan* pBins = &lidarReturn.m_Bins;
 
-    Config* conf = (Config*)args;  
-    LidarRecord lidarReturn;
-    uint64_t last_image = 0;
-    float offsetCarCenterMM = 100.0f;
+    //move all returns to where they'd be seen from the end of the scan.
+    if(prep.bDeskew)
+    {
+        DeskewScan(lidarReturn.m_Soa, motion);
+        prep.filter.Filter(lidarReturn.m_Soa, prep.deskewed);
+        pBins = &prep.deskewed;
+    }
 
-    bool bShowSlamPos = conf->GetInt("slam_verbose_position", 0);
-    bool bOutputDebugMap = conf->GetInt("slam_output_debug_map", 0);
+    dt = prep.last_scan != 0 ? (float)get_sec_diff_usec(lidarReturn.tick, prep.last_scan) : 0.0f;
+    prep.last_scan = lidarReturn.tick;
+
+    return *pBins;
+}
+
+void publish_slam_pose(double x_mm, double y_mm, double theta_deg, const MotionEstimate& motion,
+    const float cov[3][3], float score, uint64_t tick)
+{
+    SLAMRecord sr;
+    sr.m_posX_mm = x_mm;
+    sr.m_posY_mm = y_mm;
+    sr.m_theta_deg = theta_deg;
+    sr.m_speed_mm_s = motion.speed_mm_s;
+    sr.m_yaw_rate_deg_s = motion.yaw_rate_deg_s;
+    sr.m_score = score;
+    sr.tick = tick;
+
+    if(cov != NULL)
+        memcpy(sr.m_cov, cov, sizeof(sr.m_cov));
+    else
+        memset(sr.m_cov, 0, sizeof(sr.m_cov));
+
+    //write to the output array
+    g_SLAMOutput.Write(sr);
+}
 
-    RPLidar* laser = new RPLidar(0, offsetCarCenterMM);
-    double map_size_meters = 20.0;
-    unsigned random_seed = 43;
+//hand the scan to the pose graph, and get the pose back in its frame.
+//Unplaced scans are left out of the graph.
+ScanPose correct_slam_pose(const ScanPose& p, const std::vector<ScanPoint>& points, const float cov[3][3],
+    bool bPlaced, uint64_t tick)
+{
+    if(!g_LoopCloser.IsEnabled())
+        return p;
 
-    int pixel_per_cm = map_size_meters * 100;
+    if(bPlaced)
+        g_LoopCloser.SubmitScan(p, points, cov, tick);
 
-    //dimension of map along one edge
-    int map_size_pixels = 512 * 8;
+    return g_LoopCloser.Correct(p);
+}
 
-    RMHC_SLAM* slam = new RMHC_SLAM(*laser, 
-        map_size_pixels,
-        map_size_meters, 
-        random_seed);
+///////////////////////////////////////////////////////////////////////////////
+// Built in correlative scan matching SLAM
 
-    Velocities vel;
+void* ProcessScanMatchSLAM(Config* conf)
+{
+    LidarRecord lidarReturn;
+    MotionEstimate motion;
+    float dt;
 
-    slam->hole_width_mm = RPLidar::WALL_THICKNESS;
+    bool bShowSlamPos = conf->GetInt("slam_verbose_position", 0);
 
-    int scan_mm[LidarRetSet::NUM_LIDAR_RETURNS];
+    SlamScanPrep prep;
+    init_slam_scan_prep(conf, prep);
 
-    unsigned char* map_pixels = new unsigned char[map_size_pixels * map_size_pixels];
+    ScanMatchSLAM slam;
+    slam.Init(conf, &g_OccupancyMap);
+    ScanMatchResult result;
 
-    if(map_pixels == NULL)
-    {
-        printf("failed to allocate the map pixels for slam.\n");
-        return NULL;
-    }
+    //with a saved map we have to find ourselves in it before tracking.
+    bool bRelocalize = g_bSavedMapLoaded;
+    float relocBudgetMS = conf->GetFloat("slam_reloc_budget_ms", 2000.0f);
 
     Profiler profile("SLAM", 100);
 
     while(programRunning)
     {
-        //wait for a new data
-        while(!g_LidarInput.Read(lidarReturn) || last_image == lidarReturn.tick)
-        {
-            usleep(10000);
-        }
+        const LidarBinnedScan& bins = next_slam_scan(prep, lidarReturn, motion, dt);
 
-        //keep track of last image read
-        last_image = lidarReturn.tick;
+        bool bMatched = false;
+
+        if(bRelocalize)
+        {
+            //we most likely booted where the car was parked when the map was saved.
+            if(!slam.Relocalize(bins, g_SavedMapStart, relocBudgetMS, result))
+            {
+                printf("couldn't find the car in the saved map, trying the next scan.\n");
+                continue;
+            }
 
-        if(LidarRetSet::NUM_LIDAR_RETURNS != lidarReturn.m_Set.m_Count)
+            bRelocalize = false;
+            bMatched = true;
+        }
+        else
         {
-            printf("wrong dimension for lidar scan_mm\n");
-            break;
+            bMatched = slam.Update(bins, motion, dt, result);
         }
 
-        //copy mm scan dist values into scan_mm
-        //printf("Lidar return. %d points.\n", lidarReturn.m_Set.m_Count);
+        const ScanPose& p = slam.GetPose();
 
-        //start with a clean buffer each time.
-        memset(scan_mm, 0, sizeof(scan_mm));
+        if(bShowSlamPos)
+            printf("slam pos- x: %f, y: %f, theta: %f, score: %f, sd x: %f, y: %f, theta: %f %s\n",
+                p.x_mm, p.y_mm, p.theta_deg, result.score,
+                sqrtf(result.cov[0][0]), sqrtf(result.cov[1][1]), sqrtf(result.cov[2][2]),
+                bMatched ? "" : "(odometry only)");
 
-        //We write the lidar return in the scan_mm buffer to send to the SLAM.
-        //The scan_mm buffer assumes a return on every half angle. But our device
-        //likes to return arbitrary angles for each return. So we will map each
-        //return to it's half angle slot in the buffer.
-        for(int iRec = 0; iRec < lidarReturn.m_Set.m_Count; iRec++)
-        {
-            const LidarRet& ret = lidarReturn.m_Set.m_Returns[iRec];
+        ScanPose c = correct_slam_pose(p, slam.GetPoints(), result.cov, bMatched, lidarReturn.tick);
+
+        publish_slam_pose(c.x_mm, c.y_mm, c.theta_deg, motion, result.cov, result.score, lidarReturn.tick);
+
+        prep.odometry.AddPose(p.x_mm, p.y_mm, p.theta_deg, lidarReturn.tick);
 
-            int dist_mm = ret.GetDistance();
+        profile.OnFrameIter();
+    }
 
-            //printf("i: %d d: %0.2f th: %0.2f\n", iRec, ret.GetDistance(), ret.GetAngle());
+    return NULL;
+}
 
-            //calculate a half angle integer. We use this as the offset
-            //into the scan buffer to store the disance return.
-            int iHalfAngle = (ret.GetAngle() * 2.0f) - 1;
+///////////////////////////////////////////////////////////////////////////////
+// Process Lidar to product map - SLAM
 
-            //bounds check and then write our distance into the scan buffer
-            if(iHalfAngle >= 0 && iHalfAngle < (LidarRetSet::NUM_LIDAR_RETURNS))
-                scan_mm[iHalfAngle] = dist_mm;
-        }
+void* ProcessRMHCSLAM(Config* conf)
+{
+    LidarRecord lidarReturn;
+    MotionEstimate motion;
+    float dt;
+
+    bool bShowSlamPos = conf->GetInt("slam_verbose_position", 0);
+
+    RMHCSlam slam;
+
+    if(!slam.Init(conf, &g_OccupancyMap))
+    {
+        printf("slam_type rmhc needs BreezySLAM, which this build doesn't have. Try correlative.\n");
+        return NULL;
+    }
 
-        //printf("\n\n");
+    SlamScanPrep prep;
+    init_slam_scan_prep(conf, prep);
+
+    Profiler profile("SLAM", 100);
+
+    while(programRunning)
+    {
+        const LidarBinnedScan& bins = next_slam_scan(prep, lidarReturn, motion, dt);
 
         //Do a pose match with previous maps and determine our location/orientation
-        //This can take velocity data if we have it at some point.
-        slam->update(scan_mm, vel);
+        slam.Update(bins, motion, dt);
 
         //Get our pose information
-        Position& p = slam->getpos();
+        const ScanPose& p = slam.GetPose();
 
         //our predicted position. Begins in the center of the map. with zero theta.
         if(bShowSlamPos)
-            printf("slam pos- x: %f, y: %f, theta: %f\n", p.x_mm, p.y_mm, p.theta_degrees);
+            printf("slam pos- x: %f, y: %f, theta: %f, speed: %f, yaw rate: %f\n", p.x_mm, p.y_mm, p.theta_deg,
+                motion.speed_mm_s, motion.yaw_rate_deg_s);
 
-        
-        SLAMRecord sr;
-        sr.m_posX_mm = p.x_mm;
-        sr.m_posY_mm = p.y_mm;
-        sr.m_theta_deg = p.theta_degrees;
-        sr.tick = clock();
+        ScanPose c = correct_slam_pose(p, slam.GetPoints(), NULL, true, lidarReturn.tick);
 
-        //write to the output array
-        g_SLAMOutput.Write(sr);
+        publish_slam_pose(c.x_mm, c.y_mm, c.theta_deg, motion, NULL, 1.0f, lidarReturn.tick);
 
-        if(bOutputDebugMap)
-        {
-            //get a map generated from matching returns w previous returns.
-            slam->getmap(map_pixels);
-
-            //when we have slam, it takes over lidar web image
-            bSlamToLidarImage = true;
-
-            //write this map over the lidar image
-            unsigned char* pSLAMMap = map_pixels;
-            Pixel* pLidarMap = (Pixel*)lidar_image;
-            Pixel* pLidarMapEnd = pLidarMap + (lidar_image_rows * lidar_image_cols);
-            unsigned char* pSLAMMapEnd = pSLAMMap + (map_size_pixels * map_size_pixels);
-            int stride_row_slam_map = map_size_pixels / lidar_image_rows;
-            int stride_col_slam_map = map_size_pixels;
-            int stride_col = (map_size_pixels / lidar_image_cols) - 1;
-            int iRow = 0;
-            while(pSLAMMap < pSLAMMapEnd && pLidarMap < pLidarMapEnd)
-            {
-                pLidarMap->r = *pSLAMMap;
-                pLidarMap->g = *pSLAMMap;
-                pLidarMap->b = *pSLAMMap;
+        prep.odometry.AddPose(p.x_mm, p.y_mm, p.theta_deg, lidarReturn.tick);
 
-                pLidarMap++;
-                pSLAMMap = pSLAMMap + stride_row_slam_map;
-                iRow++;
+        profile.OnFrameIter();
+    }
 
-                if(iRow == lidar_image_rows - 1)
-                {
-                    pSLAMMap = pSLAMMap + stride_col_slam_map * stride_col;
-                    iRow = 0;
-                }
-            }
-            
-            plotToLidarDebugMap(p.x_mm, p.y_mm, Color8(255, 0, 0), map_size_meters);
+    return NULL;
+}
 
-            //draw path.
-            if(g_pPID_Path != NULL && g_pPID_Path->m_nodes.size() > 1)
-            {
-                Color8 pathColor(0, 255, 0);
+///////////////////////////////////////////////////////////////////////////////
+// Localize in the saved map, without changing it
 
-                //printf("drawing path.\n");
-                int numNodes = (int)g_pPID_Path->m_nodes.size();
+void* ProcessMCL(Config* conf)
+{
+    if(!g_bSavedMapLoaded)
+    {
+        printf("slam_type mcl needs a map to localize in. Set slam_map_file to one saved from a mapping run.\n");
+        return NULL;
+    }
 
-                for(int iP = 0; iP < numNodes - 1; iP++)
-                {
-                    PathNode& a = g_pPID_Path->m_nodes[iP];
-                    PathNode& b = g_pPID_Path->m_nodes[iP + 1];
-                    Vector2 pt = a.pos;
-                    int steps = 2;
-                    Vector2 delta = (b.pos - a.pos) * (1.0f / steps);
-                    
-                    for(int iStep = 0; iStep < steps; iStep++)
-                    {
-                        plotToLidarDebugMap(pt.x, pt.y, pathColor, map_size_meters);
-                        pt = pt + delta;
-                    }
-                }
-            }
+    LidarRecord lidarReturn;
+    MotionEstimate motion;
+    float dt;
+
+    bool bShowSlamPos = conf->GetInt("slam_verbose_position", 0);
+
+    SlamScanPrep prep;
+    init_slam_scan_prep(conf, prep);
+
+    MonteCarloLocalizer mcl;
+
+    if(!mcl.Init(conf, g_OccupancyMap))
+    {
+        printf("the saved map is empty, nothing to localize in.\n");
+        return NULL;
+    }
+
+    //we most likely booted where the car was parked when the map was saved.
+    mcl.Reset(g_SavedMapStart);
+
+    float cov[3][3];
+
+    Profiler profile("SLAM", 100);
+
+    while(programRunning)
+    {
+        const LidarBinnedScan& bins = next_slam_scan(prep, lidarReturn, motion, dt);
+
+        mcl.Update(bins, motion, dt);
+
+        const ScanPose& p = mcl.GetPose();
+        mcl.GetCovariance(cov);
+
+        if(bShowSlamPos)
+            printf("mcl pos- x: %f, y: %f, theta: %f, score: %f, sd x: %f, y: %f, theta: %f, particles: %d\n",
+                p.x_mm, p.y_mm, p.theta_deg, mcl.GetScore(), sqrtf(cov[0][0]), sqrtf(cov[1][1]), sqrtf(cov[2][2]),
+                mcl.GetNumParticles());
+
+        publish_slam_pose(p.x_mm, p.y_mm, p.theta_deg, motion, cov, mcl.GetScore(), lidarReturn.tick);
+
+        prep.odometry.AddPose(p.x_mm, p.y_mm, p.theta_deg, lidarReturn.tick);
+
+        profile.OnFrameIter();
+    }
+
+    return NULL;
+}
+
+void* ProcessSLAM(void * args)
+{
+    Config* conf = (Config*)args;
+
+    //rmhc is BreezySLAM's random mutation hill climber. correlative is our own.
+    const char* slam_type = conf->GetStr("slam_type", "rmhc");
+
+    if(strcmp(slam_type, "correlative") == 0)
+        return ProcessScanMatchSLAM(conf);
+
+    if(strcmp(slam_type, "mcl") == 0)
+        return ProcessMCL(conf);
+
+    return ProcessRMHCSLAM(conf);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Pose graph back end. Closes loops and optimizes away from the SLAM thread,
+// then redraws the corrected map and swaps it in.
+
+void* ProcessPoseGraph(void * args)
+{
+    Config* conf = (Config*)args;
+
+    if(!g_LoopCloser.IsEnabled())
+        return NULL;
+
+    bool bVerbose = conf->GetInt("posegraph_verbose", 0);
+
+    //the saved map we started from, under everything we add this run.
+    OccupancyMap base, scratch;
+    base.Init(conf);
+    scratch.Init(conf);
+    base.CopyFrom(g_CorrectedMap);
+
+    int numDrawn = 0;
+
+    Profiler profile("PoseGraph", 100);
+
+    while(programRunning)
+    {
+        uint64_t start = get_time_usec();
+        bool bOptimized = false;
+
+        if(g_LoopCloser.Process(bOptimized) == 0)
+        {
+            usleep(20000);
+            continue;
+        }
+
+        if(bOptimized)
+        {
+            //everything moved. Redraw it all off to the side.
+            scratch.CopyFrom(base);
+            g_LoopCloser.DrawScans(scratch, 0);
+            g_CorrectedMap.Swap(scratch);
+
+            if(bVerbose)
+                printf("pose graph- %d key scans, %d loops, optimized and redrawn in %.0f ms\n",
+                    g_LoopCloser.GetNumNodes(), g_LoopCloser.GetNumLoops(),
+                    get_sec_diff_usec(get_time_usec(), start) * 1000.0);
+        }
+        else
+        {
+            g_LoopCloser.DrawScans(g_CorrectedMap, numDrawn);
         }
-     
+
+        numDrawn = g_LoopCloser.GetNumNodes();
+
         profile.OnFrameIter();
     }
 
-    delete[] map_pixels;
-    delete slam;
-    delete laser;
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fuse SLAM poses with the commanded motion, and publish a pose at a much
+// higher rate than the lidar gives us.
+
+void* ProcessPoseEstimate(void * args)
+{
+    Config* conf = (Config*)args;
+
+    if(!conf->GetInt("pose_ekf_enabled", 0))
+        return NULL;
+
+    int hz = conf->GetInt("pose_ekf_hz", 100);
+    bool bVerbose = conf->GetInt("pose_ekf_verbose", 0);
+
+    PoseEKF ekf;
+    ekf.Init(conf);
+
+    SLAMRecord sr;
+    uint64_t last_slam = 0;
+
+    Profiler profile("Pose", 1000);
+
+    RateLoop loop;
+    loop.Init("Pose", 1000.0f / (hz > 0 ? hz : 100), conf->GetFloat("debug_loop_stats_s", 10.0f));
+
+    while(programRunning)
+    {
+        //the command the car is driving on now.
+        float throttle = 0.0f, steering = 0.0f;
+        ControlRecord* pControl = g_Controls.ReadRef();
+
+        if(pControl != NULL)
+        {
+            throttle = pControl->throttle;
+            steering = pControl->steering;
+        }
+
+        uint64_t now = get_time_usec();
+        ekf.Predict(throttle, steering, now);
+
+        //each SLAM pose corrects the estimate back at the time of its scan.
+        if(g_SLAMOutput.Read(sr) && sr.tick != last_slam)
+        {
+            last_slam = sr.tick;
+
+            float cov_sum = sr.m_cov[0][0] + sr.m_cov[1][1];
+            ekf.Correct(sr.m_posX_mm, sr.m_posY_mm, sr.m_theta_deg, cov_sum > 0.0f ? sr.m_cov : NULL,
+                sr.m_score, sr.tick);
+
+            if(bVerbose)
+            {
+                PoseEstimate est;
+                ekf.GetEstimate(est);
+                printf("pose- slam x: %.0f, y: %.0f, theta: %.1f, filter x: %.0f, y: %.0f, theta: %.1f, "
+                    "speed scale: %.2f, rejected: %d\n", sr.m_posX_mm, sr.m_posY_mm, sr.m_theta_deg,
+                    est.x_mm, est.y_mm, est.theta_deg, est.speed_scale, ekf.GetNumRejected());
+            }
+        }
+
+        if(ekf.IsInitialized())
+        {
+            PoseEstimate& est = g_PoseOutput.BeginWrite();
+            ekf.GetEstimate(est);
+            g_PoseOutput.FinishWrite();
+        }
+
+        profile.OnFrameIter();
+
+        loop.Wait();
+    }
 
     return NULL;
+}
+
+//pose at any tick, from the filter history. Past the latest estimate, or
+//between two, we move on from the nearest with its speed and yaw rate.
+bool get_pose_at(uint64_t tick, PoseEstimate& pose)
+{
+    PoseEstimate* pNearest = g_PoseOutput.FindNearest(tick);
+
+    if(pNearest == NULL)
+        return false;
+
+    pose = *pNearest;
+
+    float dt = (float)get_sec_diff_usec(tick, pose.tick);
+    float heading = TMath::DegToRad((float)(pose.theta_deg + pose.yaw_rate_deg_s * dt * 0.5f));
 
-#endif //ENABLE_BRZY_SLAM
+    pose.x_mm += cosf(heading) * pose.speed_mm_s * dt;
+    pose.y_mm += sinf(heading) * pose.speed_mm_s * dt;
+    pose.theta_deg += pose.yaw_rate_deg_s * dt;
+    pose.tick = tick;
+
+    return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Process Lidar
 
-//callback to deal with return data
-void process_lidar_return(const LidarRetSet *p, void* userData)
+//state for the lidar callbacks, handed to them as user data.
+struct LidarProcessing
 {
-    //desination frame
+    ScanFilter filter;
+    ObstacleMonitor obstacles;
+    OdometryEstimator odometry;
+    bool bStreamSectors;
+};
+
+//how fast we're going, for sizing the obstacle corridor. Take whichever of the
+//command and the slam estimate says we're going faster.
+float estimate_speed(LidarProcessing* pProc)
+{
+    float speed = 0.0f;
+    ControlRecord* pControl = g_Controls.ReadRef();
+
+    if(pControl != NULL)
+        speed = pProc->odometry.FromCommand(pControl->throttle, pControl->steering).speed_mm_s;
+
+    SLAMRecord slam;
+
+    if(g_SLAMOutput.Read(slam) && get_sec_diff_usec(get_time_usec(), slam.tick) < 0.5
+        && fabsf(slam.m_speed_mm_s) > fabsf(speed))
+        speed = slam.m_speed_mm_s;
+
+    return speed;
+}
+
+//trip the obstacle stop when returns fall in our path.
+void check_lidar_obstacles(LidarProcessing* pProc, const LidarRet* rets, int count, uint64_t firstTick, uint64_t tick)
+{
+    ObstacleHit hit;
+
+    if(pProc->obstacles.Check(rets, count, firstTick, tick, estimate_speed(pProc), pProc->filter, hit))
+        g_ObstacleLatch.Trip(hit);
+}
+
+//callback to hand the lidar driver the ring slot to write the next scan into.
+LidarRetSet* begin_lidar_return(void* userData)
+{
+    return &g_LidarInput.BeginWrite().m_Set;
+}
+
+//callback to deal with return data, already in place in the ring slot.
+void process_lidar_return(LidarRetSet *p, void* userData)
+{
+    //desination frame, the same slot handed out by begin_lidar_return
     LidarRecord& rec = g_LidarInput.BeginWrite();                
 
-    //stamp with time stamp
-    rec.tick = clock();
+    //stamp with the time the last return of the revolution arrived
+    rec.tick = p->m_EndTick;
+
+    //convert and filter once here for all the consumers downstream.
+    LidarScanToSoA(rec.m_Set, rec.m_Soa);
+
+    LidarProcessing* pProc = (LidarProcessing*)userData;
+    pProc->filter.Filter(rec.m_Soa, rec.m_Bins);
 
-    //deep copy lidar returns
-    memcpy(rec.m_Set.m_Returns, p->m_Returns, sizeof(p->m_Returns));
+    //when streaming, the sectors have already been checked. Otherwise the
+    //check waits on the whole revolution, which the corridor allows for.
+    if(!pProc->bStreamSectors)
+        check_lidar_obstacles(pProc, p->m_Returns, p->m_Count, p->m_StartTick, p->m_EndTick);
     
     //For testing...
     // static int iImage = 0;
@@ -2013,6 +2650,13 @@ void process_lidar_return(const LidarRetSet *p, void* userData)
     g_LidarInput.FinishWrite();
 }
 
+//callback for each sector in streaming mode. Only the obstacle stop needs
+//them, everything else waits on the whole scan.
+void process_lidar_sector(const LidarSector *p, void* userData)
+{
+    check_lidar_obstacles((LidarProcessing*)userData, p->m_Returns, p->m_Count, p->m_FirstTick, p->m_LastTick);
+}
+
 //Main thread to process lidar device
 void* ProcessLidarUpdate(void * args)
 {
@@ -2032,18 +2676,30 @@ void* ProcessLidarUpdate(void * args)
 
     Profiler profile("Lidar", 100);
 
-    if(InitLidar(conf))
+    //handed to the callbacks as user data
+    LidarProcessing* pProc = new LidarProcessing();
+    pProc->filter.Init(conf);
+    pProc->obstacles.Init(conf);
+    pProc->odometry.Init(conf);
+    pProc->bStreamSectors = conf->GetInt("lidar_stream_sectors", 0) != 0;
+
+    if(InitLidar(conf, pProc))
     {
         while(programRunning)
         {
-            UpdateLidar(process_lidar_return);
+            //in streaming mode this returns per batch, so only count full scans.
+            bool bScan = UpdateLidar(begin_lidar_return, process_lidar_return, process_lidar_sector);
 
-            if(bShowFPS)
+            if(bShowFPS && bScan)
                 profile.OnFrameIter();
         }
     }
 
     ShutdownLidar();
+
+    delete pProc;
+
+    return NULL;
 }
 
 
@@ -2051,6 +2707,127 @@ void* ProcessLidarUpdate(void * args)
 ///////////////////////////////////////////////////////////////////////////////////
 //Main thread to process PID control
 
+//latest position to drive on. From the pose filter when it runs, moved on to
+//now, otherwise straight from SLAM. false when nothing is newer than last_tick.
+bool read_drive_pose(bool bUsePoseFilter, CarPose& pos, uint64_t& last_tick)
+{
+    if(bUsePoseFilter)
+    {
+        PoseEstimate* pLatest = g_PoseOutput.ReadRef();
+        PoseEstimate pose;
+
+        if(pLatest == NULL || pLatest->tick == last_tick)
+            return false;
+
+        last_tick = pLatest->tick;
+
+        if(!get_pose_at(get_time_usec(), pose))
+            return false;
+
+        pos.pos = Vector2(pose.x_mm, pose.y_mm);
+        pos.theta_deg = pose.theta_deg;
+        pos.speed = pose.speed_mm_s;
+        return true;
+    }
+
+    SLAMRecord rec;
+
+    if(!g_SLAMOutput.Read(rec) || rec.tick == last_tick)
+        return false;
+
+    last_tick = rec.tick;
+    pos.pos = Vector2(rec.m_posX_mm, rec.m_posY_mm);
+    pos.theta_deg = rec.m_theta_deg;
+    pos.speed = rec.m_speed_mm_s;
+    return true;
+}
+
+//take the jitter out of a freshly recorded path, and work out the speed to
+//drive each part of it at.
+void prepare_path(Config* conf, Path& path, bool bSmooth)
+{
+    if(bSmooth && conf->GetInt("path_smooth", 1))
+    {
+        size_t numRecorded = path.m_nodes.size();
+
+        path.Smooth(conf->GetFloat("path_resample_mm", 100.0f), conf->GetFloat("path_smooth_lambda", 50.0f));
+
+        printf("smoothed path of %d nodes to %d, %.0f mm long\n", (int)numRecorded, (int)path.m_nodes.size(),
+            path.GetLength());
+    }
+
+    if(!conf->GetInt("path_speed_profile", 1))
+        return;
+
+    PathSpeedLimits limits;
+    limits.maxSpeed = conf->GetFloat("path_max_speed_mm_s", 3000.0f);
+    limits.maxLateralAccel = conf->GetFloat("path_max_lateral_accel_mm_s2", 3000.0f);
+    limits.maxAccel = conf->GetFloat("path_max_accel_mm_s2", 2000.0f);
+    limits.maxDecel = conf->GetFloat("path_max_decel_mm_s2", 3000.0f);
+
+    path.ComputeSpeedProfile(limits);
+}
+
+//read a path saved on its own into path, ready to drive. path is left as it
+//was when the file can't be read, so a bad file doesn't lose the one we have.
+bool load_path_file(Config* conf, const char* filename, Path& path)
+{
+    Path loaded;
+
+    if(filename[0] == '\0' || !PathFile::Load(filename, loaded))
+        return false;
+
+    //saved already smoothed. Just the profile.
+    prepare_path(conf, loaded, false);
+
+    path = loaded;
+
+    printf("loaded path of %d nodes from %s\n", (int)path.m_nodes.size(), filename);
+
+    return true;
+}
+
+//save the map with the path and where the car is now, which is where
+//relocalizing starts looking next time.
+bool save_map_file(const char* filename, const Path& path)
+{
+    SLAMRecord rec;
+    ScanPose lastPose;
+    const ScanPose* pLastPose = NULL;
+
+    if(g_SLAMOutput.Read(rec))
+    {
+        lastPose = ScanPose(rec.m_posX_mm, rec.m_posY_mm, rec.m_theta_deg);
+        pLastPose = &lastPose;
+    }
+
+    if(!MapFile::Save(filename, *g_pSlamMap, &path, pLastPose))
+        return false;
+
+    printf("saved map and path to %s\n", filename);
+
+    return true;
+}
+
+//pid steers on cross track error alone. pure_pursuit and stanley also use
+//the heading and speed.
+PathController* create_path_controller(Config* conf)
+{
+    const char* type = conf->GetStr("path_controller", "pid");
+    PathController* pController = NULL;
+
+    if(strcmp(type, "pure_pursuit") == 0)
+        pController = new PurePursuitController();
+    else if(strcmp(type, "stanley") == 0)
+        pController = new StanleyController();
+    else
+        pController = new PIDController();
+
+    pController->Init(conf);
+
+    return pController;
+}
+
 void* ProcessPID(void * args)
 {
     Config* conf = (Config*)args;
@@ -2063,24 +2840,32 @@ void* ProcessPID(void * args)
 
     Profiler profile("PID", 100);
     AxisRecord axis;
+
+    TraceSetThreadName("pid");
     ButtonRecord button;
 
     Path path;
-    PIDController controller;
-    
-    controller.SetPath(&path);
+    PathController* pController = create_path_controller(conf);
+
+    pController->SetPath(&path);
+
+    //controllers give the wheel angle in degrees.
+    float maxSteeringAngle = conf->GetFloat("odom_max_steer_deg", 25.0f);
+    float throttleScale = conf->GetFloat("path_throttle_scale", 0.3f);
 
-    //read PID constants from config
-    float Kp = conf->GetFloat("pid_Kp", 1.0);
-    float Ki = conf->GetFloat("pid_Ki", 0.00001);
-    float Kd = conf->GetFloat("pid_Kd", 1.0);
+    //the map and the path recorded on it are saved together.
+    const char* mapFilename = conf->GetStr("slam_map_file", "");
+    bool bSaveMap = mapFilename[0] != '\0';
 
-    controller.SetVals(Kp, Ki, Kd);
+    //and the path on its own, to swap in without a restart.
+    const char* pathFilename = conf->GetStr("path_file", "");
 
-    g_pPID_Path = &path;
+    //steer on the pose filter, at our own rate, rather than wait on SLAM.
+    bool bUsePoseFilter = conf->GetInt("pose_ekf_enabled", 0);
 
     const int js_button_toggle_record_path = conf->GetInt("js_button_toggle_record_path", 13);
     const int js_button_toggle_driving = conf->GetInt("js_button_toggle_driving", 15);
+    const int js_button_load_path = conf->GetInt("js_button_load_path", 16);
 
     enum PIDMode
     {
@@ -2092,17 +2877,45 @@ void* ProcessPID(void * args)
 
     PIDMode mode = eNoPath;
 
+    //pick up the path from last time, on its own or with the map slam is using.
+    if(load_path_file(conf, pathFilename, path))
+    {
+        mode = ePathRecorded;
+    }
+    else if(g_bSavedMapLoaded)
+    {
+        MapFile mapFile;
+
+        if(mapFile.Open(mapFilename))
+            mapFile.LoadPath(path);
+
+        if(path.m_nodes.size() > 1)
+        {
+            //saved already smoothed. Just the profile.
+            prepare_path(conf, path, false);
+
+            mode = ePathRecorded;
+            printf("loaded path of %d nodes from %s\n", (int)path.m_nodes.size(), mapFilename);
+        }
+    }
+
+    publish_path(path);
+
     uint64_t last_button = 0;
     uint64_t last_slam = 0;
+    uint64_t last_publish = 0;
     float threshNewNode = 100.0f;
     float maxThrottle = 0.5f;
 
     Vector2 lastPos;
 
+    RateLoop loop;
+    loop.Init("PID", conf->GetFloat("pid_period_ms", 10.0f), conf->GetFloat("debug_loop_stats_s", 10.0f));
+
     while(programRunning)
     {
-        // Restrict rate
-        usleep(10000);
+        // Hold the rate
+        loop.Wait();
 
         if(mode == eNoPath)
         {
@@ -2118,6 +2931,13 @@ void* ProcessPID(void * args)
                     mode = eRecordingPath;
                     printf("recording path\n");
                 }
+
+                if(button.button == js_button_load_path && button.state == 1 &&
+                    load_path_file(conf, pathFilename, path))
+                {
+                    publish_path(path);
+                    mode = ePathRecorded;
+                }
             }
         }
 
@@ -2135,6 +2955,8 @@ void* ProcessPID(void * args)
                     PathNode n;
                     n.pos = Vector2(rec.m_posX_mm, rec.m_posY_mm);
                     path.AddNode(n);
+                    publish_path(path);
+                    last_publish = get_time_usec();
                     lastPos = n.pos;
 
                     printf("recording start node\n");
@@ -2149,7 +2971,15 @@ void* ProcessPID(void * args)
                         path.AddNode(n);
                         lastPos = n.pos;
 
-                        printf("recording node %d, %0.2f, %0.2f \n", (int)path.m_nodes.size(), n.pos.x, n.pos.y);
+                        //a copy per node would grow with the square of the path.
+                        //Readers only draw it, so a few times a second will do.
+                        if(get_sec_diff_usec(get_time_usec(), last_publish) > 0.5)
+                        {
+                            publish_path(path);
+                            last_publish = get_time_usec();
+                        }
+
+                        TRACE(TRACE_INFO, "recording node %d, %0.2f, %0.2f \n", (int)path.m_nodes.size(), n.pos.x, n.pos.y);
                     }
                 }
 
@@ -2167,6 +2997,15 @@ void* ProcessPID(void * args)
                 {
                     mode = ePathRecorded;
                     printf("finished recording path.\n");
+
+                    prepare_path(conf, path, true);
+                    publish_path(path);
+
+                    if(bSaveMap)
+                        save_map_file(mapFilename, path);
+
+                    if(pathFilename[0] != '\0' && PathFile::Save(pathFilename, path))
+                        printf("saved path to %s\n", pathFilename);
                 }
             }
         }
@@ -2191,9 +3030,12 @@ void* ProcessPID(void * args)
 
                     if(g_SLAMOutput.Read(rec))
                     {
-                        Vector2 pos(rec.m_posX_mm, rec.m_posY_mm);
+                        CarPose pose;
+                        pose.pos = Vector2(rec.m_posX_mm, rec.m_posY_mm);
+                        pose.theta_deg = rec.m_theta_deg;
+                        pose.speed = rec.m_speed_mm_s;
                     
-                        controller.Start(pos);
+                        pController->Start(pose);
 
                         mode = eDrive;
                     }
@@ -2204,33 +3046,34 @@ void* ProcessPID(void * args)
                 {
                     printf("erase PID path.\n");
                     path.Reset();
+                    publish_path(path);
                     mode = eNoPath;
                 }
+
+                if(button.button == js_button_load_path && button.state == 1 &&
+                    load_path_file(conf, pathFilename, path))
+                {
+                    publish_path(path);
+                }
             }
         }
 
         if(mode == eDrive)
         {
-            SLAMRecord rec;
+            CarPose pose;
 
-            if(g_SLAMOutput.Read(rec) && rec.tick != last_slam)
+            if(read_drive_pose(bUsePoseFilter, pose, last_slam))
             {
-                last_slam = rec.tick;
+                float steering = 0.0f, throttle = 0.0f;
 
-                Vector2 pos(rec.m_posX_mm, rec.m_posY_mm);
-            
-                float steering, throttle;
-
-                controller.Update(pos, steering, throttle);
+                pController->Update(pose, steering, throttle);
 
                 //it's not really radian or deg, just left or right
                 //steering = TMath::RadToDeg(steering);
                 
-                printf("pid: steer: %0.3f throttle: %0.3f\n", steering, throttle);
+                TRACE(TRACE_DEBUG, "pid: steer: %0.3f throttle: %0.3f\n", steering, throttle);
 
                 {
-                    float maxSteeringAngle = 25.0f;
-                    float throttleScale = 0.3f;
                     steering = clamp(steering, -maxSteeringAngle, maxSteeringAngle);
 
                     axis.steer = (steering / maxSteeringAngle) * axisRange;
@@ -2259,12 +3102,46 @@ void* ProcessPID(void * args)
 
                     printf("stop PID driving.\n");
                 }
+
+                //swap paths on the move. Find the car on the new one and carry on.
+                if(button.button == js_button_load_path && button.state == 1 &&
+                    load_path_file(conf, pathFilename, path))
+                {
+                    SLAMRecord rec;
+
+                    publish_path(path);
+
+                    if(g_SLAMOutput.Read(rec))
+                    {
+                        CarPose pose;
+                        pose.pos = Vector2(rec.m_posX_mm, rec.m_posY_mm);
+                        pose.theta_deg = rec.m_theta_deg;
+                        pose.speed = rec.m_speed_mm_s;
+
+                        pController->Start(pose);
+                    }
+                    else
+                    {
+                        mode = ePathRecorded;
+                    }
+                }
             }
         }
 
         if(bShowFPS)
             profile.OnFrameIter();
     }
+
+    //keep what we mapped this run for the next one.
+    if(bSaveMap)
+        save_map_file(mapFilename, path);
+
+    if(pathFilename[0] != '\0' && PathFile::Save(pathFilename, path))
+        printf("saved path to %s\n", pathFilename);
+
+    delete pController;
+
+    return NULL;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
@@ -2289,6 +3166,13 @@ signal_callback_handler(int signum)
     exit(signum);
 }
 
+// SIGUSR1 (kill -USR1) steps the trace level up, and from debug back to off.
+void
+trace_level_signal_handler(int signum)
+{
+    TraceSetLevel(g_TraceLevel >= TRACE_DEBUG ? TRACE_OFF : g_TraceLevel + 1);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 // main loop
@@ -2336,6 +3220,12 @@ int main(int argc, char** argv)
         printf("Loaded config: %s\n", config_filename.c_str());
     }
 
+    /////////////////////////////////
+    // Start draining the control thread traces
+
+    TraceInit(&conf);
+    signal(SIGUSR1, trace_level_signal_handler);
+
     
     /////////////////////////////////
     //select camera type
@@ -2353,6 +3243,52 @@ int main(int argc, char** argv)
     // Init image records
     InitImageRecordSize(conf);
 
+    /////////////////////////
+    // Init control history, a second at the robot loop rate
+    g_Controls.Init(128, 1000000);
+
+    /////////////////////////
+    // Init pose filter output, two seconds at 100hz
+    g_PoseOutput.Init(256, 2000000);
+
+    /////////////////////////
+    // Init slam map, from last time if we saved one
+    g_OccupancyMap.Init(&conf);
+
+    const char* mapFilename = conf.GetStr("slam_map_file", "");
+
+    if(mapFilename[0] != '\0')
+    {
+        MapFile mapFile;
+
+        //BreezySLAM keeps its own map, which we can't seed.
+        const char* slam_type = conf.GetStr("slam_type", "rmhc");
+
+        if(strcmp(slam_type, "correlative") != 0 && strcmp(slam_type, "mcl") != 0)
+            printf("slam_map_file is only loaded with slam_type correlative or mcl.\n");
+        else if(mapFile.Open(mapFilename) && mapFile.LoadMap(g_OccupancyMap))
+        {
+            g_bSavedMapLoaded = true;
+            mapFile.GetStartPose(g_SavedMapStart);
+            printf("loaded map of %d tiles from %s\n", (int)mapFile.GetHeader().m_NumTiles, mapFilename);
+        }
+    }
+
+    /////////////////////////
+    // Init pose graph, which starts from the saved map too
+    g_LoopCloser.Init(&conf);
+    g_CorrectedMap.Init(&conf);
+
+    if(g_LoopCloser.IsEnabled())
+    {
+        g_CorrectedMap.CopyFrom(g_OccupancyMap);
+        g_pSlamMap = &g_CorrectedMap;
+    }
+
+    /////////////////////////
+    // Init obstacle stop
+    g_ObstacleLatch.Init(&conf);
+
     /////////////////////////////////
     // Launch our worker threads
 
@@ -2394,6 +3330,12 @@ int main(int argc, char** argv)
     pthread_t thread_slam;
     pthread_create(&thread_slam, NULL, ProcessSLAM, &conf);
 
+    pthread_t thread_pose;
+    pthread_create(&thread_pose, NULL, ProcessPoseEstimate, &conf);
+
+    pthread_t thread_posegraph;
+    pthread_create(&thread_posegraph, NULL, ProcessPoseGraph, &conf);
+
     pthread_t thread_pid;
     pthread_create(&thread_pid, NULL, ProcessPID, &conf);
 
@@ -2418,8 +3360,14 @@ int main(int argc, char** argv)
     printf("web lidar update thread exited.\n");
     pthread_join(thread_slam, NULL);
     printf("slam thread exited.\n");
+    pthread_join(thread_pose, NULL);
+    printf("pose thread exited.\n");
+    pthread_join(thread_posegraph, NULL);
+    printf("pose graph thread exited.\n");
     pthread_join(thread_pid, NULL);
     printf("pid thread exited.\n");
+
+    TraceShutdown();
     
     programExited = true;
 
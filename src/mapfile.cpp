@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+#include "mapfile.h"
+
+static const char MAP_MAGIC[8] = "SHRKMAP";
+
+static bool TileOrder(const MapFileTile& a, const MapFileTile& b)
+{
+    return a.ty != b.ty ? a.ty < b.ty : a.tx < b.tx;
+}
+
+MapFile::MapFile()
+{
+    m_pData = NULL;
+    m_Bytes = 0;
+}
+
+MapFile::~MapFile()
+{
+    Close();
+}
+
+bool MapFile::Save(const char* filename, OccupancyMap& map, const Path* pPath, const ScanPose* pLastPose)
+{
+    //copy the tiles out under the lock, and write them after.
+    std::vector<MapFileTile> tiles;
+
+    map.Lock();
+
+    const OccupancyMap::TileMap& tileMap = map.GetTiles();
+    tiles.resize(tileMap.size());
+    int iTile = 0;
+
+    for(OccupancyMap::TileMap::const_iterator it = tileMap.begin(); it != tileMap.end(); ++it, iTile++)
+    {
+        tiles[iTile].tx = it->second->tx;
+        tiles[iTile].ty = it->second->ty;
+        memcpy(tiles[iTile].m_Cells, it->second->m_Cells, sizeof(tiles[iTile].m_Cells));
+    }
+
+    map.Unlock();
+
+    //don't replace a good map with nothing.
+    if(tiles.empty())
+        return false;
+
+    std::sort(tiles.begin(), tiles.end(), TileOrder);
+
+    std::vector<PathFileNode> nodes;
+
+    if(pPath != NULL)
+        PathFile::ToNodes(*pPath, nodes);
+
+    MapFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_Magic, MAP_MAGIC, sizeof(header.m_Magic));
+    header.m_Version = MapFileHeader::VERSION;
+    header.m_TileSize = OccupancyMap::TILE_SIZE;
+    header.m_Resolution = map.GetResolution();
+    header.m_NumTiles = (uint32_t)tiles.size();
+    header.m_NumPathNodes = (uint32_t)nodes.size();
+    header.m_PathLooping = (pPath != NULL && pPath->m_looping) ? 1 : 0;
+
+    if(pLastPose != NULL)
+    {
+        header.m_HasLastPose = 1;
+        header.m_LastX_mm = pLastPose->x_mm;
+        header.m_LastY_mm = pLastPose->y_mm;
+        header.m_LastTheta_deg = pLastPose->theta_deg;
+    }
+
+    header.m_TileOffset = sizeof(MapFileHeader);
+    header.m_PathOffset = header.m_TileOffset + tiles.size() * sizeof(MapFileTile);
+    header.m_FileBytes = header.m_PathOffset + nodes.size() * sizeof(PathFileNode);
+
+    PathFileBlock blocks[3] =
+    {
+        { &header, sizeof(header) },
+        { &tiles[0], tiles.size() * sizeof(MapFileTile) },
+        { nodes.empty() ? NULL : &nodes[0], nodes.size() * sizeof(PathFileNode) },
+    };
+
+    return PathFile::WriteFile(filename, blocks, 3);
+}
+
+bool MapFile::Open(const char* filename)
+{
+    Close();
+
+    int fd = open(filename, O_RDONLY);
+
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MapFileHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* pData = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(pData == MAP_FAILED)
+        return false;
+
+    m_pData = (const unsigned char*)pData;
+    m_Bytes = st.st_size;
+
+    //make sure every record the header points at is inside the file.
+    const MapFileHeader& header = GetHeader();
+
+    bool bValid = memcmp(header.m_Magic, MAP_MAGIC, sizeof(header.m_Magic)) == 0 &&
+        header.m_Version == MapFileHeader::VERSION &&
+        header.m_TileSize == OccupancyMap::TILE_SIZE &&
+        header.m_FileBytes == m_Bytes &&
+        header.m_TileOffset + (uint64_t)header.m_NumTiles * sizeof(MapFileTile) <= m_Bytes &&
+        header.m_PathOffset + (uint64_t)header.m_NumPathNodes * sizeof(PathFileNode) <= m_Bytes;
+
+    if(!bValid)
+    {
+        printf("%s isn't a map file we can read.\n", filename);
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void MapFile::Close()
+{
+    if(m_pData != NULL)
+        munmap((void*)m_pData, m_Bytes);
+
+    m_pData = NULL;
+    m_Bytes = 0;
+}
+
+bool MapFile::LoadMap(OccupancyMap& map) const
+{
+    if(!IsOpen())
+        return false;
+
+    const MapFileHeader& header = GetHeader();
+
+    if(fabsf(header.m_Resolution - map.GetResolution()) > 0.001f)
+    {
+        printf("saved map is %.1f mm per cell, but slam_map_resolution_mm is %.1f.\n",
+            header.m_Resolution, map.GetResolution());
+        return false;
+    }
+
+    map.Clear();
+
+    const MapFileTile* pTiles = GetTiles();
+
+    for(uint32_t iTile = 0; iTile < header.m_NumTiles; iTile++)
+        map.SetTile(pTiles[iTile].tx, pTiles[iTile].ty, pTiles[iTile].m_Cells);
+
+    return true;
+}
+
+void MapFile::LoadPath(Path& path) const
+{
+    if(!IsOpen())
+    {
+        path.Reset();
+        return;
+    }
+
+    const MapFileHeader& header = GetHeader();
+
+    PathFile::FromNodes(GetPathNodes(), header.m_NumPathNodes, header.m_PathLooping != 0, path);
+}
+
+bool MapFile::GetStartPose(ScanPose& pose) const
+{
+    if(!IsOpen())
+        return false;
+
+    const MapFileHeader& header = GetHeader();
+
+    if(header.m_HasLastPose)
+    {
+        pose = ScanPose(header.m_LastX_mm, header.m_LastY_mm, header.m_LastTheta_deg);
+        return true;
+    }
+
+    if(header.m_NumPathNodes < 2)
+        return false;
+
+    const PathFileNode* pNodes = GetPathNodes();
+    float dx = pNodes[1].x_mm - pNodes[0].x_mm;
+    float dy = pNodes[1].y_mm - pNodes[0].y_mm;
+
+    pose = ScanPose(pNodes[0].x_mm, pNodes[0].y_mm, TMath::RadToDeg(atan2f(dy, dx)));
+    return true;
+}
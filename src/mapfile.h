@@ -0,0 +1,99 @@
+// mapfile.h
+//
+// On disk format for a SLAM map and the path recorded on it, so both survive
+// a reboot. The file is a header followed by fixed size records at offsets
+// given in the header, all little endian and naturally aligned. It can be
+// mmap'ed and read in place, without parsing.
+//
+//   MapFileHeader
+//   MapFileTile      x m_NumTiles      sorted by ty, then tx
+//   PathFileNode     x m_NumPathNodes  in driving order, as in a path file
+
+#ifndef __MAP_FILE_H__
+#define __MAP_FILE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "occupancy.h"
+#include "path.h"
+#include "pathfile.h"
+#include "scanmatch.h"
+
+struct MapFileHeader
+{
+    enum Constants
+    {
+        VERSION = 2,
+    };
+
+    char m_Magic[8];            //"SHRKMAP"
+    uint32_t m_Version;
+    uint32_t m_TileSize;        //cells along a tile edge
+    float m_Resolution;         //mm per cell
+    uint32_t m_NumTiles;
+    uint32_t m_NumPathNodes;
+    uint32_t m_PathLooping;
+    uint32_t m_HasLastPose;     //where the car was when the map was saved
+    float m_LastX_mm;
+    float m_LastY_mm;
+    float m_LastTheta_deg;
+    uint64_t m_TileOffset;      //bytes from the start of the file
+    uint64_t m_PathOffset;
+    uint64_t m_FileBytes;
+};
+
+struct MapFileTile
+{
+    int32_t tx;
+    int32_t ty;
+    int16_t m_Cells[OccupancyMap::TILE_CELLS];
+};
+
+class MapFile
+{
+  public:
+
+    MapFile();
+    ~MapFile();
+
+    //write the map, and the path and last pose if any, to filename. Written to
+    //a temporary file and renamed over the old one, so a crash never leaves
+    //half a map.
+    static bool Save(const char* filename, OccupancyMap& map, const Path* pPath, const ScanPose* pLastPose);
+
+    //map the file and check the header. The records can then be read in place.
+    bool Open(const char* filename);
+    void Close();
+
+    bool IsOpen() const { return m_pData != NULL; }
+
+    const MapFileHeader& GetHeader() const { return *(const MapFileHeader*)m_pData; }
+
+    const MapFileTile* GetTiles() const
+    {
+        return (const MapFileTile*)(m_pData + GetHeader().m_TileOffset);
+    }
+
+    const PathFileNode* GetPathNodes() const
+    {
+        return (const PathFileNode*)(m_pData + GetHeader().m_PathOffset);
+    }
+
+    //replace the contents of map with the tiles in the file. Fails when the
+    //resolution doesn't match the one the map was set up with.
+    bool LoadMap(OccupancyMap& map) const;
+
+    //replace the nodes of path with the ones in the file.
+    void LoadPath(Path& path) const;
+
+    //best guess at where the car starts. The pose it was saved at, else the
+    //start of the path facing along it. False when the file has neither.
+    bool GetStartPose(ScanPose& pose) const;
+
+  protected:
+
+    const unsigned char* m_pData;
+    size_t m_Bytes;
+};
+
+#endif //__MAP_FILE_H__
@@ -0,0 +1,332 @@
+// mapper.cpp
+//
+// shark_mapper builds a SLAM map offline, from a lidar log recorded on the car
+// with log_lidar. Scans go through the same filter, de-skew and SLAM as they
+// do on the car, but as fast as the cpu allows rather than at the lidar rate.
+//
+// Give it more than one config to compare settings. The runs are spread over
+// the cores, each with its own map. With a single run, the scan matcher gets
+// the cores instead.
+//
+//   shark_mapper --log log/lidar_00000000.bin --config a.json [--config b.json] [--out maps/run]
+//
+// For each config i this writes <out>_<i>.map, which slam_map_file can load,
+// <out>_<i>_trajectory.csv with the pose of every scan, and timing stats.
+// With posegraph_enabled, loops are closed as the log plays, and the map is
+// drawn from the key scans at their optimized poses.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "SharkConfig.h"
+#include "config.h"
+#include "lidar.h"
+#include "lidarlog.h"
+#include "timing.h"
+#include "odometry.h"
+#include "scanfilter.h"
+#include "scanslam.h"
+#include "rmhc.h"
+#include "occupancy.h"
+#include "mapfile.h"
+#include "posegraph.h"
+
+struct ControlSample
+{
+    float throttle;
+    float steering;
+    uint64_t tick;
+};
+
+struct MapperRunStats
+{
+    int numScans;
+    int numMatched;
+    double logSec;
+    double processSec;
+    double maxScanMS;
+    int numTiles;
+    int numKeyScans;
+    int numLoops;
+    bool bOk;
+};
+
+//the average control over the scan, or the last one before it. Same as the car does.
+//numBefore is how many of controls were applied by the end of the scan.
+static MotionEstimate estimate_log_motion(const LidarRetSet& scan, const std::vector<ControlSample>& controls,
+    size_t numBefore, const OdometryEstimator& odometry)
+{
+    float throttle = 0.0f, steering = 0.0f;
+    int numInScan = 0;
+
+    for(size_t iC = numBefore; iC > 0 && controls[iC - 1].tick >= scan.m_StartTick; iC--)
+    {
+        throttle += controls[iC - 1].throttle;
+        steering += controls[iC - 1].steering;
+        numInScan++;
+    }
+
+    if(numInScan > 0)
+    {
+        throttle /= numInScan;
+        steering /= numInScan;
+    }
+    else if(numBefore > 0)
+    {
+        throttle = controls[numBefore - 1].throttle;
+        steering = controls[numBefore - 1].steering;
+    }
+
+    return odometry.Estimate(throttle, steering);
+}
+
+static void RunSLAM(const LidarLogReader& reader, const std::vector<LidarLogEntry>& scans,
+    const std::vector<ControlSample>& controls, Config* conf, const char* outPrefix, int iRun, MapperRunStats& stats)
+{
+    memset(&stats, 0, sizeof(stats));
+
+    const char* slam_type = conf->GetStr("slam_type", "rmhc");
+    bool bCorrelative = strcmp(slam_type, "correlative") == 0;
+    bool bDeskew = conf->GetInt("slam_deskew", 1);
+
+    OccupancyMap map;
+    map.Init(conf);
+
+    ScanMatchSLAM scanMatch;
+    RMHCSlam rmhc;
+
+    if(bCorrelative)
+        scanMatch.Init(conf, &map);
+    else if(!rmhc.Init(conf, &map))
+    {
+        printf("run %d: slam_type rmhc needs BreezySLAM, which this build doesn't have.\n", iRun);
+        return;
+    }
+
+    ScanFilter filter;
+    filter.Init(conf);
+    OdometryEstimator odometry;
+    odometry.Init(conf);
+
+    //no need for a thread here. The graph catches up after every scan.
+    LoopCloser loopCloser;
+    loopCloser.Init(conf);
+
+    LidarRetSet scan;
+    LidarScanSoA soa;
+    LidarBinnedScan bins;
+    ScanMatchResult result;
+    size_t numControls = 0;
+
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s_%d_trajectory.csv", outPrefix, iRun);
+    FILE* fpTrajectory = fopen(filename, "w");
+
+    if(fpTrajectory != NULL)
+        fprintf(fpTrajectory, "tick,x_mm,y_mm,theta_deg,score,matched,ms\n");
+
+    uint64_t first_scan = 0;
+    uint64_t last_scan = 0;
+    uint64_t start = get_time_usec();
+
+    for(size_t iScan = 0; iScan < scans.size(); iScan++)
+    {
+        const LidarLogEntry& entry = scans[iScan];
+
+        reader.ReadScan(entry, scan);
+
+        while(numControls < controls.size() && controls[numControls].tick <= entry.m_Tick)
+            numControls++;
+
+        uint64_t scanStart = get_time_usec();
+
+        MotionEstimate motion = estimate_log_motion(scan, controls, numControls, odometry);
+
+        LidarScanToSoA(scan, soa);
+
+        if(bDeskew)
+            DeskewScan(soa, motion);
+
+        filter.Filter(soa, bins);
+
+        float dt = last_scan != 0 ? (float)get_sec_diff_usec(entry.m_Tick, last_scan) : 0.0f;
+        last_scan = entry.m_Tick;
+
+        if(first_scan == 0)
+            first_scan = entry.m_Tick;
+
+        ScanPose p;
+        bool bMatched = true;
+        result.score = 0.0f;
+
+        if(bCorrelative)
+        {
+            bMatched = scanMatch.Update(bins, motion, dt, result);
+            p = scanMatch.GetPose();
+        }
+        else
+        {
+            rmhc.Update(bins, motion, dt);
+            p = rmhc.GetPose();
+        }
+
+        odometry.AddPose(p.x_mm, p.y_mm, p.theta_deg, entry.m_Tick);
+
+        if(loopCloser.IsEnabled())
+        {
+            bool bOptimized = false;
+
+            if(bMatched)
+                loopCloser.SubmitScan(p, bCorrelative ? scanMatch.GetPoints() : rmhc.GetPoints(),
+                    bCorrelative ? result.cov : NULL, entry.m_Tick);
+
+            loopCloser.Process(bOptimized);
+            p = loopCloser.Correct(p);
+        }
+
+        double scanMS = get_sec_diff_usec(get_time_usec(), scanStart) * 1000.0;
+
+        stats.numScans++;
+        stats.numMatched += bMatched ? 1 : 0;
+        stats.maxScanMS = std::max(stats.maxScanMS, scanMS);
+
+        if(fpTrajectory != NULL)
+            fprintf(fpTrajectory, "%llu,%.1f,%.1f,%.2f,%.3f,%d,%.2f\n", (unsigned long long)entry.m_Tick,
+                p.x_mm, p.y_mm, p.theta_deg, result.score, bMatched ? 1 : 0, scanMS);
+    }
+
+    stats.processSec = get_sec_diff_usec(get_time_usec(), start);
+    stats.logSec = last_scan != 0 ? get_sec_diff_usec(last_scan, first_scan) : 0.0;
+    stats.numKeyScans = loopCloser.GetNumNodes();
+    stats.numLoops = loopCloser.GetNumLoops();
+
+    //the tracking map has the drift in it. Redraw from the optimized key scans.
+    if(loopCloser.IsEnabled())
+    {
+        OccupancyMap corrected;
+        corrected.Init(conf);
+        loopCloser.DrawScans(corrected, 0);
+        map.Swap(corrected);
+    }
+
+    stats.numTiles = (int)map.GetTiles().size();
+
+    if(fpTrajectory != NULL)
+        fclose(fpTrajectory);
+
+    snprintf(filename, sizeof(filename), "%s_%d.map", outPrefix, iRun);
+    stats.bOk = MapFile::Save(filename, map, NULL, NULL);
+}
+
+static void PrintStats(FILE* fp, const char* confName, int iRun, const MapperRunStats& stats)
+{
+    fprintf(fp, "run %d (%s): %d scans, %d matched, %.1f s of log in %.1f s (%.1fx real time), "
+        "%.2f ms per scan, %.2f ms max, %d tiles, %d key scans, %d loops%s\n",
+        iRun, confName, stats.numScans, stats.numMatched, stats.logSec, stats.processSec,
+        stats.processSec > 0.0 ? stats.logSec / stats.processSec : 0.0,
+        stats.numScans > 0 ? stats.processSec * 1000.0 / stats.numScans : 0.0,
+        stats.maxScanMS, stats.numTiles, stats.numKeyScans, stats.numLoops, stats.bOk ? "" : ", map not saved");
+}
+
+int main(int argc, char** argv)
+{
+    const char* logFilename = NULL;
+    const char* outPrefix = "map";
+    std::vector<std::string> configFilenames;
+
+    for(int iArg = 1; iArg < argc; iArg++)
+    {
+        const char* arg = argv[iArg];
+
+        if(0 == strcmp(arg, "--log") && (iArg + 1) < argc)
+            logFilename = argv[++iArg];
+        else if(0 == strcmp(arg, "--config") && (iArg + 1) < argc)
+            configFilenames.push_back(argv[++iArg]);
+        else if(0 == strcmp(arg, "--out") && (iArg + 1) < argc)
+            outPrefix = argv[++iArg];
+    }
+
+    if(logFilename == NULL)
+    {
+        printf("usage: shark_mapper --log lidar.bin --config conf.json [--config more.json] [--out prefix]\n");
+        return 1;
+    }
+
+    if(configFilenames.empty())
+        configFilenames.push_back("config.json");
+
+    //index the log once, and share it with every run. Scans are copied out of
+    //the mapped log as each run gets to them.
+    LidarLogReader reader;
+
+    if(!reader.Open(logFilename))
+    {
+        printf("couldn't read lidar log %s\n", logFilename);
+        return 1;
+    }
+
+    std::vector<LidarLogEntry> scans;
+    std::vector<ControlSample> controls;
+    LidarLogEntry entry;
+
+    while(reader.Next(entry))
+    {
+        if(entry.m_Type == LidarLogRecord::SCAN)
+        {
+            scans.push_back(entry);
+        }
+        else if(entry.m_Type == LidarLogRecord::CONTROL)
+        {
+            ControlSample c;
+            c.throttle = entry.m_Throttle;
+            c.steering = entry.m_Steering;
+            c.tick = entry.m_Tick;
+            controls.push_back(c);
+        }
+    }
+
+    printf("read %d scans and %d controls from %s\n", (int)scans.size(), (int)controls.size(), logFilename);
+
+    const int numRuns = (int)configFilenames.size();
+    std::vector<Config*> configs(numRuns);
+    std::vector<MapperRunStats> stats(numRuns);
+
+    for(int iRun = 0; iRun < numRuns; iRun++)
+    {
+        configs[iRun] = new Config();
+
+        if(!configs[iRun]->Load(configFilenames[iRun].c_str()))
+        {
+            printf("failed to load config %s\n", configFilenames[iRun].c_str());
+            return 1;
+        }
+    }
+
+    //a run per core. When there's just one, leave the cores to the matcher.
+    #pragma omp parallel for schedule(dynamic, 1) if(numRuns > 1)
+    for(int iRun = 0; iRun < numRuns; iRun++)
+        RunSLAM(reader, scans, controls, configs[iRun], outPrefix, iRun, stats[iRun]);
+
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s_stats.txt", outPrefix);
+    FILE* fpStats = fopen(filename, "w");
+
+    for(int iRun = 0; iRun < numRuns; iRun++)
+    {
+        PrintStats(stdout, configFilenames[iRun].c_str(), iRun, stats[iRun]);
+
+        if(fpStats != NULL)
+            PrintStats(fpStats, configFilenames[iRun].c_str(), iRun, stats[iRun]);
+
+        delete configs[iRun];
+    }
+
+    if(fpStats != NULL)
+        fclose(fpStats);
+
+    return 0;
+}
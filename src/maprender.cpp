@@ -0,0 +1,196 @@
+#include <string.h>
+#include <math.h>
+#include "maprender.h"
+
+static const unsigned char UNKNOWN_GREY = 127;
+
+MapRenderer::MapRenderer()
+{
+    m_Width = 0;
+    m_Height = 0;
+    m_SizeMM = 20000.0f;
+    m_Resolution = 40.0f;
+    m_Clamp = 350;
+    m_CellsPerPixel = 1;
+    m_ViewCx = 0;
+    m_ViewCy = 0;
+    m_bCentered = false;
+    m_Revision = 0;
+    m_Generation = 0;
+    m_bValid = false;
+}
+
+void MapRenderer::Init(Config* conf, const OccupancyMap& map, int width, int height)
+{
+    m_Width = width;
+    m_Height = height;
+    m_SizeMM = conf->GetFloat("slam_debug_map_size_m", 20.0f) * 1000.0f;
+    m_Resolution = map.GetResolution();
+    m_Clamp = map.GetClamp() > 0 ? map.GetClamp() : 1;
+
+    //the smallest power of two block that fits the view in the image.
+    int cells = (int)ceilf(m_SizeMM / m_Resolution);
+    int edge = width < height ? width : height;
+
+    m_CellsPerPixel = 1;
+
+    while(m_CellsPerPixel * edge < cells && m_CellsPerPixel < OccupancyMap::TILE_SIZE)
+        m_CellsPerPixel *= 2;
+
+    m_Grey.resize(width * height);
+    m_bCentered = false;
+    m_bValid = false;
+}
+
+void MapRenderer::SetCenter(float x_mm, float y_mm)
+{
+    const int f = m_CellsPerPixel;
+
+    //keep the view aligned to whole blocks, so blocks never straddle tiles.
+    int cx = (int)floorf(x_mm / m_Resolution) - (m_Width * f) / 2;
+    int cy = (int)floorf(y_mm / m_Resolution) - (m_Height * f) / 2;
+
+    m_ViewCx = (int)floorf((float)cx / f) * f;
+    m_ViewCy = (int)floorf((float)cy / f) * f;
+    m_bCentered = true;
+    m_bValid = false;
+}
+
+int MapRenderer::Update(OccupancyMap& map)
+{
+    if(!m_bCentered)
+        return 0;
+
+    const int f = m_CellsPerPixel;
+    const int minTx = m_ViewCx >> OccupancyMap::TILE_BITS;
+    const int minTy = m_ViewCy >> OccupancyMap::TILE_BITS;
+    const int maxTx = (m_ViewCx + m_Width * f - 1) >> OccupancyMap::TILE_BITS;
+    const int maxTy = (m_ViewCy + m_Height * f - 1) >> OccupancyMap::TILE_BITS;
+
+    //copy out the changed tiles, so the lock is only held for a memcpy each.
+    int numDirty = 0;
+
+    map.Lock();
+
+    //a new generation is a different map. Start again and draw all of it.
+    uint32_t generation = map.GetGeneration();
+    uint32_t revision = map.GetRevision();
+    bool bRedraw = !m_bValid || generation != m_Generation;
+    uint32_t drawnRevision = bRedraw ? 0 : m_Revision;
+
+    const OccupancyMap::TileMap& tiles = map.GetTiles();
+
+    for(OccupancyMap::TileMap::const_iterator it = tiles.begin(); it != tiles.end(); ++it)
+    {
+        const OccupancyMap::Tile* pTile = it->second;
+
+        if(pTile->m_Revision <= drawnRevision)
+            continue;
+
+        if(pTile->tx < minTx || pTile->tx > maxTx || pTile->ty < minTy || pTile->ty > maxTy)
+            continue;
+
+        if(numDirty == (int)m_Dirty.size())
+            m_Dirty.resize(numDirty + 16);
+
+        memcpy(&m_Dirty[numDirty], pTile, sizeof(OccupancyMap::Tile));
+        numDirty++;
+    }
+
+    map.Unlock();
+
+    if(bRedraw)
+    {
+        memset(&m_Grey[0], UNKNOWN_GREY, m_Grey.size());
+        m_Generation = generation;
+        m_bValid = true;
+    }
+
+    m_Revision = revision;
+
+    //tiles own disjoint pixels, so they can be drawn in any order.
+    #pragma omp parallel for schedule(dynamic)
+    for(int iTile = 0; iTile < numDirty; iTile++)
+        DrawTile(m_Dirty[iTile]);
+
+    return numDirty;
+}
+
+void MapRenderer::DrawTile(const OccupancyMap::Tile& tile)
+{
+    const int f = m_CellsPerPixel;
+    const int blocks = OccupancyMap::TILE_SIZE / f;
+    const int area = f * f;
+
+    //first pixel of the tile. Rows run top down, y runs bottom up.
+    const int px0 = ((tile.tx << OccupancyMap::TILE_BITS) - m_ViewCx) / f;
+    const int py0 = ((tile.ty << OccupancyMap::TILE_BITS) - m_ViewCy) / f;
+
+    for(int by = 0; by < blocks; by++)
+    {
+        int row = m_Height - 1 - (py0 + by);
+
+        if(row < 0 || row >= m_Height)
+            continue;
+
+        unsigned char* pRow = &m_Grey[row * m_Width];
+
+        for(int bx = 0; bx < blocks; bx++)
+        {
+            int col = px0 + bx;
+
+            if(col < 0 || col >= m_Width)
+                continue;
+
+            //box filter. Average the log odds of the block, then shade it.
+            const short* pCells = tile.m_Cells + (by * f) * OccupancyMap::TILE_SIZE + bx * f;
+            int sum = 0;
+
+            for(int y = 0; y < f; y++)
+                for(int x = 0; x < f; x++)
+                    sum += pCells[y * OccupancyMap::TILE_SIZE + x];
+
+            int grey = UNKNOWN_GREY - (sum * UNKNOWN_GREY) / (area * m_Clamp);
+
+            pRow[col] = (unsigned char)(grey < 0 ? 0 : (grey > 255 ? 255 : grey));
+        }
+    }
+}
+
+void MapRenderer::ToRGB(unsigned char* pImage) const
+{
+    const int count = m_Width * m_Height;
+
+    for(int i = 0; i < count; i++)
+    {
+        unsigned char grey = m_bValid ? m_Grey[i] : UNKNOWN_GREY;
+
+        pImage[i * 3] = grey;
+        pImage[i * 3 + 1] = grey;
+        pImage[i * 3 + 2] = grey;
+    }
+}
+
+bool MapRenderer::WorldToPixel(float x_mm, float y_mm, int& px, int& py) const
+{
+    const float f = (float)m_CellsPerPixel;
+
+    px = (int)floorf((x_mm / m_Resolution - m_ViewCx) / f);
+    py = m_Height - 1 - (int)floorf((y_mm / m_Resolution - m_ViewCy) / f);
+
+    return m_bCentered && px >= 0 && py >= 0 && px < m_Width && py < m_Height;
+}
+
+void MapRenderer::Plot(unsigned char* pImage, float x_mm, float y_mm, unsigned char r, unsigned char g, unsigned char b) const
+{
+    int px, py;
+
+    if(!WorldToPixel(x_mm, y_mm, px, py))
+        return;
+
+    unsigned char* pPixel = pImage + (py * m_Width + px) * 3;
+
+    pPixel[0] = r;
+    pPixel[1] = g;
+    pPixel[2] = b;
+}
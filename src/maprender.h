@@ -0,0 +1,68 @@
+// maprender.h
+//
+// Draws the occupancy map for the web, when someone asks for it. The image is
+// kept between requests and only the tiles that changed since the last one
+// are drawn again, so the SLAM thread never does any of this work.
+//
+// Each pixel is the box filtered average of a square block of cells. The block
+// size is a power of two no larger than a tile, so every pixel falls inside a
+// single tile and tiles can be drawn in parallel without sharing pixels.
+
+#ifndef __MAP_RENDER_H__
+#define __MAP_RENDER_H__
+
+#include <stdint.h>
+#include <vector>
+#include "config.h"
+#include "occupancy.h"
+
+class MapRenderer
+{
+  public:
+
+    MapRenderer();
+
+    //width x height pixels, covering about slam_debug_map_size_m meters.
+    void Init(Config* conf, const OccupancyMap& map, int width, int height);
+
+    //center the view on a point, usually where the car started. Everything
+    //is drawn again on the next update.
+    void SetCenter(float x_mm, float y_mm);
+    bool HasCenter() const { return m_bCentered; }
+
+    //draw the tiles that changed since the last update. Returns how many.
+    int Update(OccupancyMap& map);
+
+    //the map as 3 channel grey. Unknown is mid grey, walls are dark.
+    void ToRGB(unsigned char* pImage) const;
+
+    //false when the point is outside the view.
+    bool WorldToPixel(float x_mm, float y_mm, int& px, int& py) const;
+
+    //color the pixel under a point of the map, in a 3 channel image.
+    void Plot(unsigned char* pImage, float x_mm, float y_mm, unsigned char r, unsigned char g, unsigned char b) const;
+
+  protected:
+
+    void DrawTile(const OccupancyMap::Tile& tile);
+
+    int m_Width;
+    int m_Height;
+    float m_SizeMM;
+    float m_Resolution;
+    short m_Clamp;
+
+    int m_CellsPerPixel;
+    int m_ViewCx;           //cell at the left edge of the view
+    int m_ViewCy;           //cell at the bottom edge
+    bool m_bCentered;
+
+    uint32_t m_Revision;    //map revision we've drawn up to
+    uint32_t m_Generation;
+    bool m_bValid;
+
+    std::vector<unsigned char> m_Grey;
+    std::vector<OccupancyMap::Tile> m_Dirty;
+};
+
+#endif //__MAP_RENDER_H__
@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <algorithm>
+#include <unordered_set>
+#include "mcl.h"
+#include "timing.h"
+#include "tmath.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Exact squared distance transform, a row then a column at a time. See
+// Felzenszwalb and Huttenlocher, Distance Transforms of Sampled Functions.
+
+static void DistanceTransform1D(const double* f, int n, double* d, int* v, double* z)
+{
+    const double INF = 1e30;
+    int k = 0;
+    v[0] = 0;
+    z[0] = -INF;
+    z[1] = INF;
+
+    for(int q = 1; q < n; q++)
+    {
+        double s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * q - 2.0 * v[k]);
+
+        while(s <= z[k])
+        {
+            k--;
+            s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * q - 2.0 * v[k]);
+        }
+
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = INF;
+    }
+
+    k = 0;
+
+    for(int q = 0; q < n; q++)
+    {
+        while(z[k + 1] < q)
+            k++;
+
+        d[q] = (double)(q - v[k]) * (q - v[k]) + f[v[k]];
+    }
+}
+
+LikelihoodField::LikelihoodField()
+{
+    m_OriginX = 0.0f;
+    m_OriginY = 0.0f;
+    m_Resolution = 40.0f;
+    m_InvResolution = 1.0f / 40.0f;
+    m_Width = 0;
+    m_Height = 0;
+    m_Floor = 0.0f;
+    m_HitWeight = 0.9f;
+    m_RandomWeight = 0.1f;
+}
+
+bool LikelihoodField::Build(OccupancyMap& map, float sigmaMM, float maxDistMM, float hitWeight, float randomWeight)
+{
+    map.Lock();
+
+    int minCx, minCy, maxCx, maxCy;
+
+    if(!map.GetBounds(minCx, minCy, maxCx, maxCy))
+    {
+        map.Unlock();
+        return false;
+    }
+
+    m_Resolution = map.GetResolution();
+    m_InvResolution = 1.0f / m_Resolution;
+    m_HitWeight = hitWeight;
+    m_RandomWeight = randomWeight;
+
+    //a border of cells further than maxDistMM from anything, which beams
+    //that leave the map are clamped to.
+    const int margin = (int)ceilf(maxDistMM / m_Resolution) + 1;
+    const int cx0 = minCx - margin;
+    const int cy0 = minCy - margin;
+
+    m_Width = maxCx - minCx + 1 + 2 * margin;
+    m_Height = maxCy - minCy + 1 + 2 * margin;
+    m_OriginX = cx0 * m_Resolution;
+    m_OriginY = cy0 * m_Resolution;
+
+    const int numCells = m_Width * m_Height;
+    const double INF = 1e20;
+    std::vector<double> dist(numCells, INF);
+
+    m_FreeCells.clear();
+
+    const OccupancyMap::TileMap& tiles = map.GetTiles();
+    const short occupied = map.GetOccupiedThreshold();
+
+    for(OccupancyMap::TileMap::const_iterator it = tiles.begin(); it != tiles.end(); ++it)
+    {
+        const OccupancyMap::Tile* pTile = it->second;
+
+        for(int iCell = 0; iCell < OccupancyMap::TILE_CELLS; iCell++)
+        {
+            int cx = (pTile->tx << OccupancyMap::TILE_BITS) + (iCell & OccupancyMap::TILE_MASK) - cx0;
+            int cy = (pTile->ty << OccupancyMap::TILE_BITS) + (iCell >> OccupancyMap::TILE_BITS) - cy0;
+            short v = pTile->m_Cells[iCell];
+
+            if(v >= occupied)
+                dist[cy * m_Width + cx] = 0.0;
+            else if(v < 0)
+                m_FreeCells.push_back(cy * m_Width + cx);
+        }
+    }
+
+    map.Unlock();
+
+    //rows, then columns.
+    #pragma omp parallel
+    {
+        const int n = std::max(m_Width, m_Height);
+        std::vector<double> f(n), d(n), z(n + 1);
+        std::vector<int> v(n);
+
+        #pragma omp for
+        for(int y = 0; y < m_Height; y++)
+        {
+            double* pRow = &dist[y * m_Width];
+            std::copy(pRow, pRow + m_Width, f.begin());
+            DistanceTransform1D(&f[0], m_Width, pRow, &v[0], &z[0]);
+        }
+
+        #pragma omp for
+        for(int x = 0; x < m_Width; x++)
+        {
+            for(int y = 0; y < m_Height; y++)
+                f[y] = dist[y * m_Width + x];
+
+            DistanceTransform1D(&f[0], m_Height, &d[0], &v[0], &z[0]);
+
+            for(int y = 0; y < m_Height; y++)
+                dist[y * m_Width + x] = d[y];
+        }
+    }
+
+    const float maxDist2 = (maxDistMM / m_Resolution) * (maxDistMM / m_Resolution);
+    const float cellSigma2 = (sigmaMM / m_Resolution) * (sigmaMM / m_Resolution);
+
+    m_Floor = logf(m_RandomWeight);
+    m_Cells.resize(numCells);
+
+    #pragma omp parallel for
+    for(int iCell = 0; iCell < numCells; iCell++)
+    {
+        float d2 = (float)std::min((double)maxDist2, dist[iCell]);
+
+        if(d2 >= maxDist2)
+            m_Cells[iCell] = m_Floor;
+        else
+            m_Cells[iCell] = logf(m_HitWeight * expf(-d2 / (2.0f * cellSigma2)) + m_RandomWeight);
+    }
+
+    return true;
+}
+
+float LikelihoodField::GetHitLikelihood(float x_mm, float y_mm) const
+{
+    float p = expf(GetLogLikelihood(x_mm, y_mm));
+
+    return std::max(0.0f, (p - m_RandomWeight) / m_HitWeight);
+}
+
+bool LikelihoodField::SampleFree(std::mt19937& rng, float& x_mm, float& y_mm) const
+{
+    if(m_FreeCells.empty())
+        return false;
+
+    std::uniform_int_distribution<int> pick(0, (int)m_FreeCells.size() - 1);
+    std::uniform_real_distribution<float> jitter(0.0f, 1.0f);
+    int iCell = m_FreeCells[pick(rng)];
+
+    x_mm = m_OriginX + ((iCell % m_Width) + jitter(rng)) * m_Resolution;
+    y_mm = m_OriginY + ((iCell / m_Width) + jitter(rng)) * m_Resolution;
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+MonteCarloLocalizer::MonteCarloLocalizer()
+{
+    memset(m_Cov, 0, sizeof(m_Cov));
+    m_Score = 0.0f;
+
+    m_MinParticles = 100;
+    m_MaxParticles = 5000;
+    m_KLDError = 0.05f;
+    m_KLDZ = 2.33f;
+    m_KLDBinMM = 200.0f;
+    m_KLDBinDeg = 10.0f;
+    m_ResampleNeff = 0.5f;
+    m_BeamSkip = 8;
+    m_MaxRangeMM = 8000.0f;
+    m_LikelihoodScale = 0.2f;
+    m_bGlobalInit = false;
+    m_InitSDMM = 500.0f;
+    m_InitSDDeg = 20.0f;
+    m_SpeedNoise = 0.2f;
+    m_YawNoise = 0.2f;
+    m_MinSDMM = 10.0f;
+    m_MinSDDeg = 0.5f;
+}
+
+bool MonteCarloLocalizer::Init(Config* conf, OccupancyMap& map)
+{
+    m_MinParticles = conf->GetInt("mcl_min_particles", 100);
+    m_MaxParticles = conf->GetInt("mcl_max_particles", 5000);
+    m_KLDError = conf->GetFloat("mcl_kld_error", 0.05f);
+    m_KLDZ = conf->GetFloat("mcl_kld_z", 2.33f);
+    m_KLDBinMM = conf->GetFloat("mcl_kld_bin_mm", 200.0f);
+    m_KLDBinDeg = conf->GetFloat("mcl_kld_bin_deg", 10.0f);
+    m_ResampleNeff = conf->GetFloat("mcl_resample_neff", 0.5f);
+    m_BeamSkip = std::max(1, conf->GetInt("mcl_beam_skip", 8));
+    m_MaxRangeMM = conf->GetFloat("slam_cs_max_range_mm", 8000.0f);
+    m_LikelihoodScale = conf->GetFloat("mcl_likelihood_scale", 0.2f);
+    m_bGlobalInit = conf->GetInt("mcl_global_init", 0);
+    m_InitSDMM = conf->GetFloat("mcl_init_sd_mm", 500.0f);
+    m_InitSDDeg = conf->GetFloat("mcl_init_sd_deg", 20.0f);
+    m_SpeedNoise = conf->GetFloat("mcl_speed_noise", 0.2f);
+    m_YawNoise = conf->GetFloat("mcl_yaw_noise", 0.2f);
+    m_MinSDMM = conf->GetFloat("mcl_min_sd_mm", 10.0f);
+    m_MinSDDeg = conf->GetFloat("mcl_min_sd_deg", 0.5f);
+
+    m_MinParticles = std::max(1, m_MinParticles);
+    m_MaxParticles = std::max(m_MinParticles, m_MaxParticles);
+
+    m_Rng.seed(conf->GetInt("mcl_seed", 1));
+
+    float sigmaMM = conf->GetFloat("mcl_sigma_mm", 100.0f);
+    float maxDistMM = conf->GetFloat("mcl_max_dist_mm", 500.0f);
+    float randomWeight = conf->GetFloat("mcl_random_weight", 0.05f);
+
+    uint64_t start = get_time_usec();
+
+    if(!m_Field.Build(map, sigmaMM, maxDistMM, 1.0f - randomWeight, randomWeight))
+        return false;
+
+    printf("mcl likelihood field %d x %d built in %.0f ms\n", m_Field.GetWidth(), m_Field.GetHeight(),
+        get_sec_diff_usec(get_time_usec(), start) * 1000.0);
+
+    Reset(ScanPose());
+
+    return true;
+}
+
+void MonteCarloLocalizer::Reset(const ScanPose& hint)
+{
+    const int n = m_bGlobalInit ? m_MaxParticles : std::max(m_MinParticles, m_MaxParticles / 2);
+
+    m_X.resize(n);
+    m_Y.resize(n);
+    m_Theta.resize(n);
+    m_LogWeight.assign(n, 0.0f);
+    m_Weight.assign(n, 1.0 / n);
+
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    std::uniform_real_distribution<float> heading(-180.0f, 180.0f);
+
+    for(int i = 0; i < n; i++)
+    {
+        if(m_bGlobalInit && m_Field.SampleFree(m_Rng, m_X[i], m_Y[i]))
+        {
+            m_Theta[i] = heading(m_Rng);
+            continue;
+        }
+
+        m_X[i] = hint.x_mm + gauss(m_Rng) * m_InitSDMM;
+        m_Y[i] = hint.y_mm + gauss(m_Rng) * m_InitSDMM;
+        m_Theta[i] = TMath::WrapDeg(hint.theta_deg + gauss(m_Rng) * m_InitSDDeg);
+    }
+
+    m_Pose = hint;
+}
+
+void MonteCarloLocalizer::Update(const LidarBinnedScan& scan, const MotionEstimate& motion, float dt)
+{
+    BinnedScanToPoints(scan, m_MaxRangeMM, m_Points);
+
+    Predict(motion, dt);
+    Weigh(m_Points);
+    Estimate(m_Points);
+
+    //effective number of particles. Low when a few carry all the weight.
+    double sumW2 = 0.0;
+
+    for(size_t i = 0; i < m_Weight.size(); i++)
+        sumW2 += m_Weight[i] * m_Weight[i];
+
+    if(sumW2 > 0.0 && 1.0 / sumW2 < m_ResampleNeff * m_Weight.size())
+        Resample();
+}
+
+void MonteCarloLocalizer::Predict(const MotionEstimate& motion, float dt)
+{
+    const float dist = motion.speed_mm_s * dt;
+    const float dtheta = motion.yaw_rate_deg_s * dt;
+    const float sdDist = m_SpeedNoise * fabsf(dist) + m_MinSDMM;
+    const float sdTheta = m_YawNoise * fabsf(dtheta) + m_MinSDDeg;
+
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    const int n = (int)m_X.size();
+
+    for(int i = 0; i < n; i++)
+    {
+        float d = dist + gauss(m_Rng) * sdDist;
+        float a = dtheta + gauss(m_Rng) * sdTheta;
+        float heading = TMath::DegToRad(m_Theta[i] + a * 0.5f);
+
+        //a little sideways slip, so a stopped cloud doesn't collapse.
+        float slip = gauss(m_Rng) * m_MinSDMM;
+
+        m_X[i] += cosf(heading) * d - sinf(heading) * slip;
+        m_Y[i] += sinf(heading) * d + cosf(heading) * slip;
+        m_Theta[i] = TMath::WrapDeg(m_Theta[i] + a);
+    }
+}
+
+void MonteCarloLocalizer::Weigh(const std::vector<ScanPoint>& points)
+{
+    //a subset of the beams. Neighbors say much the same thing.
+    m_BeamX.clear();
+    m_BeamY.clear();
+
+    for(size_t iPt = 0; iPt < points.size(); iPt += m_BeamSkip)
+    {
+        m_BeamX.push_back(points[iPt].x);
+        m_BeamY.push_back(points[iPt].y);
+    }
+
+    const int n = (int)m_X.size();
+    const int numBeams = (int)m_BeamX.size();
+
+    if(numBeams == 0)
+        return;
+
+    const float* bx = &m_BeamX[0];
+    const float* by = &m_BeamY[0];
+    const float* cells = m_Field.GetCells();
+    const float ox = m_Field.GetOriginX();
+    const float oy = m_Field.GetOriginY();
+    const float inv = m_Field.GetInvResolution();
+    const int w = m_Field.GetWidth();
+    const int h = m_Field.GetHeight();
+    const float scale = m_LikelihoodScale;
+
+    //beams that leave the field land on its border, which is all floor.
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < n; i++)
+    {
+        const float c = cosf(TMath::DegToRad(m_Theta[i]));
+        const float s = sinf(TMath::DegToRad(m_Theta[i]));
+        const float px = (m_X[i] - ox) * inv;
+        const float py = (m_Y[i] - oy) * inv;
+        const float cs = c * inv, ss = s * inv;
+        float sum = 0.0f;
+
+        #pragma omp simd reduction(+:sum)
+        for(int b = 0; b < numBeams; b++)
+        {
+            int cx = (int)floorf(px + cs * bx[b] - ss * by[b]);
+            int cy = (int)floorf(py + ss * bx[b] + cs * by[b]);
+
+            cx = cx < 0 ? 0 : (cx >= w ? w - 1 : cx);
+            cy = cy < 0 ? 0 : (cy >= h ? h - 1 : cy);
+
+            sum += cells[cy * w + cx];
+        }
+
+        m_LogWeight[i] += sum * scale;
+    }
+
+    //normalize in log space first, so exp doesn't underflow.
+    float maxLog = *std::max_element(m_LogWeight.begin(), m_LogWeight.end());
+    double total = 0.0;
+
+    for(int i = 0; i < n; i++)
+    {
+        m_LogWeight[i] -= maxLog;
+        m_Weight[i] = exp((double)m_LogWeight[i]);
+        total += m_Weight[i];
+    }
+
+    for(int i = 0; i < n; i++)
+        m_Weight[i] /= total;
+}
+
+void MonteCarloLocalizer::Estimate(const std::vector<ScanPoint>& points)
+{
+    const int n = (int)m_X.size();
+    double mx = 0.0, my = 0.0, mc = 0.0, ms = 0.0;
+
+    for(int i = 0; i < n; i++)
+    {
+        mx += m_Weight[i] * m_X[i];
+        my += m_Weight[i] * m_Y[i];
+        mc += m_Weight[i] * cos(TMath::DegToRad((double)m_Theta[i]));
+        ms += m_Weight[i] * sin(TMath::DegToRad((double)m_Theta[i]));
+    }
+
+    m_Pose = ScanPose((float)mx, (float)my, (float)TMath::RadToDeg(atan2(ms, mc)));
+
+    double cov[3][3] = { { 0.0 } };
+
+    for(int i = 0; i < n; i++)
+    {
+        double d[3] = { m_X[i] - mx, m_Y[i] - my, TMath::WrapDeg(m_Theta[i] - m_Pose.theta_deg) };
+
+        for(int r = 0; r < 3; r++)
+            for(int c = 0; c < 3; c++)
+                cov[r][c] += m_Weight[i] * d[r] * d[c];
+    }
+
+    for(int r = 0; r < 3; r++)
+        for(int c = 0; c < 3; c++)
+            m_Cov[r][c] = (float)cov[r][c];
+
+    //how well the scan fits from the mean.
+    std::vector<ScanPoint> world;
+    TransformPoints(points, m_Pose, world);
+
+    float sum = 0.0f;
+
+    for(size_t iPt = 0; iPt < world.size(); iPt++)
+        sum += m_Field.GetHitLikelihood(world[iPt].x, world[iPt].y);
+
+    m_Score = world.empty() ? 0.0f : sum / world.size();
+}
+
+//particles needed so the sampled distribution is within m_KLDError of the
+//true one, with probability given by m_KLDZ, when it covers numBins bins.
+int MonteCarloLocalizer::KLDCount(int numBins) const
+{
+    if(numBins <= 1)
+        return m_MinParticles;
+
+    double k = numBins - 1;
+    double a = 2.0 / (9.0 * k);
+    double b = 1.0 - a + sqrt(a) * m_KLDZ;
+    double count = k / (2.0 * m_KLDError) * b * b * b;
+
+    return std::max(m_MinParticles, std::min(m_MaxParticles, (int)ceil(count)));
+}
+
+//draw particles by weight until there are enough for the bins they cover.
+void MonteCarloLocalizer::Resample()
+{
+    const int n = (int)m_X.size();
+    std::vector<double> cdf(n);
+    double sum = 0.0;
+
+    for(int i = 0; i < n; i++)
+    {
+        sum += m_Weight[i];
+        cdf[i] = sum;
+    }
+
+    std::vector<float> x, y, theta;
+    x.reserve(m_MaxParticles);
+    y.reserve(m_MaxParticles);
+    theta.reserve(m_MaxParticles);
+
+    std::unordered_set<uint64_t> bins;
+    std::uniform_real_distribution<double> uniform(0.0, sum);
+    int required = m_MinParticles;
+
+    while((int)x.size() < required && (int)x.size() < m_MaxParticles)
+    {
+        int i = (int)(std::lower_bound(cdf.begin(), cdf.end(), uniform(m_Rng)) - cdf.begin());
+        i = std::min(i, n - 1);
+
+        x.push_back(m_X[i]);
+        y.push_back(m_Y[i]);
+        theta.push_back(m_Theta[i]);
+
+        uint64_t bx = (uint64_t)(uint32_t)(int)floorf(m_X[i] / m_KLDBinMM) & 0x1fffff;
+        uint64_t by = (uint64_t)(uint32_t)(int)floorf(m_Y[i] / m_KLDBinMM) & 0x1fffff;
+        uint64_t bt = (uint64_t)(uint32_t)(int)floorf((m_Theta[i] + 180.0f) / m_KLDBinDeg) & 0x3fffff;
+
+        if(bins.insert((bx << 43) | (by << 22) | bt).second)
+            required = KLDCount((int)bins.size());
+    }
+
+    m_X.swap(x);
+    m_Y.swap(y);
+    m_Theta.swap(theta);
+
+    const int numNew = (int)m_X.size();
+    m_LogWeight.assign(numNew, 0.0f);
+    m_Weight.assign(numNew, 1.0 / numNew);
+}
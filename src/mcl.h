@@ -0,0 +1,157 @@
+// mcl.h
+//
+// Monte Carlo localization on a map we already have. Once the track is mapped
+// there's no need to keep building it, only to find the car in it. A cloud of
+// particles, each a guess at the pose, is moved with odometry and weighted by
+// how well the scan lines up with the map from there.
+//
+// Scans are scored against a likelihood field, taken once from a distance
+// transform of the map's walls, so weighting a particle is a lookup per beam.
+// The number of particles adapts with KLD sampling. Lots while the cloud is
+// spread out, few once it has settled on one place.
+
+#ifndef __MCL_H__
+#define __MCL_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <random>
+#include "config.h"
+#include "odometry.h"
+#include "scanmatch.h"
+#include "occupancy.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Log likelihood of a return landing in each cell of the map. A gaussian on
+// the distance to the nearest wall, plus a floor for returns off things that
+// aren't in the map.
+
+class LikelihoodField
+{
+  public:
+
+    LikelihoodField();
+
+    //a field covering the map's tiles, plus margin.
+    bool Build(OccupancyMap& map, float sigmaMM, float maxDistMM, float hitWeight, float randomWeight);
+
+    //outside the field counts as far from any wall.
+    float GetLogLikelihood(float x_mm, float y_mm) const
+    {
+        int cx = (int)floorf((x_mm - m_OriginX) * m_InvResolution);
+        int cy = (int)floorf((y_mm - m_OriginY) * m_InvResolution);
+
+        if((unsigned)cx >= (unsigned)m_Width || (unsigned)cy >= (unsigned)m_Height)
+            return m_Floor;
+
+        return m_Cells[cy * m_Width + cx];
+    }
+
+    //the likelihood of the cell as a hit, 0 to 1.
+    float GetHitLikelihood(float x_mm, float y_mm) const;
+
+    //a random cell far from any wall.
+    bool SampleFree(std::mt19937& rng, float& x_mm, float& y_mm) const;
+
+    float GetOriginX() const { return m_OriginX; }
+    float GetOriginY() const { return m_OriginY; }
+    float GetInvResolution() const { return m_InvResolution; }
+    int GetWidth() const { return m_Width; }
+    int GetHeight() const { return m_Height; }
+    float GetFloor() const { return m_Floor; }
+    const float* GetCells() const { return m_Cells.empty() ? NULL : &m_Cells[0]; }
+
+  protected:
+
+    float m_OriginX;
+    float m_OriginY;
+    float m_Resolution;
+    float m_InvResolution;
+    int m_Width;
+    int m_Height;
+    float m_Floor;
+    float m_HitWeight;
+    float m_RandomWeight;
+
+    std::vector<float> m_Cells;
+    std::vector<int> m_FreeCells;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+class MonteCarloLocalizer
+{
+  public:
+
+    MonteCarloLocalizer();
+
+    //the map is only read, while the field is built.
+    bool Init(Config* conf, OccupancyMap& map);
+
+    //scatter particles around hint, or over the whole map with mcl_global_init.
+    void Reset(const ScanPose& hint);
+
+    //move the particles by the odometry estimate over dt, and weigh them
+    //with the scan. Resamples once too few particles carry the weight.
+    void Update(const LidarBinnedScan& scan, const MotionEstimate& motion, float dt);
+
+    //weighted mean of the particles.
+    const ScanPose& GetPose() const { return m_Pose; }
+
+    //spread of the particles, x, y in mm and theta in degrees.
+    void GetCovariance(float cov[3][3]) const { memcpy(cov, m_Cov, sizeof(m_Cov)); }
+
+    //mean hit likelihood of the scan from the pose, 0 to 1. Like the scan
+    //matcher's score.
+    float GetScore() const { return m_Score; }
+
+    int GetNumParticles() const { return (int)m_X.size(); }
+
+  protected:
+
+    void Predict(const MotionEstimate& motion, float dt);
+    void Weigh(const std::vector<ScanPoint>& points);
+    void Resample();
+    void Estimate(const std::vector<ScanPoint>& points);
+    int KLDCount(int numBins) const;
+
+    LikelihoodField m_Field;
+    std::mt19937 m_Rng;
+
+    //particles, a structure of arrays so the weighting vectorizes.
+    std::vector<float> m_X;
+    std::vector<float> m_Y;
+    std::vector<float> m_Theta;
+    std::vector<float> m_LogWeight;
+    std::vector<double> m_Weight;
+
+    std::vector<ScanPoint> m_Points;
+    std::vector<float> m_BeamX;
+    std::vector<float> m_BeamY;
+
+    ScanPose m_Pose;
+    float m_Cov[3][3];
+    float m_Score;
+
+    int m_MinParticles;
+    int m_MaxParticles;
+    float m_KLDError;
+    float m_KLDZ;
+    float m_KLDBinMM;
+    float m_KLDBinDeg;
+    float m_ResampleNeff;
+    int m_BeamSkip;
+    float m_MaxRangeMM;
+    float m_LikelihoodScale;
+    bool m_bGlobalInit;
+    float m_InitSDMM;
+    float m_InitSDDeg;
+    float m_SpeedNoise;
+    float m_YawNoise;
+    float m_MinSDMM;
+    float m_MinSDDeg;
+};
+
+#endif //__MCL_H__
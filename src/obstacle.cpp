@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include "obstacle.h"
+#include "timing.h"
+#include "tmath.h"
+
+ObstacleMonitor::ObstacleMonitor()
+{
+    m_bEnabled = false;
+    m_HalfWidthMM = 200.0f;
+    m_MinDistanceMM = 300.0f;
+    m_DecelMMS2 = 4000.0f;
+    m_LatencySec = 0.05f;
+    m_ForwardDeg = 0.0f;
+    m_MinPoints = 2;
+}
+
+void ObstacleMonitor::Init(Config* conf)
+{
+    m_bEnabled = conf->GetInt("estop_enabled", 0) != 0;
+    m_HalfWidthMM = conf->GetFloat("estop_half_width_mm", 200.0f);
+    m_MinDistanceMM = conf->GetFloat("estop_min_distance_mm", 300.0f);
+    m_DecelMMS2 = conf->GetFloat("estop_decel_mm_s2", 4000.0f);
+    m_LatencySec = conf->GetFloat("estop_latency_ms", 50.0f) / 1000.0f;
+    m_ForwardDeg = conf->GetFloat("estop_lidar_forward_deg", 0.0f);
+    m_MinPoints = conf->GetInt("estop_min_points", 2);
+
+    if(m_DecelMMS2 < 1.0f)
+        m_DecelMMS2 = 1.0f;
+}
+
+float ObstacleMonitor::StoppingDistance(float speed_mm_s, float ageSec) const
+{
+    float v = fabsf(speed_mm_s);
+
+    return m_MinDistanceMM + v * (m_LatencySec + ageSec) + (v * v) / (2.0f * m_DecelMMS2);
+}
+
+bool ObstacleMonitor::Check(const LidarRet* rets, int count, uint64_t firstTick, uint64_t tick, float speed_mm_s,
+    const ScanFilter& filter, ObstacleHit& hit) const
+{
+    if(!m_bEnabled)
+        return false;
+
+    float ageSec = firstTick != 0 && tick > firstTick ? (float)get_sec_diff_usec(tick, firstTick) : 0.0f;
+
+    const int direction = speed_mm_s < 0.0f ? -1 : 1;
+    const float corridor = StoppingDistance(speed_mm_s, ageSec);
+    int numInside = 0;
+    float nearest = corridor;
+
+    for(int iRet = 0; iRet < count; iRet++)
+    {
+        float range = rets[iRet].GetDistance();
+
+        //cheap reject before any trig. Most returns are well past the corridor.
+        if(range > corridor + m_HalfWidthMM)
+            continue;
+
+        if(!filter.AcceptReturn(range, rets[iRet].GetQuality()))
+            continue;
+
+        //along and across the car. The angle sign doesn't matter across.
+        float theta = TMath::DegToRad(rets[iRet].GetAngle() - m_ForwardDeg);
+        float along = cosf(theta) * range * direction;
+        float across = sinf(theta) * range;
+
+        if(along <= 0.0f || along > corridor || fabsf(across) > m_HalfWidthMM)
+            continue;
+
+        numInside++;
+
+        if(along < nearest)
+            nearest = along;
+    }
+
+    if(numInside < m_MinPoints)
+        return false;
+
+    hit.direction = direction;
+    hit.distance_mm = nearest;
+    hit.corridor_mm = corridor;
+    hit.tick = tick;
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+ObstacleLatch::ObstacleLatch()
+{
+    pthread_mutex_init(&m_Mutex, NULL);
+
+    //time outs on the monotonic clock, to match our time stamps.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_Cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    m_bSignaled = false;
+    m_Direction = 0;
+    m_LastHitTick = 0;
+    m_ReleaseUsec = 500000;
+    m_bPending = false;
+
+    m_NumReactions = 0;
+    m_MinReaction = 0;
+    m_MaxReaction = 0;
+    m_TotalReaction = 0;
+}
+
+ObstacleLatch::~ObstacleLatch()
+{
+    pthread_cond_destroy(&m_Cond);
+    pthread_mutex_destroy(&m_Mutex);
+}
+
+void ObstacleLatch::Init(Config* conf)
+{
+    m_ReleaseUsec = (uint64_t)(conf->GetFloat("estop_release_ms", 500.0f) * 1000.0f);
+}
+
+void ObstacleLatch::Trip(const ObstacleHit& hit)
+{
+    pthread_mutex_lock(&m_Mutex);
+
+    //only a new trip needs to wake the writer. Otherwise just hold the latch.
+    bool bLatched = m_Direction == hit.direction && hit.tick - m_LastHitTick < m_ReleaseUsec;
+
+    m_Direction = hit.direction;
+    m_LastHitTick = hit.tick;
+
+    if(!bLatched)
+    {
+        m_PendingHit = hit;
+        m_bPending = true;
+        m_bSignaled = true;
+        pthread_cond_signal(&m_Cond);
+    }
+
+    pthread_mutex_unlock(&m_Mutex);
+}
+
+void ObstacleLatch::Wait(int usec)
+{
+    WaitUntil(get_time_usec() + usec);
+}
+
+void ObstacleLatch::WaitUntil(uint64_t tick)
+{
+    //the condition waits on the monotonic clock, same as the tick.
+    struct timespec ts;
+    ts.tv_sec = (time_t)(tick / 1000000ULL);
+    ts.tv_nsec = (long)(tick % 1000000ULL) * 1000;
+
+    pthread_mutex_lock(&m_Mutex);
+
+    while(!m_bSignaled)
+    {
+        if(pthread_cond_timedwait(&m_Cond, &m_Mutex, &ts) != 0)
+            break;
+    }
+
+    m_bSignaled = false;
+
+    pthread_mutex_unlock(&m_Mutex);
+}
+
+float ObstacleLatch::Limit(float throttle, uint64_t now)
+{
+    pthread_mutex_lock(&m_Mutex);
+
+    bool bActive = m_Direction != 0 && now - m_LastHitTick < m_ReleaseUsec;
+    bool bBlocked = bActive && throttle * m_Direction > 0.0f;
+
+    //released, or nothing moving toward it to stop. Then there's nothing to time.
+    if(!bActive)
+        m_Direction = 0;
+
+    if(!bBlocked)
+        m_bPending = false;
+
+    pthread_mutex_unlock(&m_Mutex);
+
+    return bBlocked ? 0.0f : throttle;
+}
+
+void ObstacleLatch::OnThrottleWritten(uint64_t now)
+{
+    pthread_mutex_lock(&m_Mutex);
+
+    if(!m_bPending)
+    {
+        pthread_mutex_unlock(&m_Mutex);
+        return;
+    }
+
+    ObstacleHit hit = m_PendingHit;
+    uint64_t reaction = now - hit.tick;
+    m_bPending = false;
+
+    if(m_NumReactions == 0 || reaction < m_MinReaction)
+        m_MinReaction = reaction;
+
+    if(reaction > m_MaxReaction)
+        m_MaxReaction = reaction;
+
+    m_TotalReaction += reaction;
+    m_NumReactions++;
+
+    pthread_mutex_unlock(&m_Mutex);
+
+    printf("obstacle stop: %.0f mm %s, corridor %.0f mm, reaction %.2f ms\n",
+        hit.distance_mm, hit.direction > 0 ? "ahead" : "behind", hit.corridor_mm, reaction / 1000.0f);
+
+    PrintStats();
+}
+
+void ObstacleLatch::PrintStats()
+{
+    if(m_NumReactions == 0)
+        return;
+
+    printf("obstacle stop reaction: min %.2f ms, avg %.2f ms, max %.2f ms over %d stops\n",
+        m_MinReaction / 1000.0f, (m_TotalReaction / m_NumReactions) / 1000.0f,
+        m_MaxReaction / 1000.0f, m_NumReactions);
+}
@@ -0,0 +1,110 @@
+// obstacle.h
+//
+// Emergency stop on lidar returns. The monitor checks returns against a
+// corridor in the direction we're driving, as long as our stopping distance,
+// as soon as each sector arrives. When it trips, it latches a throttle
+// override and wakes the thread that writes to the motor controller.
+
+#ifndef __OBSTACLE_H__
+#define __OBSTACLE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "config.h"
+#include "lidar.h"
+#include "scanfilter.h"
+
+struct ObstacleHit
+{
+    int direction;          //1 ahead, -1 behind
+    float distance_mm;      //to the nearest return in the corridor
+    float corridor_mm;      //length of the corridor we checked
+    uint64_t tick;          //when the return arrived
+};
+
+class ObstacleMonitor
+{
+  public:
+
+    ObstacleMonitor();
+
+    void Init(Config* conf);
+
+    bool IsEnabled() const { return m_bEnabled; }
+
+    //length of the corridor we check at the given speed, when the oldest
+    //return is ageSec old by the time we look at it.
+    float StoppingDistance(float speed_mm_s, float ageSec) const;
+
+    //check a batch of returns that came in from firstTick to tick, taken while
+    //moving at speed_mm_s. Returns true, and fills hit, when enough of them
+    //fall inside the stopping corridor. A whole revolution is about 100ms
+    //old at its start, so the corridor grows by what we drive in that time.
+    bool Check(const LidarRet* rets, int count, uint64_t firstTick, uint64_t tick, float speed_mm_s,
+        const ScanFilter& filter, ObstacleHit& hit) const;
+
+  protected:
+
+    bool m_bEnabled;
+    float m_HalfWidthMM;        //half the car width, plus margin
+    float m_MinDistanceMM;      //always keep this clear, even when stopped
+    float m_DecelMMS2;          //how hard the car can brake
+    float m_LatencySec;         //control delay, travelled at full speed
+    float m_ForwardDeg;         //lidar angle that points along the car
+    int m_MinPoints;            //returns needed in the corridor to trip
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Shared between the lidar thread, which trips it, and the robot thread, which
+// applies it. Once tripped, throttle in the blocked direction is held at zero
+// until the corridor has been clear for the release time.
+
+class ObstacleLatch
+{
+  public:
+
+    ObstacleLatch();
+    ~ObstacleLatch();
+
+    void Init(Config* conf);
+
+    //lidar thread. Latches the override and wakes the waiting writer.
+    void Trip(const ObstacleHit& hit);
+
+    //robot thread. Sleeps up to usec, or until Trip.
+    void Wait(int usec);
+
+    //same, up to the get_time_usec() tick given.
+    void WaitUntil(uint64_t tick);
+
+    //robot thread. Returns the throttle to write given the one requested.
+    float Limit(float throttle, uint64_t now);
+
+    //robot thread. Call right after writing the throttle, to measure the time
+    //from the return arriving to the write when an override was applied.
+    void OnThrottleWritten(uint64_t now);
+
+    void PrintStats();
+
+  protected:
+
+    pthread_mutex_t m_Mutex;
+    pthread_cond_t m_Cond;
+
+    volatile bool m_bSignaled;
+    volatile int m_Direction;
+    volatile uint64_t m_LastHitTick;
+    uint64_t m_ReleaseUsec;
+
+    //trip waiting to be measured at the next write
+    ObstacleHit m_PendingHit;
+    bool m_bPending;
+
+    //reaction time stats, usec
+    int m_NumReactions;
+    uint64_t m_MinReaction;
+    uint64_t m_MaxReaction;
+    uint64_t m_TotalReaction;
+};
+
+#endif //__OBSTACLE_H__
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "occupancy.h"
+
+OccupancyMap::OccupancyMap()
+{
+    m_Resolution = 40.0f;
+    m_HitDelta = 85;
+    m_MissDelta = -40;
+    m_Clamp = 350;
+    m_OccupiedThreshold = 50;
+    m_Revision = 0;
+    m_Generation = 0;
+
+    pthread_mutex_init(&m_Mutex, NULL);
+}
+
+OccupancyMap::~OccupancyMap()
+{
+    Clear();
+
+    pthread_mutex_destroy(&m_Mutex);
+}
+
+void OccupancyMap::Init(Config* conf)
+{
+    Clear();
+
+    m_Resolution = conf->GetFloat("slam_map_resolution_mm", 40.0f);
+    m_HitDelta = (short)(conf->GetFloat("slam_map_hit_log_odds", 0.85f) * LOG_ODDS_SCALE);
+    m_MissDelta = (short)(conf->GetFloat("slam_map_miss_log_odds", -0.4f) * LOG_ODDS_SCALE);
+    m_Clamp = (short)(conf->GetFloat("slam_map_clamp_log_odds", 3.5f) * LOG_ODDS_SCALE);
+    m_OccupiedThreshold = (short)(conf->GetFloat("slam_map_occupied_log_odds", 0.5f) * LOG_ODDS_SCALE);
+
+    if(m_Resolution < 5.0f)
+        m_Resolution = 5.0f;
+}
+
+void OccupancyMap::Clear()
+{
+    Lock();
+
+    for(TileMap::iterator it = m_Tiles.begin(); it != m_Tiles.end(); ++it)
+        delete it->second;
+
+    m_Tiles.clear();
+    m_Generation++;
+
+    Unlock();
+}
+
+const OccupancyMap::Tile* OccupancyMap::FindTile(int tx, int ty) const
+{
+    TileMap::const_iterator it = m_Tiles.find(TileKey(tx, ty));
+
+    return it == m_Tiles.end() ? NULL : it->second;
+}
+
+OccupancyMap::Tile* OccupancyMap::GetOrCreateTile(int tx, int ty)
+{
+    Tile*& pTile = m_Tiles[TileKey(tx, ty)];
+
+    if(pTile == NULL)
+    {
+        pTile = new Tile();
+        pTile->tx = tx;
+        pTile->ty = ty;
+        pTile->m_Revision = m_Revision;
+        memset(pTile->m_Cells, 0, sizeof(pTile->m_Cells));
+    }
+
+    return pTile;
+}
+
+void OccupancyMap::SetTile(int tx, int ty, const short* pCells)
+{
+    Lock();
+    m_Revision++;
+
+    Tile* pTile = GetOrCreateTile(tx, ty);
+    memcpy(pTile->m_Cells, pCells, sizeof(pTile->m_Cells));
+    pTile->m_Revision = m_Revision;
+
+    Unlock();
+}
+
+void OccupancyMap::CopyFrom(OccupancyMap& other)
+{
+    Clear();
+
+    other.Lock();
+    Lock();
+    m_Revision++;
+
+    for(TileMap::const_iterator it = other.m_Tiles.begin(); it != other.m_Tiles.end(); ++it)
+    {
+        Tile* pTile = GetOrCreateTile(it->second->tx, it->second->ty);
+        memcpy(pTile->m_Cells, it->second->m_Cells, sizeof(pTile->m_Cells));
+        pTile->m_Revision = m_Revision;
+    }
+
+    Unlock();
+    other.Unlock();
+}
+
+void OccupancyMap::Swap(OccupancyMap& other)
+{
+    //always lock in the same order.
+    OccupancyMap* pFirst = this < &other ? this : &other;
+    OccupancyMap* pSecond = this < &other ? &other : this;
+
+    pFirst->Lock();
+    pSecond->Lock();
+
+    m_Tiles.swap(other.m_Tiles);
+    m_Generation++;
+    m_Revision++;
+    other.m_Generation++;
+    other.m_Revision++;
+
+    pSecond->Unlock();
+    pFirst->Unlock();
+}
+
+float OccupancyMap::GetLogOdds(int cx, int cy) const
+{
+    return (float)GetCell(cx, cy) / LOG_ODDS_SCALE;
+}
+
+void OccupancyMap::UpdateCell(Tile* pTile, int cx, int cy, short delta)
+{
+    pTile->m_Revision = m_Revision;
+
+    short& cell = pTile->m_Cells[((cy & TILE_MASK) << TILE_BITS) + (cx & TILE_MASK)];
+    int v = (int)cell + delta;
+
+    if(v > m_Clamp)
+        v = m_Clamp;
+    else if(v < -m_Clamp)
+        v = -m_Clamp;
+
+    cell = (short)v;
+}
+
+void OccupancyMap::InsertScan(const ScanPose& pose, const std::vector<ScanPoint>& points)
+{
+    std::vector<ScanPoint> world;
+    TransformPoints(points, pose, world);
+
+    const int sx = WorldToCell(pose.x_mm);
+    const int sy = WorldToCell(pose.y_mm);
+    const int numPoints = (int)world.size();
+
+    //readers only look while holding the lock, so tiles can be added safely.
+    Lock();
+    m_Revision++;
+
+    //free space first, so a cell that's both hit and passed through by
+    //another ray this scan ends up occupied.
+    Tile* pCached = NULL;
+    int cachedTx = 0, cachedTy = 0;
+    bool bCached = false;
+
+    for(int iPt = 0; iPt < numPoints; iPt++)
+    {
+        const int ex = WorldToCell(world[iPt].x);
+        const int ey = WorldToCell(world[iPt].y);
+
+        //bresenham from the car to the cell before the hit.
+        int x = sx, y = sy;
+        const int dx = abs(ex - sx), dy = -abs(ey - sy);
+        const int stepX = sx < ex ? 1 : -1, stepY = sy < ey ? 1 : -1;
+        int err = dx + dy;
+
+        while(x != ex || y != ey)
+        {
+            int tx = x >> TILE_BITS;
+            int ty = y >> TILE_BITS;
+
+            if(!bCached || tx != cachedTx || ty != cachedTy)
+            {
+                TileMap::iterator it = m_Tiles.find(TileKey(tx, ty));
+                pCached = (it == m_Tiles.end()) ? NULL : it->second;
+                cachedTx = tx;
+                cachedTy = ty;
+                bCached = true;
+            }
+
+            if(pCached != NULL)
+                UpdateCell(pCached, x, y, m_MissDelta);
+
+            int e2 = 2 * err;
+
+            if(e2 >= dy)
+            {
+                err += dy;
+                x += stepX;
+            }
+
+            if(e2 <= dx)
+            {
+                err += dx;
+                y += stepY;
+            }
+        }
+    }
+
+    for(int iPt = 0; iPt < numPoints; iPt++)
+    {
+        const int ex = WorldToCell(world[iPt].x);
+        const int ey = WorldToCell(world[iPt].y);
+
+        UpdateCell(GetOrCreateTile(ex >> TILE_BITS, ey >> TILE_BITS), ex, ey, m_HitDelta);
+    }
+
+    Unlock();
+}
+
+bool OccupancyMap::GetBounds(int& minCx, int& minCy, int& maxCx, int& maxCy) const
+{
+    if(m_Tiles.empty())
+        return false;
+
+    int minTx = 0x7fffffff, minTy = 0x7fffffff;
+    int maxTx = -0x7fffffff, maxTy = -0x7fffffff;
+
+    for(TileMap::const_iterator it = m_Tiles.begin(); it != m_Tiles.end(); ++it)
+    {
+        minTx = std::min(minTx, it->second->tx);
+        minTy = std::min(minTy, it->second->ty);
+        maxTx = std::max(maxTx, it->second->tx);
+        maxTy = std::max(maxTy, it->second->ty);
+    }
+
+    minCx = minTx << TILE_BITS;
+    minCy = minTy << TILE_BITS;
+    maxCx = ((maxTx + 1) << TILE_BITS) - 1;
+    maxCy = ((maxTy + 1) << TILE_BITS) - 1;
+
+    return true;
+}
+
+void OccupancyMap::BuildLikelihood(float x_mm, float y_mm, float halfWindowMM, float sigmaMM, int numLevels,
+    LikelihoodGrid& grid) const
+{
+    const int halfCells = (int)ceilf(halfWindowMM / m_Resolution);
+    const int cx0 = WorldToCell(x_mm) - halfCells;
+    const int cy0 = WorldToCell(y_mm) - halfCells;
+    const int size = 2 * halfCells + 1;
+
+    grid.Init(cx0 * m_Resolution, cy0 * m_Resolution, m_Resolution, size, size);
+
+    //walk only the tiles that exist inside the window.
+    for(int ty = cy0 >> TILE_BITS; ty <= (cy0 + size - 1) >> TILE_BITS; ty++)
+    {
+        for(int tx = cx0 >> TILE_BITS; tx <= (cx0 + size - 1) >> TILE_BITS; tx++)
+        {
+            const Tile* pTile = FindTile(tx, ty);
+
+            if(pTile == NULL)
+                continue;
+
+            for(int iCell = 0; iCell < TILE_CELLS; iCell++)
+            {
+                if(pTile->m_Cells[iCell] < m_OccupiedThreshold)
+                    continue;
+
+                int cx = (tx << TILE_BITS) + (iCell & TILE_MASK);
+                int cy = (ty << TILE_BITS) + (iCell >> TILE_BITS);
+
+                if(cx < cx0 || cy < cy0 || cx >= cx0 + size || cy >= cy0 + size)
+                    continue;
+
+                grid.AddHit(CellToWorld(cx), CellToWorld(cy), sigmaMM);
+            }
+        }
+    }
+
+    grid.BuildPyramid(numLevels);
+}
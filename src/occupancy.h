@@ -0,0 +1,133 @@
+// occupancy.h
+//
+// Occupancy grid made of fixed size tiles, allocated the first time a return
+// lands in them. Memory grows with the area we've actually explored, and the
+// map has no edge to drive off. Cells hold log odds of being occupied, in
+// hundredths, so a tile is a small contiguous block of shorts.
+//
+// The SLAM thread is the only writer. Other threads take the lock to read,
+// and can use the tile revisions to find what changed since they last looked.
+
+#ifndef __OCCUPANCY_H__
+#define __OCCUPANCY_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <math.h>
+#include <vector>
+#include <unordered_map>
+#include "config.h"
+#include "scanmatch.h"
+
+class OccupancyMap
+{
+  public:
+
+    enum Constants
+    {
+        TILE_BITS = 6,
+        TILE_SIZE = 1 << TILE_BITS,     //cells along a tile edge
+        TILE_MASK = TILE_SIZE - 1,
+        TILE_CELLS = TILE_SIZE * TILE_SIZE,
+
+        LOG_ODDS_SCALE = 100,           //cell units per unit of log odds
+    };
+
+    struct Tile
+    {
+        int tx;
+        int ty;
+        uint32_t m_Revision;            //map revision when last changed
+        short m_Cells[TILE_CELLS];      //row major, y then x
+    };
+
+    typedef std::unordered_map<uint64_t, Tile*> TileMap;
+
+    OccupancyMap();
+    ~OccupancyMap();
+
+    void Init(Config* conf);
+
+    void Clear();
+
+    //for threads other than the writer. Hold it while looking at tiles.
+    void Lock() { pthread_mutex_lock(&m_Mutex); }
+    void Unlock() { pthread_mutex_unlock(&m_Mutex); }
+
+    //bumped by every scan inserted.
+    uint32_t GetRevision() const { return m_Revision; }
+
+    //bumped by Clear, when everything seen before is gone.
+    uint32_t GetGeneration() const { return m_Generation; }
+
+    //add a scan taken from pose. points are in the car frame. Each return
+    //raises its cell, and lowers the cells along the ray to it. Rays only
+    //lower cells in tiles that already exist, so free space alone never
+    //allocates memory.
+    void InsertScan(const ScanPose& pose, const std::vector<ScanPoint>& points);
+
+    //log odds of a cell, 0 when unknown.
+    float GetLogOdds(int cx, int cy) const;
+
+    bool IsOccupied(int cx, int cy) const { return GetCell(cx, cy) >= m_OccupiedThreshold; }
+
+    short GetCell(int cx, int cy) const
+    {
+        const Tile* pTile = FindTile(cx >> TILE_BITS, cy >> TILE_BITS);
+        return pTile ? pTile->m_Cells[((cy & TILE_MASK) << TILE_BITS) + (cx & TILE_MASK)] : 0;
+    }
+
+    int WorldToCell(float mm) const { return (int)floorf(mm / m_Resolution); }
+    float CellToWorld(int c) const { return ((float)c + 0.5f) * m_Resolution; }
+
+    float GetResolution() const { return m_Resolution; }
+    short GetOccupiedThreshold() const { return m_OccupiedThreshold; }
+    short GetClamp() const { return m_Clamp; }
+
+    const Tile* FindTile(int tx, int ty) const;
+    Tile* GetOrCreateTile(int tx, int ty);
+
+    //overwrite a whole tile, say from a saved map.
+    void SetTile(int tx, int ty, const short* pCells);
+
+    //replace everything here with the tiles of other.
+    void CopyFrom(OccupancyMap& other);
+
+    //trade tiles with other. Lets a map be rebuilt off to the side, and put
+    //in place without readers ever seeing it half done.
+    void Swap(OccupancyMap& other);
+
+    const TileMap& GetTiles() const { return m_Tiles; }
+
+    //cell bounds of the allocated tiles, inclusive. false when empty.
+    bool GetBounds(int& minCx, int& minCy, int& maxCx, int& maxCy) const;
+
+    size_t GetMemoryBytes() const { return m_Tiles.size() * sizeof(Tile); }
+
+    //fill grid with a likelihood field of the occupied cells in the window
+    //centered on x, y. For the scan matcher.
+    void BuildLikelihood(float x_mm, float y_mm, float halfWindowMM, float sigmaMM, int numLevels,
+        LikelihoodGrid& grid) const;
+
+  protected:
+
+    static uint64_t TileKey(int tx, int ty)
+    {
+        return ((uint64_t)(uint32_t)tx << 32) | (uint64_t)(uint32_t)ty;
+    }
+
+    void UpdateCell(Tile* pTile, int cx, int cy, short delta);
+
+    TileMap m_Tiles;
+    pthread_mutex_t m_Mutex;
+    uint32_t m_Revision;
+    uint32_t m_Generation;
+
+    float m_Resolution;
+    short m_HitDelta;
+    short m_MissDelta;
+    short m_Clamp;
+    short m_OccupiedThreshold;
+};
+
+#endif //__OCCUPANCY_H__
@@ -0,0 +1,155 @@
+#include <math.h>
+#include "odometry.h"
+#include "tmath.h"
+
+OdometryEstimator::OdometryEstimator()
+{
+    m_MaxSpeedMMS = 3000.0f;
+    m_WheelbaseMM = 260.0f;
+    m_MaxSteerDeg = 25.0f;
+    m_PoseWeight = 0.5f;
+
+    m_bPoseValid = false;
+    m_LastX = 0.0;
+    m_LastY = 0.0;
+    m_LastTheta = 0.0;
+    m_LastTick = 0;
+    m_NumPoses = 0;
+}
+
+void OdometryEstimator::Init(Config* conf)
+{
+    m_MaxSpeedMMS = conf->GetFloat("odom_max_speed_mm_s", 3000.0f);
+    m_WheelbaseMM = conf->GetFloat("odom_wheelbase_mm", 260.0f);
+    m_MaxSteerDeg = conf->GetFloat("odom_max_steer_deg", 25.0f);
+    m_PoseWeight = conf->GetFloat("odom_pose_weight", 0.5f);
+
+    if(m_WheelbaseMM < 1.0f)
+        m_WheelbaseMM = 1.0f;
+
+    if(m_PoseWeight < 0.0f)
+        m_PoseWeight = 0.0f;
+    else if(m_PoseWeight > 1.0f)
+        m_PoseWeight = 1.0f;
+}
+
+MotionEstimate OdometryEstimator::FromCommand(float throttle, float steering) const
+{
+    MotionEstimate m;
+
+    //bicycle model. Positive steering turns right, so clockwise.
+    m.speed_mm_s = throttle * m_MaxSpeedMMS;
+    m.yaw_rate_deg_s = TMath::RadToDeg(-m.speed_mm_s * tanf(TMath::DegToRad(steering * m_MaxSteerDeg)) / m_WheelbaseMM);
+
+    return m;
+}
+
+void OdometryEstimator::AddPose(double x_mm, double y_mm, double theta_deg, uint64_t tick)
+{
+    if(m_NumPoses > 0 && tick > m_LastTick)
+    {
+        float dt = (float)(tick - m_LastTick) * 1e-6f;
+
+        //too long between poses to say anything about the current motion.
+        if(dt < 0.5f)
+        {
+            float dx = (float)(x_mm - m_LastX);
+            float dy = (float)(y_mm - m_LastY);
+            float dtheta = (float)(theta_deg - m_LastTheta);
+
+            while(dtheta > 180.0f)
+                dtheta -= 360.0f;
+
+            while(dtheta < -180.0f)
+                dtheta += 360.0f;
+
+            //sign the speed by whether we moved along our heading or against it.
+            float heading = TMath::DegToRad((float)m_LastTheta);
+            float forward = dx * cosf(heading) + dy * sinf(heading);
+            float dist = sqrtf(dx * dx + dy * dy);
+
+            m_PoseMotion.speed_mm_s = (forward < 0.0f ? -dist : dist) / dt;
+            m_PoseMotion.yaw_rate_deg_s = dtheta / dt;
+            m_bPoseValid = true;
+        }
+        else
+        {
+            m_bPoseValid = false;
+        }
+    }
+
+    m_LastX = x_mm;
+    m_LastY = y_mm;
+    m_LastTheta = theta_deg;
+    m_LastTick = tick;
+    m_NumPoses++;
+}
+
+MotionEstimate OdometryEstimator::Estimate(float throttle, float steering) const
+{
+    MotionEstimate cmd = FromCommand(throttle, steering);
+
+    if(!m_bPoseValid)
+        return cmd;
+
+    //the command says where we are going next, the poses where we have been.
+    MotionEstimate m;
+    m.speed_mm_s = m_PoseMotion.speed_mm_s * m_PoseWeight + cmd.speed_mm_s * (1.0f - m_PoseWeight);
+    m.yaw_rate_deg_s = m_PoseMotion.yaw_rate_deg_s * m_PoseWeight + cmd.yaw_rate_deg_s * (1.0f - m_PoseWeight);
+
+    return m;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Rplidar angles increase clockwise, so the scan's y axis points to the right
+// of forward. The motion is worked out in the usual counter clockwise frame,
+// with y to the left, and flipped on the way in and out.
+
+void DeskewScan(LidarScanSoA& scan, const MotionEstimate& motion)
+{
+    const float v = motion.speed_mm_s;
+    const float w = TMath::DegToRad(motion.yaw_rate_deg_s);
+
+    if(v == 0.0f && w == 0.0f)
+        return;
+
+    for(int iRet = 0; iRet < scan.m_Count; iRet++)
+    {
+        if(scan.m_Range[iRet] <= 0.0f)
+            continue;
+
+        //pose of the car when this return was taken, relative to the end pose.
+        float t = scan.m_Time[iRet];
+        float phi = w * t;
+        float c = cosf(phi);
+        float s = sinf(phi);
+        float px, py;
+
+        if(fabsf(w) > 1e-4f)
+        {
+            px = v / w * s;
+            py = v / w * (1.0f - c);
+        }
+        else
+        {
+            px = v * t;
+            py = 0.0f;
+        }
+
+        float qx = scan.m_X[iRet];
+        float qy = -scan.m_Y[iRet];
+
+        float x = c * qx - s * qy + px;
+        float y = -(s * qx + c * qy + py);
+
+        float angle = TMath::RadToDeg(atan2f(y, x));
+
+        if(angle < 0.0f)
+            angle += 360.0f;
+
+        scan.m_X[iRet] = x;
+        scan.m_Y[iRet] = y;
+        scan.m_Range[iRet] = sqrtf(x * x + y * y);
+        scan.m_Angle[iRet] = angle;
+    }
+}
@@ -0,0 +1,61 @@
+// odometry.h
+//
+// Rough estimate of how the car is moving, for correcting lidar scans taken
+// while driving. We have no wheel encoders, so this blends what we told the
+// car to do with how the SLAM pose has actually been changing.
+
+#ifndef __ODOMETRY_H__
+#define __ODOMETRY_H__
+
+#include <stdint.h>
+#include "config.h"
+#include "lidar.h"
+
+struct MotionEstimate
+{
+    MotionEstimate() : speed_mm_s(0.0f), yaw_rate_deg_s(0.0f) {}
+
+    float speed_mm_s;       //forward speed, negative in reverse
+    float yaw_rate_deg_s;   //counter clockwise seen from above
+};
+
+class OdometryEstimator
+{
+  public:
+
+    OdometryEstimator();
+
+    void Init(Config* conf);
+
+    //motion implied by a throttle and steering command, each -1 to 1.
+    MotionEstimate FromCommand(float throttle, float steering) const;
+
+    //track the pose solution, to measure motion from the last two poses.
+    void AddPose(double x_mm, double y_mm, double theta_deg, uint64_t tick);
+
+    //best guess at current motion, given the average command over the scan.
+    MotionEstimate Estimate(float throttle, float steering) const;
+
+  protected:
+
+    float m_MaxSpeedMMS;
+    float m_WheelbaseMM;
+    float m_MaxSteerDeg;
+    float m_PoseWeight;
+
+    bool m_bPoseValid;
+    MotionEstimate m_PoseMotion;
+
+    double m_LastX;
+    double m_LastY;
+    double m_LastTheta;
+    uint64_t m_LastTick;
+    int m_NumPoses;
+};
+
+//Move every return of the scan into the lidar frame at the end of the scan,
+//assuming constant motion over the revolution. Uses the per return times in
+//scan.m_Time, and updates angle, range, x and y.
+void DeskewScan(LidarScanSoA& scan, const MotionEstimate& motion);
+
+#endif //__ODOMETRY_H__
@@ -1,8 +1,10 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
 #include "path.h"
 #include "tmath.h"
+#include "trace.h"
 
 using namespace TMath;
 
@@ -10,11 +12,18 @@ void Path::Reset()
 {
     m_iActiveSpan = 0;
     m_nodes.clear();
+    m_spacing = 0.0f;
+    m_maxSpeed = 0.0f;
+    m_activeArc = 0.0f;
+    m_bIndexDirty = true;
 }
 
 void Path::AddNode(const PathNode &n)
 {
     m_nodes.push_back(n);
+    m_spacing = 0.0f;
+    m_maxSpeed = 0.0f;
+    m_bIndexDirty = true;
 }
 
 PathNode *Path::GetActiveNode()
@@ -25,74 +34,277 @@ PathNode *Path::GetActiveNode()
     return NULL;
 }
 
-void Path::Start(const TMath::Vector2 &pos)
+float Path::GetLength()
 {
-    int iClosest = -1;
-    float closestDist = 1000000.0f;
+    UpdateIndex();
 
-    for(int iN = 0; iN < m_nodes.size(); iN++)
-    {
-        PathNode& n = m_nodes[iN];
-        float d = (n.pos - pos).Mag();
+    if(m_segments.empty())
+        return 0.0f;
+
+    const PathSegment& last = m_segments.back();
+    return last.arcStart + last.length;
+}
+
+// work out each span once, and bin them in a grid for nearest queries.
+void Path::UpdateIndex()
+{
+    const int numSegs = m_nodes.size() > 1 ? (int)m_nodes.size() - 1 : 0;
+
+    if(!m_bIndexDirty && (int)m_segments.size() == numSegs)
+        return;
+
+    m_bIndexDirty = false;
+    m_segments.resize(numSegs);
 
-        if(d < closestDist)
+    float arc = 0.0f;
+    Vector2 lo(1e30f, 1e30f), hi(-1e30f, -1e30f);
+
+    for(int iS = 0; iS < numSegs; iS++)
+    {
+        PathSegment& seg = m_segments[iS];
+        seg.start = m_nodes[iS].pos;
+        seg.dir = m_nodes[iS + 1].pos - seg.start;
+        seg.length = seg.dir.Normalize();
+        seg.arcStart = arc;
+        arc += seg.length;
+
+        for(int iN = iS; iN <= iS + 1; iN++)
         {
-            d = closestDist;
-            iClosest = iN;
-            m_iActiveSpan = iN;
+            const Vector2& p = m_nodes[iN].pos;
+            lo = Vector2(p.x < lo.x ? p.x : lo.x, p.y < lo.y ? p.y : lo.y);
+            hi = Vector2(p.x > hi.x ? p.x : hi.x, p.y > hi.y ? p.y : hi.y);
         }
     }
 
-    m_iActiveSpan = 0;
-    printf("starting w active span: %d\n", m_iActiveSpan);
+    m_cellStart.clear();
+    m_cellSegs.clear();
+    m_gridW = m_gridH = 0;
+
+    if(numSegs == 0)
+        return;
+
+    // a couple of segments a cell, but no more than 256 cells a side.
+    const float maxCells = 256.0f;
+    m_gridCell = (arc / numSegs) * 2.0f;
+
+    if(m_gridCell < (hi.x - lo.x) / maxCells)
+        m_gridCell = (hi.x - lo.x) / maxCells;
+
+    if(m_gridCell < (hi.y - lo.y) / maxCells)
+        m_gridCell = (hi.y - lo.y) / maxCells;
+
+    if(m_gridCell <= 0.0f)
+        m_gridCell = 1.0f;
+
+    m_gridOrigin = lo;
+    m_gridW = (int)((hi.x - lo.x) / m_gridCell) + 1;
+    m_gridH = (int)((hi.y - lo.y) / m_gridCell) + 1;
+
+    // count, then fill, the cells each segment's bounds touch.
+    std::vector<int> count(m_gridW * m_gridH + 1, 0);
+
+    for(int pass = 0; pass < 2; pass++)
+    {
+        for(int iS = 0; iS < numSegs; iS++)
+        {
+            const Vector2& a = m_nodes[iS].pos;
+            const Vector2& b = m_nodes[iS + 1].pos;
+            int x0 = (int)(((a.x < b.x ? a.x : b.x) - lo.x) / m_gridCell);
+            int x1 = (int)(((a.x > b.x ? a.x : b.x) - lo.x) / m_gridCell);
+            int y0 = (int)(((a.y < b.y ? a.y : b.y) - lo.y) / m_gridCell);
+            int y1 = (int)(((a.y > b.y ? a.y : b.y) - lo.y) / m_gridCell);
+
+            for(int y = y0; y <= y1 && y < m_gridH; y++)
+            {
+                for(int x = x0; x <= x1 && x < m_gridW; x++)
+                {
+                    int iCell = y * m_gridW + x;
+
+                    if(pass == 0)
+                        count[iCell]++;
+                    else
+                        m_cellSegs[m_cellStart[iCell] + count[iCell]++] = iS;
+                }
+            }
+        }
+
+        if(pass == 0)
+        {
+            m_cellStart.resize(m_gridW * m_gridH + 1);
+            int total = 0;
+
+            for(int iCell = 0; iCell <= m_gridW * m_gridH; iCell++)
+            {
+                m_cellStart[iCell] = total;
+                total += count[iCell];
+                count[iCell] = 0;
+            }
+
+            m_cellSegs.resize(total);
+        }
+    }
 }
 
-// take a pos and update the cross track error in err.
-// returns true if still on the path, if non looping
+void Path::Project(int iSegment, const TMath::Vector2 &pos, PathProjection &proj) const
+{
+    const PathSegment& seg = m_segments[iSegment];
+    float t = (pos - seg.start).Dot(seg.dir);
+
+    if(t < 0.0f)
+        t = 0.0f;
+    else if(t > seg.length)
+        t = seg.length;
+
+    proj.iSegment = iSegment;
+    proj.t = t;
+    proj.point = seg.start + seg.dir * t;
+    proj.dist = (proj.point - pos).Mag();
+    proj.arc = seg.arcStart + t;
+}
 
-bool Path::Update(const TMath::Vector2& pos, float& crossTrackErr)
+// search rings of cells outward from pos, until no cell left could hold
+// anything closer than the best so far.
+bool Path::FindNearest(const TMath::Vector2 &pos, PathProjection &proj)
 {
-    if(m_iActiveSpan >= m_nodes.size() - 2)
+    UpdateIndex();
+
+    if(m_segments.empty())
+        return false;
+
+    proj.dist = 1e30f;
+
+    int cx = (int)floorf((pos.x - m_gridOrigin.x) / m_gridCell);
+    int cy = (int)floorf((pos.y - m_gridOrigin.y) / m_gridCell);
+    cx = cx < 0 ? 0 : (cx >= m_gridW ? m_gridW - 1 : cx);
+    cy = cy < 0 ? 0 : (cy >= m_gridH ? m_gridH - 1 : cy);
+
+    const int maxRing = (m_gridW > m_gridH ? m_gridW : m_gridH);
+    PathProjection candidate;
+
+    for(int ring = 0; ring <= maxRing; ring++)
     {
-        if(!m_looping)
-            return false;
+        bool bAnyCloser = false;
 
-        m_iActiveSpan = 0;
+        for(int y = cy - ring; y <= cy + ring; y++)
+        {
+            if(y < 0 || y >= m_gridH)
+                continue;
+
+            // only the edge of the ring. The inside was done already.
+            int step = (y == cy - ring || y == cy + ring) ? 1 : 2 * ring;
+
+            for(int x = cx - ring; x <= cx + ring; x += (step > 0 ? step : 1))
+            {
+                if(x < 0 || x >= m_gridW)
+                    continue;
+
+                // distance from pos to the cell's box.
+                float bx0 = m_gridOrigin.x + x * m_gridCell, by0 = m_gridOrigin.y + y * m_gridCell;
+                float dx = pos.x < bx0 ? bx0 - pos.x : (pos.x > bx0 + m_gridCell ? pos.x - bx0 - m_gridCell : 0.0f);
+                float dy = pos.y < by0 ? by0 - pos.y : (pos.y > by0 + m_gridCell ? pos.y - by0 - m_gridCell : 0.0f);
+
+                if(dx * dx + dy * dy >= proj.dist * proj.dist)
+                    continue;
+
+                bAnyCloser = true;
+                int iCell = y * m_gridW + x;
+
+                for(int i = m_cellStart[iCell]; i < m_cellStart[iCell + 1]; i++)
+                {
+                    Project(m_cellSegs[i], pos, candidate);
+
+                    if(candidate.dist < proj.dist)
+                        proj = candidate;
+                }
+            }
+        }
+
+        if(!bAnyCloser && ring > 0 && proj.dist < 1e30f)
+            break;
     }
 
-    printf("pos %0.2f, %0.2f\n", pos.x, pos.y);
+    return true;
+}
+
+void Path::Start(const TMath::Vector2 &pos)
+{
+    PathProjection proj;
+    m_iActiveSpan = 0;
+
+    if(FindNearest(pos, proj))
+        m_iActiveSpan = proj.iSegment;
 
-    PathNode& a = m_nodes[m_iActiveSpan];
-    PathNode& b = m_nodes[m_iActiveSpan + 1];
+    TRACE(TRACE_INFO, "starting w active span: %d\n", m_iActiveSpan);
+}
+
+// follow the active span along, or find the path again when we're far off it.
+// returns false past the end, if non looping.
 
-    printf("a %0.2f, %0.2f\n", a.pos.x, a.pos.y);
-    printf("b %0.2f, %0.2f\n", b.pos.x, b.pos.y);
+bool Path::Track(const TMath::Vector2& pos, PathProjection& proj)
+{
+    UpdateIndex();
 
-    LineSeg2d pathSeg(a.pos, b.pos);
+    const int numSegs = (int)m_segments.size();
 
-	LineSeg2d::LineSegResult offEnd;
+    if(numSegs == 0)
+        return false;
 
-    Vector2 closePt = pathSeg.ClosestPointOnLineTo(pos, offEnd);
+    if((int)m_iActiveSpan >= numSegs)
+        m_iActiveSpan = m_looping ? 0 : numSegs - 1;
 
-    printf("cl %0.2f, %0.2f\n", closePt.x, closePt.y);
+    // the active span and its neighbors, around the loop if there is one.
+    PathProjection candidate;
+    proj.dist = 1e30f;
 
-    if(offEnd == LineSeg2d::eOffEndB)
+    for(int iS = (int)m_iActiveSpan - 1; iS <= (int)m_iActiveSpan + 2; iS++)
     {
-        m_iActiveSpan++;
+        int i = iS;
+
+        if(m_looping)
+            i = (i + numSegs) % numSegs;
+        else if(i < 0 || i >= numSegs)
+            continue;
+
+        Project(i, pos, candidate);
+
+        if(candidate.dist < proj.dist)
+            proj = candidate;
     }
-    else if(offEnd == LineSeg2d::eOffEndA)
+
+    // knocked off the path, or it skipped ahead. Find it again.
+    if(proj.dist > m_reacquireDist && FindNearest(pos, candidate) && candidate.dist < proj.dist)
     {
-        if(m_iActiveSpan > 0)
-            m_iActiveSpan--;
+        TRACE(TRACE_INFO, "reacquired path at span %d, was %d\n", candidate.iSegment, m_iActiveSpan);
+        proj = candidate;
     }
 
-    Vector2 errVec = closePt - pos;
+    m_iActiveSpan = proj.iSegment;
+    m_activeArc = proj.arc;
+
+    // past the end.
+    if(!m_looping && proj.iSegment == numSegs - 1 && proj.t >= m_segments[numSegs - 1].length)
+        return false;
+
+    return true;
+}
+
+// take a pos and update the cross track error in err.
+// returns true if still on the path, if non looping
+
+bool Path::Update(const TMath::Vector2& pos, float& crossTrackErr)
+{
+    PathProjection proj;
+
+    if(!Track(pos, proj))
+        return false;
+
+    Vector2 errVec = proj.point - pos;
 
     float sign = 1.0f;
 
     float mag = errVec.Normalize() * 0.01f;
 
-    if( errVec.Cross(pathSeg.m_ray) < 0.0f)
+    if( errVec.Cross(m_segments[proj.iSegment].dir) > 0.0f)
         sign = -1.0f;
 
     crossTrackErr = mag * sign;
@@ -100,6 +312,329 @@ bool Path::Update(const TMath::Vector2& pos, float& crossTrackErr)
     return true;
 }
 
+int Path::SegmentAtArc(float arc)
+{
+    UpdateIndex();
+
+    if(m_segments.empty())
+        return -1;
+
+    float length = GetLength();
+
+    if(m_looping && length > 0.0f)
+    {
+        arc = fmodf(arc, length);
+
+        if(arc < 0.0f)
+            arc += length;
+    }
+
+    // last segment starting at or before arc.
+    int lo = 0, hi = (int)m_segments.size() - 1;
+
+    while(lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+
+        if(m_segments[mid].arcStart <= arc)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+TMath::Vector2 Path::PointAtArc(float arc)
+{
+    int iSeg = SegmentAtArc(arc);
+
+    if(iSeg < 0)
+        return m_nodes.empty() ? Vector2() : m_nodes[0].pos;
+
+    float length = GetLength();
+
+    if(m_looping && length > 0.0f)
+    {
+        arc = fmodf(arc, length);
+
+        if(arc < 0.0f)
+            arc += length;
+    }
+
+    const PathSegment& seg = m_segments[iSeg];
+    float t = arc - seg.arcStart;
+
+    if(t < 0.0f)
+        t = 0.0f;
+    else if(t > seg.length)
+        t = seg.length;
+
+    return seg.start + seg.dir * t;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// smoothing and the speed profile
+
+// points every spacing along the polyline, and the end.
+static void ResamplePolyline(const std::vector<Vector2>& in, float spacing, std::vector<Vector2>& out)
+{
+    out.clear();
+
+    if(in.empty())
+        return;
+
+    out.push_back(in[0]);
+    float carry = 0.0f;
+
+    for(size_t i = 0; i + 1 < in.size(); i++)
+    {
+        Vector2 d = in[i + 1] - in[i];
+        float len = d.Mag();
+        float t = spacing - carry;
+
+        while(t <= len)
+        {
+            out.push_back(in[i] + d * (t / len));
+            t += spacing;
+        }
+
+        carry = len - (t - spacing);
+    }
+
+    // the end, unless the last point is already close to it.
+    if(carry > spacing * 0.5f || out.size() < 2)
+        out.push_back(in.back());
+    else
+        out.back() = in.back();
+}
+
+// Whittaker smoother. Minimizes the distance to the points plus lambda times
+// the squared second differences, the discrete form of a smoothing spline.
+// The system is pentadiagonal, so a banded LDL^T solves it in O(n).
+static void SmoothSeries(std::vector<float>& v, float lambda)
+{
+    const int n = (int)v.size();
+
+    if(n < 3)
+        return;
+
+    std::vector<float> a0(n, 1.0f), a1(n, 0.0f), a2(n, 0.0f);
+
+    // lambda * D^T D, a row of (1, -2, 1) at a time.
+    for(int k = 0; k + 2 < n; k++)
+    {
+        a0[k] += lambda;
+        a0[k + 1] += 4.0f * lambda;
+        a0[k + 2] += lambda;
+        a1[k] += -2.0f * lambda;
+        a1[k + 1] += -2.0f * lambda;
+        a2[k] += lambda;
+    }
+
+    std::vector<float> d(n), l1(n, 0.0f), l2(n, 0.0f);
+
+    for(int i = 0; i < n; i++)
+    {
+        float di = a0[i];
+
+        if(i >= 1)
+            di -= l1[i - 1] * l1[i - 1] * d[i - 1];
+
+        if(i >= 2)
+            di -= l2[i - 2] * l2[i - 2] * d[i - 2];
+
+        d[i] = di;
+        l1[i] = (a1[i] - (i >= 1 ? l2[i - 1] * l1[i - 1] * d[i - 1] : 0.0f)) / di;
+        l2[i] = a2[i] / di;
+    }
+
+    for(int i = 0; i < n; i++)
+    {
+        if(i >= 1)
+            v[i] -= l1[i - 1] * v[i - 1];
+
+        if(i >= 2)
+            v[i] -= l2[i - 2] * v[i - 2];
+    }
+
+    for(int i = 0; i < n; i++)
+        v[i] /= d[i];
+
+    for(int i = n - 1; i >= 0; i--)
+    {
+        if(i + 1 < n)
+            v[i] -= l1[i] * v[i + 1];
+
+        if(i + 2 < n)
+            v[i] -= l2[i] * v[i + 2];
+    }
+}
+
+void Path::Smooth(float spacing, float lambda)
+{
+    if(m_nodes.size() < 3 || spacing <= 0.0f)
+        return;
+
+    std::vector<Vector2> raw(m_nodes.size()), even;
+
+    for(size_t i = 0; i < m_nodes.size(); i++)
+        raw[i] = m_nodes[i].pos;
+
+    // even spacing first, so the second differences mean the same everywhere.
+    ResamplePolyline(raw, spacing, even);
+
+    const int n = (int)even.size();
+
+    // a loop borrows points from its other end, so the seam is smoothed too.
+    const int pad = m_looping ? std::min(n / 2, 20) : 0;
+    std::vector<float> xs(n + 2 * pad), ys(n + 2 * pad);
+
+    for(int i = -pad; i < n + pad; i++)
+    {
+        const Vector2& p = even[(i + n) % n];
+        xs[i + pad] = p.x;
+        ys[i + pad] = p.y;
+    }
+
+    SmoothSeries(xs, lambda);
+    SmoothSeries(ys, lambda);
+
+    // catmull-rom through the smoothed points, finely, then even spacing
+    // along that curve.
+    const int steps = 8;
+    std::vector<Vector2> dense;
+
+    for(int i = 0; i + 1 < n; i++)
+    {
+        Vector2 p0(xs[std::max(i - 1 + pad, 0)], ys[std::max(i - 1 + pad, 0)]);
+        Vector2 p1(xs[i + pad], ys[i + pad]);
+        Vector2 p2(xs[i + 1 + pad], ys[i + 1 + pad]);
+        int i3 = std::min(i + 2 + pad, n + 2 * pad - 1);
+        Vector2 p3(xs[i3], ys[i3]);
+
+        for(int iStep = 0; iStep < steps; iStep++)
+        {
+            float t = (float)iStep / steps, t2 = t * t, t3 = t2 * t;
+
+            dense.push_back((p1 * 2.0f + (p2 - p0) * t + (p0 * 2.0f - p1 * 5.0f + p2 * 4.0f - p3) * t2
+                + (p1 * 3.0f - p0 - p2 * 3.0f + p3) * t3) * 0.5f);
+        }
+    }
+
+    dense.push_back(Vector2(xs[n - 1 + pad], ys[n - 1 + pad]));
+
+    std::vector<Vector2> smoothed;
+    ResamplePolyline(dense, spacing, smoothed);
+
+    m_nodes.resize(smoothed.size());
+
+    for(size_t i = 0; i < smoothed.size(); i++)
+    {
+        m_nodes[i] = PathNode();
+        m_nodes[i].pos = smoothed[i];
+    }
+
+    m_spacing = spacing;
+    m_maxSpeed = 0.0f;
+    m_iActiveSpan = 0;
+    m_bIndexDirty = true;
+}
+
+void Path::ComputeSpeedProfile(const PathSpeedLimits& limits)
+{
+    const int n = (int)m_nodes.size();
+
+    m_maxSpeed = 0.0f;
+
+    if(n < 3 || limits.maxSpeed <= 0.0f)
+        return;
+
+    // how far apart the nodes are, for paths not smoothed this run.
+    if(m_spacing <= 0.0f)
+        m_spacing = GetLength() / (n - 1);
+
+    // signed curvature of the circle through each node and the nodes a few
+    // hundred mm either side. Next door neighbors are too close, and any
+    // wobble left reads as a sharp turn. The ends of an open path take the
+    // curvature of the first node with room either side.
+    const int reach = std::max(1, std::min((n - 1) / 2, (int)(300.0f / m_spacing + 0.5f)));
+
+    for(int i = 0; i < n; i++)
+    {
+        int iMid = i;
+
+        if(!m_looping)
+            iMid = std::max(reach, std::min(n - 1 - reach, i));
+
+        const Vector2& a = m_nodes[(iMid - reach + n) % n].pos;
+        const Vector2& b = m_nodes[iMid].pos;
+        const Vector2& c = m_nodes[(iMid + reach) % n].pos;
+        float denom = (b - a).Mag() * (c - b).Mag() * (c - a).Mag();
+
+        m_nodes[i].curvature = denom > 1e-6f ? 2.0f * (b - a).Cross(c - b) / denom : 0.0f;
+    }
+
+    // as fast as the turn allows, then limited by how fast we can speed up
+    // after and slow down before. A loop goes round twice to settle the seam.
+    for(int i = 0; i < n; i++)
+    {
+        float k = fabsf(m_nodes[i].curvature);
+        float v = limits.maxSpeed;
+
+        if(k > 1e-9f && sqrtf(limits.maxLateralAccel / k) < v)
+            v = sqrtf(limits.maxLateralAccel / k);
+
+        m_nodes[i].speed = v;
+    }
+
+    if(!m_looping)
+        m_nodes[n - 1].speed = 0.0f;
+
+    const int passes = m_looping ? 2 : 1;
+
+    for(int pass = 0; pass < passes; pass++)
+    {
+        for(int j = 1; j < n + (m_looping ? 1 : 0); j++)
+        {
+            float vPrev = m_nodes[(j - 1) % n].speed;
+            float& v = m_nodes[j % n].speed;
+            v = std::min(v, sqrtf(vPrev * vPrev + 2.0f * limits.maxAccel * m_spacing));
+        }
+
+        for(int j = n - 2 + (m_looping ? 1 : 0); j >= 0; j--)
+        {
+            float vNext = m_nodes[(j + 1) % n].speed;
+            float& v = m_nodes[j].speed;
+            v = std::min(v, sqrtf(vNext * vNext + 2.0f * limits.maxDecel * m_spacing));
+        }
+    }
+
+    m_maxSpeed = limits.maxSpeed;
+}
+
+float Path::ThrottleAtArc(float arc) const
+{
+    if(m_maxSpeed <= 0.0f || m_spacing <= 0.0f || m_nodes.empty())
+        return 1.0f;
+
+    const int n = (int)m_nodes.size();
+    int i = (int)(arc / m_spacing + 0.5f);
+
+    if(m_looping)
+        i = ((i % n) + n) % n;
+    else
+        i = i < 0 ? 0 : (i >= n ? n - 1 : i);
+
+    return m_nodes[i].speed / m_maxSpeed;
+}
+
+void PathController::Start(const CarPose &pose)
+{
+    if(m_pPath != NULL)
+        m_pPath->Start(pose.pos);
+}
+
 PIDController::PIDController()
 {
     Kp = 10.0f;
@@ -111,6 +646,11 @@ PIDController::PIDController()
     m_totalError = 0.0f;
 }
 
+void PIDController::Init(Config* conf)
+{
+    SetVals(conf->GetFloat("pid_Kp", 1.0), conf->GetFloat("pid_Ki", 0.00001), conf->GetFloat("pid_Kd", 1.0));
+}
+
 void PIDController::SetVals(float p, float i, float d)
 {
     Kp = p;
@@ -118,32 +658,30 @@ void PIDController::SetVals(float p, float i, float d)
     Kd = d;
 }
 
-void PIDController::Start(const TMath::Vector2 &pos)
+void PIDController::Start(const CarPose &pose)
 {
     m_prevErr = 0.0f;
     m_diffErr = 0.0f;
     m_totalError = 0.0f;
 
-    if(m_pPath != NULL)
-        m_pPath->Start(pos);
-
+    PathController::Start(pose);
 }
 
-void PIDController::Update(const Vector2& pos, float& steering, float& throttle)
+void PIDController::Update(const CarPose& pose, float& steering, float& throttle)
 {
     if(m_pPath == NULL)
         return;
 
     float crossTrackErr = 0.0f;
 
-    if(m_pPath->Update(pos, crossTrackErr))
+    if(m_pPath->Update(pose.pos, crossTrackErr))
     {
-        printf("crossTrackErr %f\n", crossTrackErr);
+        TRACE(TRACE_DEBUG, "crossTrackErr %f\n", crossTrackErr);
         m_diffErr = crossTrackErr - m_prevErr;
 
         steering = (-Kp * crossTrackErr) - (Kd * m_diffErr) - (Ki * m_totalError);
 
-        throttle = 1.0f;
+        throttle = m_pPath->ThrottleAtArc(m_pPath->GetActiveArc());
 
         //accumulate total error
 		//m_totalError += crossTrackErr;
@@ -156,3 +694,92 @@ void PIDController::Update(const Vector2& pos, float& steering, float& throttle)
         throttle = 0.0f;
     }
 }
+
+PurePursuitController::PurePursuitController()
+{
+    m_wheelbase = 260.0f;
+    m_lookaheadMin = 300.0f;
+    m_lookaheadGain = 0.5f;
+    m_lookaheadMax = 2000.0f;
+}
+
+void PurePursuitController::Init(Config* conf)
+{
+    m_wheelbase = conf->GetFloat("odom_wheelbase_mm", 260.0f);
+    m_lookaheadMin = conf->GetFloat("pursuit_lookahead_min_mm", 300.0f);
+    m_lookaheadGain = conf->GetFloat("pursuit_lookahead_gain_s", 0.5f);
+    m_lookaheadMax = conf->GetFloat("pursuit_lookahead_max_mm", 2000.0f);
+}
+
+void PurePursuitController::Update(const CarPose& pose, float& steering, float& throttle)
+{
+    PathProjection proj;
+
+    if(m_pPath == NULL || !m_pPath->Track(pose.pos, proj))
+    {
+        throttle = 0.0f;
+        return;
+    }
+
+    float lookahead = m_lookaheadMin + m_lookaheadGain * fabsf(pose.speed);
+
+    if(lookahead > m_lookaheadMax)
+        lookahead = m_lookaheadMax;
+
+    Vector2 target = m_pPath->PointAtArc(proj.arc + lookahead);
+    Vector2 toTarget = target - pose.pos;
+    float dist = toTarget.Mag();
+
+    if(dist < 1e-3f)
+    {
+        steering = 0.0f;
+        throttle = m_pPath->ThrottleAtArc(proj.arc);
+        return;
+    }
+
+    // angle to the target from our heading, ccw. Then the wheel angle of the
+    // arc through it.
+    float alpha = atan2f(toTarget.y, toTarget.x) - DegToRad(pose.theta_deg);
+    float delta = atan2f(2.0f * m_wheelbase * sinf(alpha), dist);
+
+    steering = -RadToDeg(delta);
+    throttle = m_pPath->ThrottleAtArc(proj.arc);
+}
+
+StanleyController::StanleyController()
+{
+    m_wheelbase = 260.0f;
+    m_gain = 2.5f;
+    m_softSpeed = 200.0f;
+}
+
+void StanleyController::Init(Config* conf)
+{
+    m_wheelbase = conf->GetFloat("odom_wheelbase_mm", 260.0f);
+    m_gain = conf->GetFloat("stanley_gain", 2.5f);
+    m_softSpeed = conf->GetFloat("stanley_soft_speed_mm_s", 200.0f);
+}
+
+void StanleyController::Update(const CarPose& pose, float& steering, float& throttle)
+{
+    // the front axle is what it steers.
+    float heading = DegToRad(pose.theta_deg);
+    Vector2 front = pose.pos + Vector2(cosf(heading), sinf(heading)) * m_wheelbase;
+    PathProjection proj;
+
+    if(m_pPath == NULL || !m_pPath->Track(front, proj))
+    {
+        throttle = 0.0f;
+        return;
+    }
+
+    const PathSegment& seg = m_pPath->GetSegments()[proj.iSegment];
+
+    // how far the path is to our left, and how far we're turned from it.
+    float crossTrack = seg.dir.Cross(proj.point - front);
+    float headingErr = DegToRad(WrapDeg(RadToDeg(atan2f(seg.dir.y, seg.dir.x)) - pose.theta_deg));
+    float delta = headingErr + atan2f(m_gain * crossTrack, fabsf(pose.speed) + m_softSpeed);
+
+    steering = -RadToDeg(delta);
+    throttle = m_pPath->ThrottleAtArc(proj.arc);
+}
@@ -8,10 +8,52 @@
 
 #include <vector>
 #include "tmath.h"
+#include "config.h"
 
 struct PathNode
+{
+    PathNode() : curvature(0.0f), speed(0.0f) {}
+
+    TMath::Vector2 pos;
+    float curvature;            //1 / turn radius, positive to the left
+    float speed;                //target speed from the profile
+};
+
+//limits the speed profile is worked out under. Units of the path, per second.
+struct PathSpeedLimits
+{
+    float maxSpeed;
+    float maxLateralAccel;
+    float maxAccel;
+    float maxDecel;
+};
+
+//the span from node i to node i + 1, with what queries need worked out once.
+struct PathSegment
+{
+    TMath::Vector2 start;
+    TMath::Vector2 dir;         //unit length, toward the next node
+    float length;
+    float arcStart;             //length of the path before this span
+};
+
+//where the car is, for the controllers. theta is ccw from x, in degrees.
+//speed is in path units per second.
+struct CarPose
 {
     TMath::Vector2 pos;
+    float theta_deg;
+    float speed;
+};
+
+//where a point lands on the path.
+struct PathProjection
+{
+    int iSegment;
+    TMath::Vector2 point;
+    float t;                    //along the segment, 0 to its length
+    float dist;                 //from the point to the path
+    float arc;                  //length of the path up to point
 };
 
 class Path
@@ -22,6 +64,14 @@ class Path
     {
         m_looping = 0;
         m_iActiveSpan = 0;
+        m_reacquireDist = 500.0f;
+        m_spacing = 0.0f;
+        m_maxSpeed = 0.0f;
+        m_activeArc = 0.0f;
+        m_bIndexDirty = true;
+        m_gridCell = 1.0f;
+        m_gridW = 0;
+        m_gridH = 0;
     }
 
     void Reset();
@@ -36,26 +86,106 @@ class Path
     // returns true if still on the path, if non looping
     bool Update(const TMath::Vector2 &pos, float &crossTrackErr);
 
+    // same tracking as Update, for controllers that want the projection.
+    // returns false past the end, if non looping.
+    bool Track(const TMath::Vector2 &pos, PathProjection &proj);
+
+    // point arc along the path. Wraps when looping, else clamps to the ends.
+    TMath::Vector2 PointAtArc(float arc);
+
+    // the segment arc falls on, the same way.
+    int SegmentAtArc(float arc);
+
+    // nearest point on the whole path, from a grid over the segments.
+    // false when there are fewer than two nodes.
+    bool FindNearest(const TMath::Vector2 &pos, PathProjection &proj);
+
+    // nearest point on one segment.
+    void Project(int iSegment, const TMath::Vector2 &pos, PathProjection &proj) const;
+
+    // once recorded. Smooth out the jitter of the SLAM positions, and put the
+    // nodes every spacing along the path. lambda is how hard to smooth.
+    void Smooth(float spacing, float lambda);
+
+    // curvature at every node, and the fastest speed that keeps under the
+    // limits, braking ahead of the turns. Needs evenly spaced nodes.
+    void ComputeSpeedProfile(const PathSpeedLimits& limits);
+
+    bool HasSpeedProfile() const { return m_maxSpeed > 0.0f; }
+
+    // profile speed at arc, over the profile's top speed. 1 with no profile.
+    // Nodes are evenly spaced, so it's a lookup.
+    float ThrottleAtArc(float arc) const;
+
+    // arc of the car along the path, as of the last Track or Update.
+    float GetActiveArc() const { return m_activeArc; }
+
+    // segments, and total length, rebuilt when nodes have changed.
+    const std::vector<PathSegment>& GetSegments() { UpdateIndex(); return m_segments; }
+    float GetLength();
+
     bool m_looping;
     unsigned int m_iActiveSpan;
     std::vector<PathNode> m_nodes;
+
+    // further than this from the active span, and we look for the path
+    // again everywhere. Same units as the nodes.
+    float m_reacquireDist;
+
+  protected:
+
+    void UpdateIndex();
+
+    float m_spacing;            //between nodes, once smoothed
+    float m_maxSpeed;           //of the profile, 0 when there isn't one
+    float m_activeArc;
+
+    bool m_bIndexDirty;
+    std::vector<PathSegment> m_segments;
+
+    // uniform grid. Cell i lists segments m_cellSegs[m_cellStart[i]] up to
+    // m_cellSegs[m_cellStart[i + 1]].
+    TMath::Vector2 m_gridOrigin;
+    float m_gridCell;
+    int m_gridW;
+    int m_gridH;
+    std::vector<int> m_cellStart;
+    std::vector<int> m_cellSegs;
 };
 
-class PIDController
+// steers the car along a path. steering is in degrees of wheel angle,
+// positive to the right. throttle is 0 to 1, and 0 once off the end.
+class PathController
 {
     public:
 
-    PIDController();
+    PathController() { m_pPath = NULL; }
+    virtual ~PathController() {}
 
-    void SetVals(float p, float i, float d);
+    virtual void Init(Config* conf) {}
 
     void SetPath(Path* pPath) { m_pPath = pPath; }
 
-    void Start(const TMath::Vector2 &pos);
+    virtual void Start(const CarPose &pose);
 
-    void Update(const TMath::Vector2& carPos, float& steering, float& throttle);
+    virtual void Update(const CarPose& pose, float& steering, float& throttle) = 0;
 
     Path* m_pPath;
+};
+
+class PIDController : public PathController
+{
+    public:
+
+    PIDController();
+
+    virtual void Init(Config* conf);
+
+    void SetVals(float p, float i, float d);
+
+    virtual void Start(const CarPose &pose);
+
+    virtual void Update(const CarPose& pose, float& steering, float& throttle);
 
     float Kp;
     float Kd;
@@ -65,4 +195,41 @@ class PIDController
     float m_totalError;
 };
 
+// steer for the point a lookahead distance down the path, along the arc
+// that reaches it. The lookahead grows with speed, which keeps it from
+// weaving at speed while still cutting tight turns slow.
+class PurePursuitController : public PathController
+{
+    public:
+
+    PurePursuitController();
+
+    virtual void Init(Config* conf);
+
+    virtual void Update(const CarPose& pose, float& steering, float& throttle);
+
+    float m_wheelbase;
+    float m_lookaheadMin;
+    float m_lookaheadGain;      // seconds, lookahead per unit of speed
+    float m_lookaheadMax;
+};
+
+// Stanley, from Stanford's DARPA challenge car. Steers to match the path
+// heading, plus a correction for cross track error at the front axle that
+// softens as speed goes up.
+class StanleyController : public PathController
+{
+    public:
+
+    StanleyController();
+
+    virtual void Init(Config* conf);
+
+    virtual void Update(const CarPose& pose, float& steering, float& throttle);
+
+    float m_wheelbase;
+    float m_gain;
+    float m_softSpeed;
+};
+
 #endif //__PATH_H__
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+#include "pathfile.h"
+
+static const char PATH_MAGIC[8] = "SHRKPTH";
+
+void PathFile::ToNodes(const Path& path, std::vector<PathFileNode>& nodes)
+{
+    nodes.resize(path.m_nodes.size());
+
+    for(size_t iN = 0; iN < nodes.size(); iN++)
+    {
+        nodes[iN].x_mm = path.m_nodes[iN].pos.x;
+        nodes[iN].y_mm = path.m_nodes[iN].pos.y;
+    }
+}
+
+void PathFile::FromNodes(const PathFileNode* pNodes, uint32_t numNodes, bool bLooping, Path& path)
+{
+    path.Reset();
+
+    for(uint32_t iN = 0; iN < numNodes; iN++)
+    {
+        PathNode n;
+        n.pos = TMath::Vector2(pNodes[iN].x_mm, pNodes[iN].y_mm);
+        path.AddNode(n);
+    }
+
+    path.m_looping = bLooping;
+}
+
+bool PathFile::WriteFile(const char* filename, const PathFileBlock* pBlocks, int numBlocks)
+{
+    char tempname[1024];
+    snprintf(tempname, sizeof(tempname), "%s.tmp", filename);
+
+    FILE* fp = fopen(tempname, "wb");
+
+    if(fp == NULL)
+    {
+        printf("couldn't write %s\n", tempname);
+        return false;
+    }
+
+    bool bOk = true;
+
+    for(int iBlock = 0; iBlock < numBlocks && bOk; iBlock++)
+    {
+        if(pBlocks[iBlock].bytes > 0)
+            bOk = fwrite(pBlocks[iBlock].pData, pBlocks[iBlock].bytes, 1, fp) == 1;
+    }
+
+    //the rename can reach the disk before the data does. Get the data there first.
+    bOk = bOk && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    bOk = (fclose(fp) == 0) && bOk;
+
+    if(!bOk || rename(tempname, filename) != 0)
+    {
+        printf("failed writing %s\n", filename);
+        unlink(tempname);
+        return false;
+    }
+
+    //and the rename itself lives in the directory.
+    char dirname[1024];
+    snprintf(dirname, sizeof(dirname), "%s", filename);
+    char* pSlash = strrchr(dirname, '/');
+
+    if(pSlash == NULL)
+        snprintf(dirname, sizeof(dirname), ".");
+    else if(pSlash == dirname)
+        pSlash[1] = '\0';
+    else
+        pSlash[0] = '\0';
+
+    int fd = open(dirname, O_RDONLY);
+
+    if(fd < 0 || fsync(fd) != 0)
+        printf("couldn't sync %s, the new %s may not survive a power cut\n", dirname, filename);
+
+    if(fd >= 0)
+        close(fd);
+
+    return true;
+}
+
+bool PathFile::Save(const char* filename, const Path& path)
+{
+    if(path.m_nodes.size() < 2)
+        return false;
+
+    std::vector<PathFileNode> nodes;
+    ToNodes(path, nodes);
+
+    PathFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_Magic, PATH_MAGIC, sizeof(header.m_Magic));
+    header.m_Version = PathFileHeader::VERSION;
+    header.m_NumNodes = (uint32_t)nodes.size();
+    header.m_Looping = path.m_looping ? 1 : 0;
+    header.m_FileBytes = sizeof(PathFileHeader) + nodes.size() * sizeof(PathFileNode);
+
+    PathFileBlock blocks[2] =
+    {
+        { &header, sizeof(header) },
+        { &nodes[0], nodes.size() * sizeof(PathFileNode) },
+    };
+
+    return WriteFile(filename, blocks, 2);
+}
+
+bool PathFile::Load(const char* filename, Path& path)
+{
+    FILE* fp = fopen(filename, "rb");
+
+    if(fp == NULL)
+        return false;
+
+    PathFileHeader header;
+    std::vector<PathFileNode> nodes;
+
+    //the header sizes itself. Trust it only as far as the file really goes.
+    struct stat st;
+
+    bool bOk = fstat(fileno(fp), &st) == 0 &&
+        fread(&header, sizeof(header), 1, fp) == 1 &&
+        header.m_FileBytes == (uint64_t)st.st_size &&
+        memcmp(header.m_Magic, PATH_MAGIC, sizeof(header.m_Magic)) == 0 &&
+        header.m_Version == PathFileHeader::VERSION &&
+        header.m_NumNodes >= 2 &&
+        header.m_FileBytes == sizeof(PathFileHeader) + (uint64_t)header.m_NumNodes * sizeof(PathFileNode);
+
+    if(bOk)
+    {
+        nodes.resize(header.m_NumNodes);
+        bOk = fread(&nodes[0], sizeof(PathFileNode), nodes.size(), fp) == nodes.size();
+    }
+
+    fclose(fp);
+
+    if(!bOk)
+    {
+        printf("%s isn't a path file we can read.\n", filename);
+        return false;
+    }
+
+    FromNodes(&nodes[0], header.m_NumNodes, header.m_Looping != 0, path);
+
+    return true;
+}
@@ -0,0 +1,72 @@
+// pathfile.h
+//
+// On disk format for a recorded path on its own, so one can be swapped in
+// without the map it was recorded on. A header and the nodes, little endian
+// and naturally aligned, written to a temp file and renamed over the old one.
+//
+//   PathFileHeader
+//   PathFileNode  x m_NumNodes  in driving order
+//
+// Map files keep the path they were recorded with as the same nodes.
+//
+// Only positions are kept. The speed profile depends on the limits in the
+// config, so it's worked out again after loading.
+
+#ifndef __PATH_FILE_H__
+#define __PATH_FILE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "path.h"
+
+struct PathFileHeader
+{
+    enum Constants
+    {
+        VERSION = 1,
+    };
+
+    char m_Magic[8];            //"SHRKPTH"
+    uint32_t m_Version;
+    uint32_t m_NumNodes;
+    uint32_t m_Looping;
+    uint32_t m_Reserved;
+    uint64_t m_FileBytes;
+};
+
+struct PathFileNode
+{
+    float x_mm;
+    float y_mm;
+};
+
+//a run of bytes to write, for WriteFile.
+struct PathFileBlock
+{
+    const void* pData;
+    size_t bytes;
+};
+
+class PathFile
+{
+  public:
+
+    //false when there's nothing worth saving, or the write failed.
+    static bool Save(const char* filename, const Path& path);
+
+    //replace the nodes of path with the ones in the file. path is left
+    //alone when the file is missing or isn't one of ours.
+    static bool Load(const char* filename, Path& path);
+
+    //between a path and its nodes on disk. Shared with MapFile.
+    static void ToNodes(const Path& path, std::vector<PathFileNode>& nodes);
+    static void FromNodes(const PathFileNode* pNodes, uint32_t numNodes, bool bLooping, Path& path);
+
+    //write the blocks to a temp file and rename it over filename, syncing
+    //the file before and its directory after, so neither a crash nor a power
+    //cut leaves half a file. Shared with MapFile.
+    static bool WriteFile(const char* filename, const PathFileBlock* pBlocks, int numBlocks);
+};
+
+#endif //__PATH_FILE_H__
@@ -0,0 +1,380 @@
+#include <string.h>
+#include <math.h>
+#include "poseekf.h"
+#include "tmath.h"
+
+PoseEKF::PoseEKF()
+{
+    m_iHead = 0;
+    m_Count = 0;
+    m_QPos = 2500.0f;
+    m_QPosSpeed = 20.0f;
+    m_QTheta = 0.0012f;
+    m_QThetaRate = 0.01f;
+    m_QScale = 0.01f;
+    m_MinScale = 0.5f;
+    m_MaxScale = 2.0f;
+    m_RPos = 50.0f;
+    m_RTheta = TMath::DegToRad(1.0f);
+    m_MinScore = 0.1f;
+    m_Gate = 16.3f;
+    m_MaxRejects = 5;
+    m_NumRejected = 0;
+    m_RejectRun = 0;
+
+    m_History.resize(200);
+}
+
+void PoseEKF::Init(Config* conf)
+{
+    m_Odometry.Init(conf);
+
+    //noise added per second. Position and heading also grow with how fast we go.
+    float posSD = conf->GetFloat("pose_ekf_pos_sd_mm", 50.0f);
+    float thetaSD = TMath::DegToRad(conf->GetFloat("pose_ekf_theta_sd_deg", 2.0f));
+
+    m_QPos = posSD * posSD;
+    m_QPosSpeed = conf->GetFloat("pose_ekf_pos_per_speed", 20.0f);
+    m_QTheta = thetaSD * thetaSD;
+    m_QThetaRate = conf->GetFloat("pose_ekf_theta_per_rate", 0.01f);
+    m_QScale = conf->GetFloat("pose_ekf_scale_sd", 0.1f) * conf->GetFloat("pose_ekf_scale_sd", 0.1f);
+
+    //a scale that isn't positive would drive us backwards. Keep it believable.
+    m_MinScale = conf->GetFloat("pose_ekf_min_scale", 0.5f);
+    m_MaxScale = conf->GetFloat("pose_ekf_max_scale", 2.0f);
+
+    if(m_MinScale < 0.01f)
+        m_MinScale = 0.01f;
+
+    if(m_MaxScale < m_MinScale)
+        m_MaxScale = m_MinScale;
+
+    float slamPosSD = conf->GetFloat("pose_ekf_slam_pos_sd_mm", 50.0f);
+    float slamThetaSD = conf->GetFloat("pose_ekf_slam_theta_sd_deg", 1.0f);
+
+    m_RPos = slamPosSD;
+    m_RTheta = TMath::DegToRad(slamThetaSD);
+    m_MinScore = conf->GetFloat("pose_ekf_min_score", 0.1f);
+    m_Gate = conf->GetFloat("pose_ekf_gate", 16.3f);
+    m_MaxRejects = conf->GetInt("pose_ekf_max_rejects", 5);
+
+    int depth = conf->GetInt("pose_ekf_history", 200);
+    m_History.resize(depth < 2 ? 2 : depth);
+    m_iHead = 0;
+    m_Count = 0;
+}
+
+void PoseEKF::Propagate(State& s, float throttle, float steering, float dt) const
+{
+    if(dt <= 0.0f)
+        return;
+
+    MotionEstimate m = m_Odometry.FromCommand(throttle, steering);
+    float v = m.speed_mm_s;
+    float w = TMath::DegToRad(m.yaw_rate_deg_s);
+    float k = s.scale;
+
+    //move along the heading half way through the turn.
+    float thetaMid = s.theta + 0.5f * k * w * dt;
+    float c = cosf(thetaMid);
+    float sn = sinf(thetaMid);
+
+    s.x += k * v * c * dt;
+    s.y += k * v * sn * dt;
+    s.theta = TMath::WrapRad(s.theta + k * w * dt);
+
+    //jacobian of the motion with respect to the state.
+    float F[NUM_STATES][NUM_STATES];
+    memset(F, 0, sizeof(F));
+
+    for(int i = 0; i < NUM_STATES; i++)
+        F[i][i] = 1.0f;
+
+    F[0][2] = -k * v * sn * dt;
+    F[0][3] = v * c * dt - k * v * sn * 0.5f * w * dt * dt;
+    F[1][2] = k * v * c * dt;
+    F[1][3] = v * sn * dt + k * v * c * 0.5f * w * dt * dt;
+    F[2][3] = w * dt;
+
+    //P = F P F' + Q
+    float FP[NUM_STATES][NUM_STATES];
+
+    for(int i = 0; i < NUM_STATES; i++)
+        for(int j = 0; j < NUM_STATES; j++)
+        {
+            float sum = 0.0f;
+
+            for(int l = 0; l < NUM_STATES; l++)
+                sum += F[i][l] * s.P[l][j];
+
+            FP[i][j] = sum;
+        }
+
+    for(int i = 0; i < NUM_STATES; i++)
+        for(int j = 0; j < NUM_STATES; j++)
+        {
+            float sum = 0.0f;
+
+            for(int l = 0; l < NUM_STATES; l++)
+                sum += FP[i][l] * F[j][l];
+
+            s.P[i][j] = sum;
+        }
+
+    float qPos = (m_QPos + m_QPosSpeed * fabsf(k * v)) * dt;
+    float qTheta = (m_QTheta + m_QThetaRate * fabsf(k * w)) * dt;
+
+    s.P[0][0] += qPos;
+    s.P[1][1] += qPos;
+    s.P[2][2] += qTheta;
+    s.P[3][3] += m_QScale * dt;
+
+    ClampScale(s);
+}
+
+void PoseEKF::ClampScale(State& s) const
+{
+    if(s.scale < m_MinScale)
+        s.scale = m_MinScale;
+    else if(s.scale > m_MaxScale)
+        s.scale = m_MaxScale;
+}
+
+bool PoseEKF::Update(State& s, const float z[3], const float R[3][3])
+{
+    float y[3];
+    y[0] = (float)(z[0] - s.x);
+    y[1] = (float)(z[1] - s.y);
+    y[2] = TMath::WrapRad(z[2] - s.theta);
+
+    float S[3][3], Sinv[3][3];
+
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            S[i][j] = s.P[i][j] + R[i][j];
+
+    if(!TMath::Invert33(S, Sinv))
+        return false;
+
+    //mahalanobis distance of the innovation. Too far and it's a bad match.
+    float d2 = 0.0f;
+
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            d2 += y[i] * Sinv[i][j] * y[j];
+
+    if(d2 > m_Gate)
+        return false;
+
+    //K = P H' S^-1, where H picks the first three states.
+    float K[NUM_STATES][3];
+
+    for(int i = 0; i < NUM_STATES; i++)
+        for(int j = 0; j < 3; j++)
+        {
+            float sum = 0.0f;
+
+            for(int l = 0; l < 3; l++)
+                sum += s.P[i][l] * Sinv[l][j];
+
+            K[i][j] = sum;
+        }
+
+    float dx[NUM_STATES];
+
+    for(int i = 0; i < NUM_STATES; i++)
+        dx[i] = K[i][0] * y[0] + K[i][1] * y[1] + K[i][2] * y[2];
+
+    s.x += dx[0];
+    s.y += dx[1];
+    s.theta = TMath::WrapRad(s.theta + dx[2]);
+    s.scale += dx[3];
+
+    ClampScale(s);
+
+    //P = (I - K H) P, kept symmetric.
+    float P[NUM_STATES][NUM_STATES];
+
+    for(int i = 0; i < NUM_STATES; i++)
+        for(int j = 0; j < NUM_STATES; j++)
+            P[i][j] = s.P[i][j] - (K[i][0] * s.P[0][j] + K[i][1] * s.P[1][j] + K[i][2] * s.P[2][j]);
+
+    for(int i = 0; i < NUM_STATES; i++)
+        for(int j = 0; j < NUM_STATES; j++)
+            s.P[i][j] = 0.5f * (P[i][j] + P[j][i]);
+
+    return true;
+}
+
+void PoseEKF::Reset(State& s, double x_mm, double y_mm, float theta, const float R[3][3], uint64_t tick) const
+{
+    s.x = x_mm;
+    s.y = y_mm;
+    s.theta = theta;
+    s.scale = 1.0f;
+    s.tick = tick;
+    s.throttle = 0.0f;
+    s.steering = 0.0f;
+
+    memset(s.P, 0, sizeof(s.P));
+
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            s.P[i][j] = R[i][j];
+
+    s.P[3][3] = 0.25f;
+}
+
+void PoseEKF::Predict(float throttle, float steering, uint64_t tick)
+{
+    if(!IsInitialized() || tick <= At(0).tick)
+        return;
+
+    State s = At(0);
+    Propagate(s, throttle, steering, (float)(tick - s.tick) * 1e-6f);
+    s.throttle = throttle;
+    s.steering = steering;
+    s.tick = tick;
+
+    m_iHead = (m_iHead + 1) % m_History.size();
+
+    if(m_Count < (int)m_History.size())
+        m_Count++;
+
+    At(0) = s;
+}
+
+void PoseEKF::Correct(double x_mm, double y_mm, double theta_deg, const float cov[3][3], float score, uint64_t tick)
+{
+    //measurement noise. The matcher's covariance when we have one, with a floor,
+    //since it's limited by the grid resolution. Then scaled down by match quality.
+    float R[3][3];
+    memset(R, 0, sizeof(R));
+
+    if(cov != NULL)
+    {
+        for(int i = 0; i < 3; i++)
+            for(int j = 0; j < 3; j++)
+                R[i][j] = cov[i][j] * (i == 2 ? TMath::DegToRad(1.0f) : 1.0f) * (j == 2 ? TMath::DegToRad(1.0f) : 1.0f);
+    }
+
+    float floorPos = 0.25f * m_RPos * m_RPos;
+    float floorTheta = 0.25f * m_RTheta * m_RTheta;
+
+    if(cov == NULL || R[0][0] + R[1][1] <= 0.0f)
+    {
+        memset(R, 0, sizeof(R));
+        floorPos = m_RPos * m_RPos;
+        floorTheta = m_RTheta * m_RTheta;
+    }
+
+    R[0][0] = fmaxf(R[0][0], floorPos);
+    R[1][1] = fmaxf(R[1][1], floorPos);
+    R[2][2] = fmaxf(R[2][2], floorTheta);
+
+    float quality = fmaxf(score, m_MinScore);
+
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            R[i][j] /= quality * quality;
+
+    float theta = TMath::WrapRad(TMath::DegToRad((float)theta_deg));
+
+    if(!IsInitialized())
+    {
+        m_iHead = 0;
+        m_Count = 1;
+        Reset(At(0), x_mm, y_mm, theta, R, tick);
+        return;
+    }
+
+    //the newest state no later than the scan.
+    int age = 0;
+
+    while(age < m_Count && At(age).tick > tick)
+        age++;
+
+    //older than anything we kept. Too late to be useful.
+    if(age == m_Count)
+        return;
+
+    State s = At(age);
+
+    //the command that was applied from that state on.
+    const State& next = age > 0 ? At(age - 1) : At(0);
+    Propagate(s, next.throttle, next.steering, (float)(tick - s.tick) * 1e-6f);
+    s.tick = tick;
+
+    float z[3] = { (float)x_mm, (float)y_mm, theta };
+
+    if(Update(s, z, R))
+    {
+        m_RejectRun = 0;
+    }
+    else
+    {
+        m_NumRejected++;
+
+        //keep refusing SLAM and we'd drift forever. Believe it after a while.
+        if(++m_RejectRun <= m_MaxRejects)
+            return;
+
+        Reset(s, x_mm, y_mm, theta, R, tick);
+        s.throttle = next.throttle;
+        s.steering = next.steering;
+        m_RejectRun = 0;
+    }
+
+    //newer than our latest state. It becomes the latest.
+    if(age == 0 && tick > At(0).tick)
+    {
+        s.throttle = At(0).throttle;
+        s.steering = At(0).steering;
+
+        m_iHead = (m_iHead + 1) % m_History.size();
+
+        if(m_Count < (int)m_History.size())
+            m_Count++;
+
+        At(0) = s;
+        return;
+    }
+
+    //replay the commands since the scan on top of the correction.
+    State prev = s;
+
+    for(int iAge = age - 1; iAge >= 0; iAge--)
+    {
+        State& e = At(iAge);
+        State n = prev;
+
+        Propagate(n, e.throttle, e.steering, (float)(e.tick - prev.tick) * 1e-6f);
+        n.throttle = e.throttle;
+        n.steering = e.steering;
+        n.tick = e.tick;
+
+        e = n;
+        prev = n;
+    }
+
+    if(age == 0 || At(age).tick == tick)
+        At(age) = s;
+}
+
+void PoseEKF::GetEstimate(PoseEstimate& est) const
+{
+    const State& s = At(0);
+    MotionEstimate m = m_Odometry.FromCommand(s.throttle, s.steering);
+
+    est.x_mm = s.x;
+    est.y_mm = s.y;
+    est.theta_deg = TMath::RadToDeg(s.theta);
+    est.speed_mm_s = m.speed_mm_s * s.scale;
+    est.yaw_rate_deg_s = m.yaw_rate_deg_s * s.scale;
+    est.speed_scale = s.scale;
+    est.tick = s.tick;
+
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            est.cov[i][j] = s.P[i][j] * (i == 2 ? TMath::RadToDeg(1.0f) : 1.0f) * (j == 2 ? TMath::RadToDeg(1.0f) : 1.0f);
+}
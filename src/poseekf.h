@@ -0,0 +1,106 @@
+// poseekf.h
+//
+// Extended Kalman filter over the car's pose, so the controller gets a fresh
+// pose every few ms instead of one per lidar revolution. Between SLAM poses
+// the filter drives a bicycle model with the commanded throttle and steering.
+// Each SLAM pose then corrects it, trusted more the better the scan matched.
+//
+// The state is x, y, heading and a speed scale, which learns how far off the
+// commanded speed is from the speed SLAM sees. SLAM poses arrive late, after
+// the scan is matched, so the filter keeps a short history. A correction is
+// applied at the time of its scan, and the commands since are replayed on top.
+
+#ifndef __POSE_EKF_H__
+#define __POSE_EKF_H__
+
+#include <stdint.h>
+#include <vector>
+#include "config.h"
+#include "odometry.h"
+
+struct PoseEstimate
+{
+    double x_mm;
+    double y_mm;
+    double theta_deg;
+    float speed_mm_s;
+    float yaw_rate_deg_s;
+    float speed_scale;      //measured speed over commanded speed
+    float cov[3][3];        //x, y in mm, theta in degrees
+    uint64_t tick;
+};
+
+class PoseEKF
+{
+  public:
+
+    enum Constants
+    {
+        NUM_STATES = 4,     //x, y, theta, speed scale
+    };
+
+    PoseEKF();
+
+    void Init(Config* conf);
+
+    //false until the first SLAM pose arrives.
+    bool IsInitialized() const { return m_Count > 0; }
+
+    //move the estimate forward to tick, under the command applied since the last.
+    void Predict(float throttle, float steering, uint64_t tick);
+
+    //fold in a SLAM pose from a scan ending at tick. cov may be NULL when the
+    //backend has none. score is the match quality, 0 to 1.
+    void Correct(double x_mm, double y_mm, double theta_deg, const float cov[3][3], float score, uint64_t tick);
+
+    //the latest estimate.
+    void GetEstimate(PoseEstimate& est) const;
+
+    int GetNumRejected() const { return m_NumRejected; }
+
+  protected:
+
+    struct State
+    {
+        double x;
+        double y;
+        float theta;                //radians
+        float scale;
+        float P[NUM_STATES][NUM_STATES];
+        float throttle;             //command that brought us here
+        float steering;
+        uint64_t tick;
+    };
+
+    void Propagate(State& s, float throttle, float steering, float dt) const;
+    bool Update(State& s, const float z[3], const float R[3][3]);
+    void Reset(State& s, double x_mm, double y_mm, float theta, const float R[3][3], uint64_t tick) const;
+    void ClampScale(State& s) const;
+
+    State& At(int age) { return m_History[(m_iHead - age + m_History.size()) % m_History.size()]; }
+    const State& At(int age) const { return m_History[(m_iHead - age + m_History.size()) % m_History.size()]; }
+
+    OdometryEstimator m_Odometry;
+
+    std::vector<State> m_History;
+    int m_iHead;                    //latest state
+    int m_Count;
+
+    float m_QPos;                   //process noise, per second
+    float m_QPosSpeed;
+    float m_QTheta;
+    float m_QThetaRate;
+    float m_QScale;
+    float m_MinScale;               //speed scale is kept in this range
+    float m_MaxScale;
+    float m_RPos;                   //SLAM pose noise when the backend has no covariance
+    float m_RTheta;
+    float m_MinScore;
+    float m_Gate;                   //chi squared, 3 dof
+    int m_MaxRejects;
+
+    int m_NumRejected;
+    int m_RejectRun;
+};
+
+#endif //__POSE_EKF_H__
@@ -0,0 +1,579 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "posegraph.h"
+#include "tmath.h"
+
+ScanPose ComposePose(const ScanPose& a, const ScanPose& b)
+{
+    float c = cosf(TMath::DegToRad(a.theta_deg));
+    float s = sinf(TMath::DegToRad(a.theta_deg));
+
+    return ScanPose(a.x_mm + c * b.x_mm - s * b.y_mm,
+        a.y_mm + s * b.x_mm + c * b.y_mm,
+        TMath::WrapDeg(a.theta_deg + b.theta_deg));
+}
+
+ScanPose InversePose(const ScanPose& a)
+{
+    float c = cosf(TMath::DegToRad(a.theta_deg));
+    float s = sinf(TMath::DegToRad(a.theta_deg));
+
+    return ScanPose(-c * a.x_mm - s * a.y_mm, s * a.x_mm - c * a.y_mm, TMath::WrapDeg(-a.theta_deg));
+}
+
+//3x3 helpers for the solver.
+//out = a^T * m * b
+static void TransposeMulMul(const double a[3][3], const double m[3][3], const double b[3][3], double out[3][3])
+{
+    double mb[3][3];
+
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            mb[i][j] = m[i][0] * b[0][j] + m[i][1] * b[1][j] + m[i][2] * b[2][j];
+
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            out[i][j] = a[0][i] * mb[0][j] + a[1][i] * mb[1][j] + a[2][i] * mb[2][j];
+}
+
+static double Dot(const std::vector<double>& a, const std::vector<double>& b)
+{
+    double sum = 0.0;
+
+    for(size_t i = 0; i < a.size(); i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+PoseGraph::PoseGraph()
+{
+}
+
+int PoseGraph::AddNode(const ScanPose& pose)
+{
+    m_Poses.push_back(pose);
+
+    return (int)m_Poses.size() - 1;
+}
+
+void PoseGraph::AddEdge(int from, int to, const ScanPose& delta, const float info[3][3])
+{
+    Edge e;
+    e.from = from;
+    e.to = to;
+    e.delta = delta;
+    memcpy(e.info, info, sizeof(e.info));
+
+    m_Edges.push_back(e);
+}
+
+void PoseGraph::AddBlock(BlockRows& rows, int row, int col, const double m[3][3])
+{
+    std::vector<Block>& r = rows[row];
+
+    for(size_t iB = 0; iB < r.size(); iB++)
+    {
+        if(r[iB].col == col)
+        {
+            for(int i = 0; i < 3; i++)
+                for(int j = 0; j < 3; j++)
+                    r[iB].m[i][j] += m[i][j];
+
+            return;
+        }
+    }
+
+    Block b;
+    b.col = col;
+    memcpy(b.m, m, sizeof(b.m));
+    r.push_back(b);
+}
+
+int PoseGraph::Optimize(int maxIterations, int maxCGIterations)
+{
+    //node 0 anchors the graph, so unknown k is node k + 1.
+    const int numUnknowns = (int)m_Poses.size() - 1;
+
+    if(numUnknowns < 1 || m_Edges.empty())
+        return 0;
+
+    const int n = numUnknowns * 3;
+    std::vector<double> b(n), dx(n);
+    BlockRows H;
+
+    int iter = 0;
+
+    for(; iter < maxIterations; iter++)
+    {
+        H.assign(numUnknowns, std::vector<Block>());
+        std::fill(b.begin(), b.end(), 0.0);
+
+        for(size_t iE = 0; iE < m_Edges.size(); iE++)
+        {
+            const Edge& e = m_Edges[iE];
+            const ScanPose& pi = m_Poses[e.from];
+            const ScanPose& pj = m_Poses[e.to];
+
+            const double ci = cos(TMath::DegToRad((double)pi.theta_deg)), si = sin(TMath::DegToRad((double)pi.theta_deg));
+            const double cz = cos(TMath::DegToRad((double)e.delta.theta_deg)), sz = sin(TMath::DegToRad((double)e.delta.theta_deg));
+            const double c = ci * cz - si * sz, s = si * cz + ci * sz;
+            const double dx_mm = pj.x_mm - pi.x_mm, dy_mm = pj.y_mm - pi.y_mm;
+
+            //j seen from i, then how far that is from the measurement, in its frame.
+            const double lx = ci * dx_mm + si * dy_mm;
+            const double ly = -si * dx_mm + ci * dy_mm;
+            const double ex = lx - e.delta.x_mm, ey = ly - e.delta.y_mm;
+
+            double err[3];
+            err[0] = cz * ex + sz * ey;
+            err[1] = -sz * ex + cz * ey;
+            err[2] = TMath::DegToRad((double)TMath::WrapDeg(pj.theta_deg - pi.theta_deg - e.delta.theta_deg));
+
+            //jacobians of the error by pose i and pose j, theta in radians.
+            const double A[3][3] = {
+                { -c, -s, cz * ly - sz * lx },
+                { s, -c, -sz * ly - cz * lx },
+                { 0.0, 0.0, -1.0 } };
+
+            const double B[3][3] = {
+                { c, s, 0.0 },
+                { -s, c, 0.0 },
+                { 0.0, 0.0, 1.0 } };
+
+            double info[3][3];
+
+            for(int r = 0; r < 3; r++)
+                for(int k = 0; k < 3; k++)
+                    info[r][k] = e.info[r][k];
+
+            double infoErr[3];
+
+            for(int r = 0; r < 3; r++)
+                infoErr[r] = info[r][0] * err[0] + info[r][1] * err[1] + info[r][2] * err[2];
+
+            const int ui = e.from - 1;
+            const int uj = e.to - 1;
+            double blk[3][3];
+
+            if(ui >= 0)
+            {
+                TransposeMulMul(A, info, A, blk);
+                AddBlock(H, ui, ui, blk);
+
+                for(int r = 0; r < 3; r++)
+                    b[ui * 3 + r] += A[0][r] * infoErr[0] + A[1][r] * infoErr[1] + A[2][r] * infoErr[2];
+            }
+
+            if(uj >= 0)
+            {
+                TransposeMulMul(B, info, B, blk);
+                AddBlock(H, uj, uj, blk);
+
+                for(int r = 0; r < 3; r++)
+                    b[uj * 3 + r] += B[0][r] * infoErr[0] + B[1][r] * infoErr[1] + B[2][r] * infoErr[2];
+            }
+
+            if(ui >= 0 && uj >= 0)
+            {
+                TransposeMulMul(A, info, B, blk);
+                AddBlock(H, ui, uj, blk);
+                TransposeMulMul(B, info, A, blk);
+                AddBlock(H, uj, ui, blk);
+            }
+        }
+
+        //H dx = -b
+        for(int i = 0; i < n; i++)
+            b[i] = -b[i];
+
+        SolvePCG(H, b, dx, maxCGIterations);
+
+        double maxStepMM = 0.0, maxStepRad = 0.0;
+
+        for(int k = 0; k < numUnknowns; k++)
+        {
+            ScanPose& p = m_Poses[k + 1];
+            p.x_mm += (float)dx[k * 3 + 0];
+            p.y_mm += (float)dx[k * 3 + 1];
+            p.theta_deg = TMath::WrapDeg(p.theta_deg + (float)TMath::RadToDeg(dx[k * 3 + 2]));
+
+            maxStepMM = std::max(maxStepMM, std::max(fabs(dx[k * 3 + 0]), fabs(dx[k * 3 + 1])));
+            maxStepRad = std::max(maxStepRad, fabs(dx[k * 3 + 2]));
+        }
+
+        if(maxStepMM < 0.5 && maxStepRad < 1e-4)
+        {
+            iter++;
+            break;
+        }
+    }
+
+    return iter;
+}
+
+void PoseGraph::SolvePCG(const BlockRows& H, const std::vector<double>& b, std::vector<double>& x,
+    int maxIterations) const
+{
+    const int numRows = (int)H.size();
+    const int n = numRows * 3;
+
+    //block jacobi preconditioner.
+    std::vector<double> precond(numRows * 9, 0.0);
+
+    for(int row = 0; row < numRows; row++)
+    {
+        double inv[3][3];
+
+        for(size_t iB = 0; iB < H[row].size(); iB++)
+        {
+            if(H[row][iB].col != row)
+                continue;
+
+            if(!TMath::Invert33(H[row][iB].m, inv))
+                memset(inv, 0, sizeof(inv));
+
+            memcpy(&precond[row * 9], inv, sizeof(inv));
+        }
+    }
+
+    std::vector<double> r(b), z(n), p(n), Ap(n);
+    x.assign(n, 0.0);
+
+    for(int row = 0; row < numRows; row++)
+        for(int i = 0; i < 3; i++)
+            z[row * 3 + i] = precond[row * 9 + i * 3 + 0] * r[row * 3 + 0]
+                + precond[row * 9 + i * 3 + 1] * r[row * 3 + 1]
+                + precond[row * 9 + i * 3 + 2] * r[row * 3 + 2];
+
+    p = z;
+    double rz = Dot(r, z);
+    const double stop = Dot(b, b) * 1e-12;
+
+    for(int iter = 0; iter < maxIterations && rz != 0.0; iter++)
+    {
+        //Ap = H p, a row of blocks at a time.
+        #pragma omp parallel for if(numRows > 256)
+        for(int row = 0; row < numRows; row++)
+        {
+            double sum[3] = { 0.0, 0.0, 0.0 };
+
+            for(size_t iB = 0; iB < H[row].size(); iB++)
+            {
+                const Block& blk = H[row][iB];
+                const double* pp = &p[blk.col * 3];
+
+                for(int i = 0; i < 3; i++)
+                    sum[i] += blk.m[i][0] * pp[0] + blk.m[i][1] * pp[1] + blk.m[i][2] * pp[2];
+            }
+
+            Ap[row * 3 + 0] = sum[0];
+            Ap[row * 3 + 1] = sum[1];
+            Ap[row * 3 + 2] = sum[2];
+        }
+
+        double pAp = Dot(p, Ap);
+
+        if(pAp <= 0.0)
+            break;
+
+        double alpha = rz / pAp;
+
+        for(int i = 0; i < n; i++)
+        {
+            x[i] += alpha * p[i];
+            r[i] -= alpha * Ap[i];
+        }
+
+        if(Dot(r, r) < stop)
+            break;
+
+        for(int row = 0; row < numRows; row++)
+            for(int i = 0; i < 3; i++)
+                z[row * 3 + i] = precond[row * 9 + i * 3 + 0] * r[row * 3 + 0]
+                    + precond[row * 9 + i * 3 + 1] * r[row * 3 + 1]
+                    + precond[row * 9 + i * 3 + 2] * r[row * 3 + 2];
+
+        double rzNew = Dot(r, z);
+        double beta = rzNew / rz;
+        rz = rzNew;
+
+        for(int i = 0; i < n; i++)
+            p[i] = z[i] + beta * p[i];
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+LoopCloser::LoopCloser()
+{
+    m_bEnabled = false;
+    m_KeyDistanceMM = 300.0f;
+    m_KeyAngleDeg = 15.0f;
+    m_OdomSDMM = 20.0f;
+    m_OdomSDDeg = 1.0f;
+    m_LoopSDMM = 50.0f;
+    m_LoopSDDeg = 2.0f;
+    m_LoopRadiusMM = 2000.0f;
+    m_LoopWindowMM = 1000.0f;
+    m_LoopWindowDeg = 30.0f;
+    m_LoopMinScore = 0.6f;
+    m_LoopMinGap = 30;
+    m_LoopNeighbors = 2;
+    m_LoopEvery = 5;
+    m_NextLoopNode = 0;
+    m_Iterations = 10;
+    m_CGIterations = 200;
+    m_MaxRangeMM = 8000.0f;
+    m_SigmaMM = 60.0f;
+    m_Resolution = 40.0f;
+    m_bSubmitted = false;
+    m_NumLoops = 0;
+
+    pthread_mutex_init(&m_Mutex, NULL);
+}
+
+LoopCloser::~LoopCloser()
+{
+    for(size_t i = 0; i < m_Queue.size(); i++)
+        delete m_Queue[i];
+
+    for(size_t i = 0; i < m_Nodes.size(); i++)
+        delete m_Nodes[i];
+
+    pthread_mutex_destroy(&m_Mutex);
+}
+
+void LoopCloser::Init(Config* conf)
+{
+    m_bEnabled = conf->GetInt("posegraph_enabled", 0);
+    m_KeyDistanceMM = conf->GetFloat("posegraph_key_distance_mm", 300.0f);
+    m_KeyAngleDeg = conf->GetFloat("posegraph_key_angle_deg", 15.0f);
+    m_OdomSDMM = conf->GetFloat("posegraph_odom_sd_mm", 20.0f);
+    m_OdomSDDeg = conf->GetFloat("posegraph_odom_sd_deg", 1.0f);
+    m_LoopSDMM = conf->GetFloat("posegraph_loop_sd_mm", 50.0f);
+    m_LoopSDDeg = conf->GetFloat("posegraph_loop_sd_deg", 2.0f);
+    m_LoopRadiusMM = conf->GetFloat("posegraph_loop_radius_mm", 2000.0f);
+    m_LoopWindowMM = conf->GetFloat("posegraph_loop_window_mm", 1000.0f);
+    m_LoopWindowDeg = conf->GetFloat("posegraph_loop_window_deg", 30.0f);
+    m_LoopMinScore = conf->GetFloat("posegraph_loop_min_score", 0.6f);
+    m_LoopMinGap = conf->GetInt("posegraph_loop_min_gap", 30);
+    m_LoopNeighbors = conf->GetInt("posegraph_loop_neighbors", 2);
+    m_LoopEvery = conf->GetInt("posegraph_loop_every", 5);
+    m_Iterations = conf->GetInt("posegraph_iterations", 10);
+    m_CGIterations = conf->GetInt("posegraph_cg_iterations", 200);
+
+    //match scans the same way the front end does.
+    m_MaxRangeMM = conf->GetFloat("slam_cs_max_range_mm", 8000.0f);
+    m_SigmaMM = conf->GetFloat("slam_cs_sigma_mm", 60.0f);
+    m_Resolution = conf->GetFloat("slam_map_resolution_mm", 40.0f);
+    m_Matcher.Init(conf);
+}
+
+void LoopCloser::SubmitScan(const ScanPose& pose, const std::vector<ScanPoint>& points, const float cov[3][3],
+    uint64_t tick)
+{
+    if(m_bSubmitted)
+    {
+        float dx = pose.x_mm - m_LastSubmitted.x_mm;
+        float dy = pose.y_mm - m_LastSubmitted.y_mm;
+        float da = fabsf(TMath::WrapDeg(pose.theta_deg - m_LastSubmitted.theta_deg));
+
+        if(dx * dx + dy * dy < m_KeyDistanceMM * m_KeyDistanceMM && da < m_KeyAngleDeg)
+            return;
+    }
+
+    m_LastSubmitted = pose;
+    m_bSubmitted = true;
+
+    KeyScan* pScan = new KeyScan();
+    pScan->pose = pose;
+    pScan->points = points;
+    pScan->tick = tick;
+
+    if(cov != NULL)
+        memcpy(pScan->cov, cov, sizeof(pScan->cov));
+    else
+        memset(pScan->cov, 0, sizeof(pScan->cov));
+
+    pthread_mutex_lock(&m_Mutex);
+    m_Queue.push_back(pScan);
+    pthread_mutex_unlock(&m_Mutex);
+}
+
+ScanPose LoopCloser::Correct(const ScanPose& pose)
+{
+    pthread_mutex_lock(&m_Mutex);
+    ScanPose correction = m_Correction;
+    pthread_mutex_unlock(&m_Mutex);
+
+    return ComposePose(correction, pose);
+}
+
+//the front end covariance is x, y in mm and theta in degrees. Never trust it
+//more than the configured floor.
+void LoopCloser::EdgeInfo(const float cov[3][3], float info[3][3]) const
+{
+    double c[3][3], inv[3][3];
+    const double scale[3] = { 1.0, 1.0, TMath::DegToRad(1.0) };
+
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            c[i][j] = cov[i][j] * scale[i] * scale[j];
+
+    c[0][0] += m_OdomSDMM * m_OdomSDMM;
+    c[1][1] += m_OdomSDMM * m_OdomSDMM;
+    c[2][2] += TMath::DegToRad((double)m_OdomSDDeg) * TMath::DegToRad((double)m_OdomSDDeg);
+
+    if(!TMath::Invert33(c, inv))
+    {
+        memset(inv, 0, sizeof(inv));
+        inv[0][0] = inv[1][1] = 1.0 / (m_OdomSDMM * m_OdomSDMM);
+        inv[2][2] = 1.0 / (TMath::DegToRad((double)m_OdomSDDeg) * TMath::DegToRad((double)m_OdomSDDeg));
+    }
+
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            info[i][j] = (float)inv[i][j];
+}
+
+int LoopCloser::Process(bool& bOptimized)
+{
+    bOptimized = false;
+
+    std::deque<KeyScan*> queue;
+
+    pthread_mutex_lock(&m_Mutex);
+    queue.swap(m_Queue);
+    pthread_mutex_unlock(&m_Mutex);
+
+    if(queue.empty())
+        return 0;
+
+    bool bLoop = false;
+
+    for(size_t iQ = 0; iQ < queue.size(); iQ++)
+    {
+        KeyScan* pScan = queue[iQ];
+        const int iNode = (int)m_Nodes.size();
+
+        if(iNode == 0)
+        {
+            //start off wherever the front end's frame is mapped to now.
+            m_Graph.AddNode(ComposePose(m_Correction, pScan->pose));
+        }
+        else
+        {
+            //the front end's step since the last key scan, hung off the
+            //optimized pose of that scan.
+            ScanPose delta = RelativePose(m_Nodes[iNode - 1]->pose, pScan->pose);
+            float info[3][3];
+            EdgeInfo(pScan->cov, info);
+
+            m_Graph.AddNode(ComposePose(m_Graph.GetPose(iNode - 1), delta));
+            m_Graph.AddEdge(iNode - 1, iNode, delta, info);
+        }
+
+        m_Nodes.push_back(pScan);
+
+        //once a loop is closed, the next few key scans would only add the same one.
+        if(iNode >= m_NextLoopNode && FindLoop(iNode))
+        {
+            bLoop = true;
+            m_NextLoopNode = iNode + m_LoopEvery;
+        }
+    }
+
+    if(bLoop)
+    {
+        m_Graph.Optimize(m_Iterations, m_CGIterations);
+        bOptimized = true;
+    }
+
+    //the last key scan tells us where the front end's frame sits now.
+    const int iLast = (int)m_Nodes.size() - 1;
+    ScanPose correction = ComposePose(m_Graph.GetPose(iLast), InversePose(m_Nodes[iLast]->pose));
+
+    pthread_mutex_lock(&m_Mutex);
+    m_Correction = correction;
+    pthread_mutex_unlock(&m_Mutex);
+
+    return (int)queue.size();
+}
+
+//match key scan iNode against the nearest older one far enough back along
+//the track, and its neighbors. Adds the edge when it fits.
+bool LoopCloser::FindLoop(int iNode)
+{
+    const ScanPose& pose = m_Graph.GetPose(iNode);
+    int iBest = -1;
+    float bestDist2 = m_LoopRadiusMM * m_LoopRadiusMM;
+
+    for(int iOld = 0; iOld < iNode - m_LoopMinGap; iOld++)
+    {
+        const ScanPose& old = m_Graph.GetPose(iOld);
+        float dx = old.x_mm - pose.x_mm;
+        float dy = old.y_mm - pose.y_mm;
+        float dist2 = dx * dx + dy * dy;
+
+        if(dist2 < bestDist2)
+        {
+            bestDist2 = dist2;
+            iBest = iOld;
+        }
+    }
+
+    if(iBest < 0)
+        return false;
+
+    //a likelihood field of the old scans, in the optimized frame.
+    const ScanPose& center = m_Graph.GetPose(iBest);
+    const float halfWindow = m_MaxRangeMM + m_LoopWindowMM;
+    const int halfCells = (int)ceilf(halfWindow / m_Resolution);
+    const int size = 2 * halfCells + 1;
+
+    m_Grid.Init(center.x_mm - halfCells * m_Resolution, center.y_mm - halfCells * m_Resolution,
+        m_Resolution, size, size);
+
+    const int first = std::max(0, iBest - m_LoopNeighbors);
+    const int last = std::min(iNode - m_LoopMinGap - 1, iBest + m_LoopNeighbors);
+    std::vector<ScanPoint> world;
+
+    for(int iOld = first; iOld <= last; iOld++)
+    {
+        TransformPoints(m_Nodes[iOld]->points, m_Graph.GetPose(iOld), world);
+
+        for(size_t iPt = 0; iPt < world.size(); iPt++)
+            m_Grid.AddHit(world[iPt].x, world[iPt].y, m_SigmaMM);
+    }
+
+    m_Grid.BuildPyramid(m_Matcher.m_NumLevels);
+
+    ScanMatchResult result;
+
+    if(!m_Matcher.Match(m_Grid, m_Nodes[iNode]->points, pose, m_LoopWindowMM, m_LoopWindowDeg,
+        m_LoopMinScore, result))
+        return false;
+
+    ScanPose delta = RelativePose(center, result.pose);
+    float info[3][3];
+
+    memset(info, 0, sizeof(info));
+    info[0][0] = info[1][1] = 1.0f / (m_LoopSDMM * m_LoopSDMM);
+    info[2][2] = 1.0f / (float)(TMath::DegToRad((double)m_LoopSDDeg) * TMath::DegToRad((double)m_LoopSDDeg));
+
+    m_Graph.AddEdge(iBest, iNode, delta, info);
+    m_NumLoops++;
+
+    return true;
+}
+
+void LoopCloser::DrawScans(OccupancyMap& map, int firstNode) const
+{
+    for(int iNode = std::max(firstNode, 0); iNode < (int)m_Nodes.size(); iNode++)
+        map.InsertScan(m_Graph.GetPose(iNode), m_Nodes[iNode]->points);
+}
@@ -0,0 +1,162 @@
+// posegraph.h
+//
+// Pose graph back end for SLAM. The front end tracks scan to map and drifts a
+// little with every scan, which adds up over a lap. Here we keep key scans as
+// nodes, linked by the front end's relative poses. When the car comes back
+// somewhere it has been, matching the new scan against the old ones gives a
+// loop closure edge. Optimizing the graph then spreads the drift out over the
+// whole loop.
+//
+// All this runs in its own thread. The front end hands over scans and reads
+// back a correction, the transform from its own frame to the optimized one.
+
+#ifndef __POSE_GRAPH_H__
+#define __POSE_GRAPH_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
+#include "config.h"
+#include "scanmatch.h"
+#include "occupancy.h"
+
+//pose math in the plane. theta in degrees, like ScanPose.
+ScanPose ComposePose(const ScanPose& a, const ScanPose& b);
+ScanPose InversePose(const ScanPose& a);
+
+//b seen from a.
+inline ScanPose RelativePose(const ScanPose& a, const ScanPose& b) { return ComposePose(InversePose(a), b); }
+
+///////////////////////////////////////////////////////////////////////////////
+// The graph and its solver. Gauss-Newton, where each step solves the sparse
+// normal equations with conjugate gradients, preconditioned by the inverse of
+// the 3x3 blocks on the diagonal. Node 0 is held fixed.
+
+class PoseGraph
+{
+  public:
+
+    PoseGraph();
+
+    int AddNode(const ScanPose& pose);
+
+    //delta is to seen from from. info is the inverse covariance of delta,
+    //with theta in radians.
+    void AddEdge(int from, int to, const ScanPose& delta, const float info[3][3]);
+
+    //returns the number of Gauss-Newton steps taken.
+    int Optimize(int maxIterations, int maxCGIterations);
+
+    int GetNumNodes() const { return (int)m_Poses.size(); }
+    int GetNumEdges() const { return (int)m_Edges.size(); }
+
+    const ScanPose& GetPose(int iNode) const { return m_Poses[iNode]; }
+
+  protected:
+
+    struct Edge
+    {
+        int from;
+        int to;
+        ScanPose delta;
+        float info[3][3];
+    };
+
+    struct Block
+    {
+        int col;
+        double m[3][3];
+    };
+
+    typedef std::vector< std::vector<Block> > BlockRows;
+
+    static void AddBlock(BlockRows& rows, int row, int col, const double m[3][3]);
+
+    void SolvePCG(const BlockRows& H, const std::vector<double>& b, std::vector<double>& x, int maxIterations) const;
+
+    std::vector<ScanPose> m_Poses;
+    std::vector<Edge> m_Edges;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+class LoopCloser
+{
+  public:
+
+    LoopCloser();
+    ~LoopCloser();
+
+    void Init(Config* conf);
+
+    bool IsEnabled() const { return m_bEnabled; }
+
+    //from the front end, for every scan. Cheap. Scans far enough from the last
+    //key scan are queued for the back end. cov may be NULL.
+    void SubmitScan(const ScanPose& pose, const std::vector<ScanPoint>& points, const float cov[3][3], uint64_t tick);
+
+    //front end pose moved into the optimized frame.
+    ScanPose Correct(const ScanPose& pose);
+
+    //back end. Adds queued key scans to the graph, looks for loops, and
+    //optimizes when one is found. Returns the number of key scans added.
+    //bOptimized is set when earlier poses moved.
+    int Process(bool& bOptimized);
+
+    //draw every key scan at its optimized pose into map, on top of what's there.
+    void DrawScans(OccupancyMap& map, int firstNode) const;
+
+    int GetNumNodes() const { return m_Graph.GetNumNodes(); }
+    int GetNumLoops() const { return m_NumLoops; }
+
+  protected:
+
+    struct KeyScan
+    {
+        ScanPose pose;              //front end frame
+        std::vector<ScanPoint> points;
+        float cov[3][3];
+        uint64_t tick;
+    };
+
+    bool FindLoop(int iNode);
+    void EdgeInfo(const float cov[3][3], float info[3][3]) const;
+
+    bool m_bEnabled;
+    float m_KeyDistanceMM;
+    float m_KeyAngleDeg;
+    float m_OdomSDMM;
+    float m_OdomSDDeg;
+    float m_LoopSDMM;
+    float m_LoopSDDeg;
+    float m_LoopRadiusMM;
+    float m_LoopWindowMM;
+    float m_LoopWindowDeg;
+    float m_LoopMinScore;
+    int m_LoopMinGap;
+    int m_LoopNeighbors;
+    int m_LoopEvery;
+    int m_Iterations;
+    int m_CGIterations;
+    float m_MaxRangeMM;
+    float m_SigmaMM;
+    float m_Resolution;
+
+    //front end side
+    pthread_mutex_t m_Mutex;
+    std::deque<KeyScan*> m_Queue;
+    ScanPose m_LastSubmitted;
+    bool m_bSubmitted;
+    ScanPose m_Correction;          //front end frame to optimized
+
+    //back end side
+    PoseGraph m_Graph;
+    std::vector<KeyScan*> m_Nodes;
+    CorrelativeScanMatcher m_Matcher;
+    LikelihoodGrid m_Grid;
+    int m_NextLoopNode;
+    int m_NumLoops;
+};
+
+#endif //__POSE_GRAPH_H__
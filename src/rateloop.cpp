@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "rateloop.h"
+#include "timing.h"
+
+void LatencyHistogram::Reset()
+{
+    memset(m_Buckets, 0, sizeof(m_Buckets));
+    m_Count = 0;
+    m_Sum = 0;
+    m_Max = 0;
+}
+
+void LatencyHistogram::Add(uint64_t usec)
+{
+    int iBucket = 0;
+
+    while(iBucket < NUM_BUCKETS - 1 && (usec >> (iBucket + 1)) != 0)
+        iBucket++;
+
+    m_Buckets[iBucket]++;
+    m_Count++;
+    m_Sum += usec;
+
+    if(usec > m_Max)
+        m_Max = usec;
+}
+
+uint64_t LatencyHistogram::GetPercentile(float fraction) const
+{
+    if(m_Count == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)(fraction * m_Count);
+    uint64_t total = 0;
+
+    for(int iBucket = 0; iBucket < NUM_BUCKETS; iBucket++)
+    {
+        total += m_Buckets[iBucket];
+
+        //no more than the worst we saw, which can be well inside the bucket.
+        if(total > target)
+            return (2ULL << iBucket) < m_Max ? (2ULL << iBucket) : m_Max;
+    }
+
+    return m_Max;
+}
+
+RateLoop::RateLoop()
+{
+    Init("loop", 10.0f, 0.0f);
+}
+
+void RateLoop::Init(const char* label, float periodMS, float statsSec)
+{
+    strncpy(m_Label, label, sizeof(m_Label) - 1);
+    m_Label[sizeof(m_Label) - 1] = 0;
+
+    m_PeriodUsec = periodMS > 0.001f ? (uint64_t)(periodMS * 1000.0f) : 1;
+    m_StatsUsec = statsSec > 0.0f ? (uint64_t)(statsSec * 1000000.0f) : 0;
+
+    uint64_t now = get_time_usec();
+    m_Deadline = now + m_PeriodUsec;
+    m_PassStart = now;
+    m_StatsStart = now;
+
+    m_NumPasses = 0;
+    m_NumOverruns = 0;
+    m_NumMissed = 0;
+    m_NumEarly = 0;
+
+    m_Compute.Reset();
+    m_Jitter.Reset();
+}
+
+static void sleep_until_usec(uint64_t tick)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(tick / 1000000ULL);
+    ts.tv_nsec = (long)(tick % 1000000ULL) * 1000;
+
+    //same clock as get_time_usec. Absolute, so a signal just means going back to sleep.
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+void RateLoop::Wait()
+{
+    sleep_until_usec(BeginWait());
+    EndWait();
+}
+
+uint64_t RateLoop::BeginWait()
+{
+    uint64_t now = get_time_usec();
+
+    m_Compute.Add(now - m_PassStart);
+
+    //late. Skip to the first deadline still ahead, keeping the phase.
+    if(now >= m_Deadline)
+    {
+        uint64_t missed = (now - m_Deadline) / m_PeriodUsec + 1;
+
+        m_NumOverruns++;
+        m_NumMissed += missed - 1;
+        m_Deadline += missed * m_PeriodUsec;
+    }
+
+    return m_Deadline;
+}
+
+bool RateLoop::EndWait()
+{
+    uint64_t now = get_time_usec();
+
+    m_PassStart = now;
+
+    if(now < m_Deadline)
+    {
+        m_NumEarly++;
+        return false;
+    }
+
+    m_Jitter.Add(now - m_Deadline);
+    m_Deadline += m_PeriodUsec;
+    m_NumPasses++;
+
+    if(m_StatsUsec != 0 && now - m_StatsStart >= m_StatsUsec)
+    {
+        PrintStats();
+
+        m_StatsStart = now;
+        m_Compute.Reset();
+        m_Jitter.Reset();
+    }
+
+    return true;
+}
+
+void RateLoop::PrintStats()
+{
+    double sec = get_sec_diff_usec(get_time_usec(), m_StatsStart);
+
+    printf("%s loop: %.1f hz of %.1f, %llu overruns, %llu missed, %llu early. "
+        "compute us mean %.0f p50 %llu p99 %llu max %llu. late us mean %.0f p50 %llu p99 %llu max %llu\n",
+        m_Label, sec > 0.0 ? m_Jitter.GetCount() / sec : 0.0, 1000000.0 / m_PeriodUsec,
+        (unsigned long long)m_NumOverruns, (unsigned long long)m_NumMissed, (unsigned long long)m_NumEarly,
+        m_Compute.GetMean(), (unsigned long long)m_Compute.GetPercentile(0.5f),
+        (unsigned long long)m_Compute.GetPercentile(0.99f), (unsigned long long)m_Compute.GetMax(),
+        m_Jitter.GetMean(), (unsigned long long)m_Jitter.GetPercentile(0.5f),
+        (unsigned long long)m_Jitter.GetPercentile(0.99f), (unsigned long long)m_Jitter.GetMax());
+}
@@ -0,0 +1,91 @@
+// rateloop.h
+//
+// Runs a control loop at a fixed rate. Each pass sleeps to an absolute
+// deadline on the monotonic clock, so the rate doesn't drift with the work
+// done in the pass, and a late wake doesn't push back the ones after it.
+// A pass that runs past its deadline is an overrun. The loop picks up at the
+// next deadline still ahead, rather than run the missed ones back to back.
+//
+// Time spent in each pass, and how late each wake was, go in histograms,
+// printed every so often with the overrun count.
+
+#ifndef __RATE_LOOP_H__
+#define __RATE_LOOP_H__
+
+#include <stdint.h>
+
+//counts of times in usec, in power of two buckets. Bucket i holds [2^i, 2^(i+1)).
+class LatencyHistogram
+{
+  public:
+
+    enum Constants
+    {
+        NUM_BUCKETS = 24,
+    };
+
+    LatencyHistogram() { Reset(); }
+
+    void Reset();
+
+    void Add(uint64_t usec);
+
+    //upper bound of the bucket the fraction falls in. 0 when empty.
+    uint64_t GetPercentile(float fraction) const;
+
+    uint64_t GetMax() const { return m_Max; }
+    uint64_t GetCount() const { return m_Count; }
+    double GetMean() const { return m_Count > 0 ? (double)m_Sum / m_Count : 0.0; }
+
+  protected:
+
+    uint64_t m_Buckets[NUM_BUCKETS];
+    uint64_t m_Count;
+    uint64_t m_Sum;
+    uint64_t m_Max;
+};
+
+class RateLoop
+{
+  public:
+
+    RateLoop();
+
+    //statsSec is how often to print the stats. 0 for never.
+    void Init(const char* label, float periodMS, float statsSec);
+
+    //sleep until the next deadline.
+    void Wait();
+
+    //for a loop that sleeps on something else as well, that could wake it
+    //early. BeginWait ends the pass and gives the deadline to sleep to, in
+    //get_time_usec() ticks. EndWait starts the next pass, and returns false
+    //when woken before the deadline, which is then kept for the next wait.
+    uint64_t BeginWait();
+    bool EndWait();
+
+    uint64_t GetPeriodUsec() const { return m_PeriodUsec; }
+    uint64_t GetNumOverruns() const { return m_NumOverruns; }
+
+    void PrintStats();
+
+  protected:
+
+    char m_Label[32];
+    uint64_t m_PeriodUsec;
+    uint64_t m_StatsUsec;
+
+    uint64_t m_Deadline;
+    uint64_t m_PassStart;
+    uint64_t m_StatsStart;
+
+    uint64_t m_NumPasses;
+    uint64_t m_NumOverruns;
+    uint64_t m_NumMissed;           //deadlines skipped over by overruns
+    uint64_t m_NumEarly;            //wakes before the deadline
+
+    LatencyHistogram m_Compute;
+    LatencyHistogram m_Jitter;
+};
+
+#endif //__RATE_LOOP_H__
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include "SharkConfig.h"
+#include "rmhc.h"
+
+#if ENABLE_BRZY_SLAM
+
+#include <BreezySLAM/Position.hpp>
+#include <BreezySLAM/Velocities.hpp>
+#include <BreezySLAM/Laser.hpp>
+#include <BreezySLAM/algorithms.hpp>
+
+//We define a RPLidar object from the base Laser to provide
+//specifics about our scanning hardware.
+
+class RPLidar : public Laser
+{
+    public:
+
+    enum constants
+    {
+        NUM_RAYS_PER_SCAN = 360 * 2, //half angle per ray
+        SCAN_RATE_HZ = 10,  //data rate depends on motor speed. this is about right for default.
+        DETECTION_ANGLE_DEGREES = 360, //Some lidars scan just a portion, this scans 360
+        DISTANCE_NO_DETECTION_MM = 10000, //6M according to RobotShop. Seems longer.
+    };
+
+    RPLidar(int detection_margin = 0, float offset_mm = 0) : 
+        Laser(NUM_RAYS_PER_SCAN,
+         SCAN_RATE_HZ, 
+         DETECTION_ANGLE_DEGREES, 
+         DISTANCE_NO_DETECTION_MM, 
+         detection_margin, offset_mm) { }
+    
+};
+
+#endif //ENABLE_BRZY_SLAM
+
+RMHCSlam::RMHCSlam()
+{
+    m_pSlam = NULL;
+    m_pLaser = NULL;
+    m_pMap = NULL;
+    m_MaxRangeMM = 8000.0f;
+}
+
+RMHCSlam::~RMHCSlam()
+{
+#if ENABLE_BRZY_SLAM
+    delete m_pSlam;
+    delete m_pLaser;
+#endif
+}
+
+bool RMHCSlam::Init(Config* conf, OccupancyMap* pMap)
+{
+    m_pMap = pMap;
+    m_MaxRangeMM = conf->GetFloat("slam_cs_max_range_mm", 8000.0f);
+    m_ScanMM.resize(LidarBinnedScan::NUM_BINS);
+
+#if ENABLE_BRZY_SLAM
+
+    float offsetCarCenterMM = conf->GetFloat("slam_rmhc_lidar_offset_mm", 100.0f);
+    double map_size_meters = conf->GetFloat("slam_rmhc_map_size_m", 20.0f);
+
+    //dimension of map along one edge
+    int map_size_pixels = conf->GetInt("slam_rmhc_map_pixels", 512 * 8);
+    unsigned random_seed = conf->GetInt("slam_rmhc_seed", 43);
+
+    m_pLaser = new RPLidar(0, offsetCarCenterMM);
+
+    m_pSlam = new RMHC_SLAM(*m_pLaser, 
+        map_size_pixels,
+        map_size_meters, 
+        random_seed);
+
+    //Affects the width of returns when making the map.
+    m_pSlam->hole_width_mm = conf->GetFloat("slam_rmhc_hole_width_mm", 300.0f);
+
+    return true;
+
+#else
+
+    return false;
+
+#endif //ENABLE_BRZY_SLAM
+}
+
+void RMHCSlam::Update(const LidarBinnedScan& scan, const MotionEstimate& motion, float dt)
+{
+#if ENABLE_BRZY_SLAM
+
+    //odometry since the last scan, as a starting point for the match.
+    Velocities vel(motion.speed_mm_s * dt, motion.yaw_rate_deg_s * dt, dt);
+
+    //The scan_mm buffer assumes a return on every half angle. The scan filter
+    //has already mapped our arbitrary return angles onto those slots.
+    for(int iBin = 0; iBin < LidarBinnedScan::NUM_BINS; iBin++)
+        m_ScanMM[iBin] = (int)scan.m_Range[iBin];
+
+    //Do a pose match with previous maps and determine our location/orientation
+    m_pSlam->update(&m_ScanMM[0], vel);
+
+    //Begins in the center of the map. with zero theta.
+    Position& p = m_pSlam->getpos();
+    m_Pose = ScanPose(p.x_mm, p.y_mm, p.theta_degrees);
+
+    //keep our own map too, so the map tools work the same for either backend.
+    BinnedScanToPoints(scan, m_MaxRangeMM, m_Points);
+    m_pMap->InsertScan(m_Pose, m_Points);
+
+#endif //ENABLE_BRZY_SLAM
+}
@@ -0,0 +1,53 @@
+// rmhc.h
+//
+// BreezySLAM's RMHC_SLAM behind the same interface as ScanMatchSLAM, so the
+// car and shark_mapper set it up the same way. RMHC keeps its own map inside
+// the library. Scans are also added to our occupancy map at the pose it
+// reports, so the map tools work with either backend.
+//
+// https://github.com/simondlevy/BreezySLAM
+
+#ifndef __RMHC_H__
+#define __RMHC_H__
+
+#include <vector>
+#include "config.h"
+#include "odometry.h"
+#include "scanmatch.h"
+#include "occupancy.h"
+
+class RMHC_SLAM;
+class Laser;
+
+class RMHCSlam
+{
+  public:
+
+    RMHCSlam();
+    ~RMHCSlam();
+
+    //false when this build doesn't have BreezySLAM.
+    bool Init(Config* conf, OccupancyMap* pMap);
+
+    //track the car through one more scan. motion is the odometry estimate and
+    //dt the time since the last scan.
+    void Update(const LidarBinnedScan& scan, const MotionEstimate& motion, float dt);
+
+    const ScanPose& GetPose() const { return m_Pose; }
+
+    //the last scan, in the car frame.
+    const std::vector<ScanPoint>& GetPoints() const { return m_Points; }
+
+  protected:
+
+    RMHC_SLAM* m_pSlam;
+    Laser* m_pLaser;
+    OccupancyMap* m_pMap;
+
+    ScanPose m_Pose;
+    std::vector<int> m_ScanMM;
+    std::vector<ScanPoint> m_Points;
+    float m_MaxRangeMM;
+};
+
+#endif //__RMHC_H__
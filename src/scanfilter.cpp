@@ -0,0 +1,215 @@
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "scanfilter.h"
+
+ScanFilter::ScanFilter()
+{
+    m_MinQuality = 1;
+    m_MinRangeMM = 150.0f;
+    m_MaxRangeMM = 10000.0f;
+
+    m_MedianWindow = 5;
+    m_OutlierMM = 300.0f;
+
+    m_MaxGapBins = 2;
+    m_MaxGapJumpMM = 100.0f;
+}
+
+void ScanFilter::Init(Config* conf)
+{
+    m_MinQuality = conf->GetInt("lidar_filter_min_quality", 1);
+    m_MinRangeMM = conf->GetFloat("lidar_filter_min_range_mm", 150.0f);
+    m_MaxRangeMM = conf->GetFloat("lidar_filter_max_range_mm", 10000.0f);
+    m_MedianWindow = conf->GetInt("lidar_filter_median_window", 5);
+    m_OutlierMM = conf->GetFloat("lidar_filter_outlier_mm", 300.0f);
+    m_MaxGapBins = conf->GetInt("lidar_filter_max_gap_bins", 2);
+    m_MaxGapJumpMM = conf->GetFloat("lidar_filter_max_gap_jump_mm", 100.0f);
+
+    //the window is centered, so it must be odd. 1 or less turns it off.
+    if(m_MedianWindow > 1 && (m_MedianWindow & 1) == 0)
+        m_MedianWindow++;
+
+    if(m_MedianWindow > 15)
+        m_MedianWindow = 15;
+}
+
+void ScanFilter::Filter(const LidarScanSoA& scan, LidarBinnedScan& out)
+{
+    Bin(scan, out);
+
+    if(m_MedianWindow > 1)
+        RejectOutliers(out);
+
+    if(m_MaxGapBins > 0)
+        FillGaps(out);
+
+    out.m_NumValid = 0;
+
+    for(int iBin = 0; iBin < LidarBinnedScan::NUM_BINS; iBin++)
+        out.m_NumValid += (out.m_Flags[iBin] != LidarBinnedScan::BIN_EMPTY);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The gates are a straight pass over the SoA arrays with no branches, so the
+// compiler can vectorize it. Then each surviving return goes to its nearest half
+// degree bin. When two land in the same bin, we keep the closer one.
+
+void ScanFilter::Bin(const LidarScanSoA& scan, LidarBinnedScan& out)
+{
+    const int count = scan.m_Count;
+    const float* range = scan.m_Range;
+    const unsigned char* quality = scan.m_Quality;
+    const int minQuality = m_MinQuality;
+    const float minRange = m_MinRangeMM;
+    const float maxRange = m_MaxRangeMM;
+    unsigned char* keep = m_Keep;
+
+    for(int iRet = 0; iRet < count; iRet++)
+    {
+        unsigned char q = quality[iRet] >= minQuality;
+        unsigned char r = (range[iRet] >= minRange) & (range[iRet] <= maxRange);
+        keep[iRet] = q | (r << 1);
+    }
+
+    memset(out.m_Range, 0, sizeof(out.m_Range));
+    memset(out.m_Quality, 0, sizeof(out.m_Quality));
+    memset(out.m_Flags, 0, sizeof(out.m_Flags));
+    out.m_NumRejectedQuality = 0;
+    out.m_NumRejectedRange = 0;
+    out.m_NumOutliers = 0;
+    out.m_NumInterpolated = 0;
+
+    for(int iRet = 0; iRet < count; iRet++)
+    {
+        if(keep[iRet] != 3)
+        {
+            //count no return as out of range, not low quality.
+            if((keep[iRet] & 2) == 0)
+                out.m_NumRejectedRange++;
+            else
+                out.m_NumRejectedQuality++;
+
+            continue;
+        }
+
+        int iBin = (int)(scan.m_Angle[iRet] * LidarBinnedScan::BINS_PER_DEGREE + 0.5f);
+
+        if(iBin >= LidarBinnedScan::NUM_BINS)
+            iBin -= LidarBinnedScan::NUM_BINS;
+
+        if(iBin < 0 || iBin >= LidarBinnedScan::NUM_BINS)
+            continue;
+
+        if(out.m_Flags[iBin] == LidarBinnedScan::BIN_EMPTY || range[iRet] < out.m_Range[iBin])
+        {
+            out.m_Range[iBin] = range[iRet];
+            out.m_Quality[iBin] = quality[iRet];
+            out.m_Flags[iBin] = LidarBinnedScan::BIN_MEASURED;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A bin is an outlier when it's far from the median of the measured bins around
+// it. This removes single return spikes, like the mixed pixels at the edge of an
+// object, without rounding off real corners. The scan wraps at 360 degrees.
+
+void ScanFilter::RejectOutliers(LidarBinnedScan& out)
+{
+    const int N = LidarBinnedScan::NUM_BINS;
+    const int half = m_MedianWindow / 2;
+    float window[15];
+
+    //judge against the input, not bins we've already removed.
+    memcpy(m_Scratch, out.m_Range, sizeof(m_Scratch));
+
+    for(int iBin = 0; iBin < N; iBin++)
+    {
+        if(out.m_Flags[iBin] == LidarBinnedScan::BIN_EMPTY)
+            continue;
+
+        int num = 0;
+
+        for(int iW = -half; iW <= half; iW++)
+        {
+            float r = m_Scratch[(iBin + iW + N) % N];
+
+            if(r > 0.0f)
+                window[num++] = r;
+        }
+
+        //nothing around to compare with. Keep it rather than guess.
+        if(num < 3)
+            continue;
+
+        std::nth_element(window, window + num / 2, window + num);
+        float median = window[num / 2];
+
+        if(fabsf(m_Scratch[iBin] - median) > m_OutlierMM)
+        {
+            out.m_Range[iBin] = 0.0f;
+            out.m_Quality[iBin] = 0;
+            out.m_Flags[iBin] = LidarBinnedScan::BIN_EMPTY;
+            out.m_NumOutliers++;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Linear fill for short runs of empty bins. We only bridge a gap when the bins
+// on either side are at about the same range, so we never fill in the space
+// between a near object and the wall behind it.
+
+void ScanFilter::FillGaps(LidarBinnedScan& out)
+{
+    const int N = LidarBinnedScan::NUM_BINS;
+
+    //start the walk on a measured bin so runs that wrap past 0 are handled.
+    int iStart = -1;
+
+    for(int iBin = 0; iBin < N; iBin++)
+    {
+        if(out.m_Flags[iBin] != LidarBinnedScan::BIN_EMPTY)
+        {
+            iStart = iBin;
+            break;
+        }
+    }
+
+    if(iStart < 0)
+        return;
+
+    int iPrev = iStart;
+
+    for(int iStep = 1; iStep <= N; iStep++)
+    {
+        int iBin = (iStart + iStep) % N;
+
+        if(out.m_Flags[iBin] == LidarBinnedScan::BIN_EMPTY)
+            continue;
+
+        int gap = (iBin - iPrev + N) % N - 1;
+
+        if(gap > 0 && gap <= m_MaxGapBins
+            && out.m_Flags[iPrev] == LidarBinnedScan::BIN_MEASURED
+            && fabsf(out.m_Range[iBin] - out.m_Range[iPrev]) <= m_MaxGapJumpMM)
+        {
+            float a = out.m_Range[iPrev];
+            float b = out.m_Range[iBin];
+
+            for(int iGap = 1; iGap <= gap; iGap++)
+            {
+                int iFill = (iPrev + iGap) % N;
+                float t = (float)iGap / (gap + 1);
+
+                out.m_Range[iFill] = a + (b - a) * t;
+                out.m_Quality[iFill] = std::min(out.m_Quality[iPrev], out.m_Quality[iBin]);
+                out.m_Flags[iFill] = LidarBinnedScan::BIN_INTERPOLATED;
+                out.m_NumInterpolated++;
+            }
+        }
+
+        iPrev = iBin;
+    }
+}
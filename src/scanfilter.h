@@ -0,0 +1,81 @@
+// scanfilter.h
+//
+// Conditions a raw lidar scan into one range per half degree. Weak and out of
+// range returns are dropped, isolated spikes are rejected against the median of
+// their neighbours, and short gaps along a surface are filled in. This runs
+// once per scan on the lidar thread, and SLAM, the web stream and obstacle
+// detection all read the result.
+
+#ifndef __SCAN_FILTER_H__
+#define __SCAN_FILTER_H__
+
+#include "config.h"
+#include "lidar.h"
+
+struct LidarBinnedScan
+{
+    enum Constants
+    {
+        NUM_BINS = LidarRetSet::NUM_LIDAR_RETURNS,
+        BINS_PER_DEGREE = NUM_BINS / 360,
+
+        BIN_EMPTY = 0,
+        BIN_MEASURED = 1,
+        BIN_INTERPOLATED = 2,
+    };
+
+    LidarBinnedScan() : m_NumValid(0), m_NumRejectedQuality(0), m_NumRejectedRange(0),
+        m_NumOutliers(0), m_NumInterpolated(0) {}
+
+    //bin i is centered on i / 2 degrees. 0 range means no return.
+    float m_Range[NUM_BINS];
+    unsigned char m_Quality[NUM_BINS];
+    unsigned char m_Flags[NUM_BINS];
+
+    int m_NumValid;
+    int m_NumRejectedQuality;
+    int m_NumRejectedRange;
+    int m_NumOutliers;
+    int m_NumInterpolated;
+};
+
+class ScanFilter
+{
+  public:
+
+    ScanFilter();
+
+    void Init(Config* conf);
+
+    //true when a single return passes the quality and range gates. For
+    //consumers that work on raw returns, like the lidar sectors.
+    bool AcceptReturn(float range_mm, int quality) const
+    {
+        return quality >= m_MinQuality && range_mm >= m_MinRangeMM && range_mm <= m_MaxRangeMM;
+    }
+
+    //run all the stages on scan, writing the result to out.
+    void Filter(const LidarScanSoA& scan, LidarBinnedScan& out);
+
+  protected:
+
+    void Bin(const LidarScanSoA& scan, LidarBinnedScan& out);
+    void RejectOutliers(LidarBinnedScan& out);
+    void FillGaps(LidarBinnedScan& out);
+
+    int m_MinQuality;
+    float m_MinRangeMM;
+    float m_MaxRangeMM;
+
+    int m_MedianWindow;
+    float m_OutlierMM;
+
+    int m_MaxGapBins;
+    float m_MaxGapJumpMM;
+
+    //per return gate result, and the working copy for the median pass.
+    unsigned char m_Keep[LidarScanSoA::MAX_RETURNS];
+    float m_Scratch[LidarBinnedScan::NUM_BINS];
+};
+
+#endif //__SCAN_FILTER_H__
@@ -0,0 +1,444 @@
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "scanmatch.h"
+#include "tmath.h"
+
+void BinnedScanToPoints(const LidarBinnedScan& scan, float maxRangeMM, std::vector<ScanPoint>& points)
+{
+    points.clear();
+
+    for(int iBin = 0; iBin < LidarBinnedScan::NUM_BINS; iBin++)
+    {
+        float range = scan.m_Range[iBin];
+
+        if(range <= 0.0f || range > maxRangeMM)
+            continue;
+
+        float theta = -TMath::DegToRad((float)iBin / LidarBinnedScan::BINS_PER_DEGREE);
+        ScanPoint pt;
+        pt.x = cosf(theta) * range;
+        pt.y = sinf(theta) * range;
+        points.push_back(pt);
+    }
+}
+
+void TransformPoints(const std::vector<ScanPoint>& points, const ScanPose& pose, std::vector<ScanPoint>& out)
+{
+    float c = cosf(TMath::DegToRad(pose.theta_deg));
+    float s = sinf(TMath::DegToRad(pose.theta_deg));
+    int numPoints = (int)points.size();
+
+    out.resize(numPoints);
+
+    for(int iPt = 0; iPt < numPoints; iPt++)
+    {
+        const ScanPoint& p = points[iPt];
+        out[iPt].x = c * p.x - s * p.y + pose.x_mm;
+        out[iPt].y = s * p.x + c * p.y + pose.y_mm;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+LikelihoodGrid::LikelihoodGrid()
+{
+    m_OriginX = 0.0f;
+    m_OriginY = 0.0f;
+    m_Resolution = 50.0f;
+    m_Width = 0;
+    m_Height = 0;
+}
+
+void LikelihoodGrid::Init(float originX, float originY, float resolution, int width, int height)
+{
+    m_OriginX = originX;
+    m_OriginY = originY;
+    m_Resolution = resolution;
+    m_Width = width;
+    m_Height = height;
+
+    m_Levels.resize(1);
+    m_Levels[0].assign(width * height, 0.0f);
+}
+
+void LikelihoodGrid::Clear()
+{
+    m_Levels.resize(1);
+    std::fill(m_Levels[0].begin(), m_Levels[0].end(), 0.0f);
+}
+
+void LikelihoodGrid::AddHit(float x, float y, float sigmaMM)
+{
+    float fx = (x - m_OriginX) / m_Resolution;
+    float fy = (y - m_OriginY) / m_Resolution;
+    int cx = (int)floorf(fx);
+    int cy = (int)floorf(fy);
+    int radius = (int)ceilf(2.0f * sigmaMM / m_Resolution);
+    float invTwoSigma2 = 1.0f / (2.0f * sigmaMM * sigmaMM);
+
+    for(int iy = cy - radius; iy <= cy + radius; iy++)
+    {
+        for(int ix = cx - radius; ix <= cx + radius; ix++)
+        {
+            //distance from the hit to the cell center
+            float dx = ((float)ix + 0.5f - fx) * m_Resolution;
+            float dy = ((float)iy + 0.5f - fy) * m_Resolution;
+
+            SetMax(ix, iy, expf(-(dx * dx + dy * dy) * invTwoSigma2));
+        }
+    }
+}
+
+void LikelihoodGrid::BuildPyramid(int numLevels)
+{
+    m_Levels.resize(numLevels < 1 ? 1 : numLevels);
+
+    const int W = m_Width;
+    const int H = m_Height;
+
+    for(int iLevel = 1; iLevel < (int)m_Levels.size(); iLevel++)
+    {
+        const int step = 1 << (iLevel - 1);
+        const float* prev = &m_Levels[iLevel - 1][0];
+
+        m_Levels[iLevel].resize(W * H);
+        float* cur = &m_Levels[iLevel][0];
+
+        #pragma omp parallel for
+        for(int iy = 0; iy < H; iy++)
+        {
+            const float* row = prev + iy * W;
+            const float* rowBelow = (iy + step < H) ? prev + (iy + step) * W : NULL;
+            float* out = cur + iy * W;
+
+            for(int ix = 0; ix < W; ix++)
+            {
+                float m = row[ix];
+
+                if(ix + step < W)
+                    m = std::max(m, row[ix + step]);
+
+                if(rowBelow != NULL)
+                {
+                    m = std::max(m, rowBelow[ix]);
+
+                    if(ix + step < W)
+                        m = std::max(m, rowBelow[ix + step]);
+                }
+
+                out[ix] = m;
+            }
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+CorrelativeScanMatcher::CorrelativeScanMatcher()
+{
+    m_LinearWindowMM = 300.0f;
+    m_AngularWindowDeg = 20.0f;
+    m_MinScore = 0.3f;
+    m_NumLevels = 5;
+}
+
+void CorrelativeScanMatcher::Init(Config* conf)
+{
+    m_LinearWindowMM = conf->GetFloat("slam_cs_search_mm", 300.0f);
+    m_AngularWindowDeg = conf->GetFloat("slam_cs_search_deg", 20.0f);
+    m_MinScore = conf->GetFloat("slam_cs_min_score", 0.3f);
+    m_NumLevels = conf->GetInt("slam_cs_levels", 5);
+
+    if(m_NumLevels < 1)
+        m_NumLevels = 1;
+}
+
+//Mean likelihood of the points shifted by dx, dy cells. The loop is written
+//without branches so it vectorizes, with the grid reads as gathers.
+float CorrelativeScanMatcher::Score(const LikelihoodGrid& grid, int iLevel, const int* cellX, const int* cellY,
+    int numPoints, int dx, int dy) const
+{
+    const float* cells = grid.GetLevel(iLevel);
+    const unsigned W = (unsigned)grid.GetWidth();
+    const unsigned H = (unsigned)grid.GetHeight();
+    float sum = 0.0f;
+
+    #pragma omp simd reduction(+:sum)
+    for(int iPt = 0; iPt < numPoints; iPt++)
+    {
+        unsigned x = (unsigned)(cellX[iPt] + dx);
+        unsigned y = (unsigned)(cellY[iPt] + dy);
+        bool inside = (x < W) & (y < H);
+        unsigned index = inside ? y * W + x : 0;
+        sum += inside ? cells[index] : 0.0f;
+    }
+
+    return sum / numPoints;
+}
+
+//Depth first, best child first, so we find a good solution early and can
+//prune the rest of the tree against it.
+void CorrelativeScanMatcher::Search(const LikelihoodGrid& grid, int iLevel, const Candidate& parent, int maxOffset,
+    const int* cellX, const int* cellY, int numPoints, Candidate& best, int& numScored) const
+{
+    if(iLevel == 0)
+    {
+        if(parent.score > best.score)
+            best = parent;
+
+        return;
+    }
+
+    const int childLevel = iLevel - 1;
+    const int step = 1 << childLevel;
+    Candidate children[4];
+    int numChildren = 0;
+
+    for(int iy = 0; iy < 2; iy++)
+    {
+        for(int ix = 0; ix < 2; ix++)
+        {
+            Candidate c;
+            c.iAngle = parent.iAngle;
+            c.dx = parent.dx + ix * step;
+            c.dy = parent.dy + iy * step;
+
+            if(c.dx > maxOffset || c.dy > maxOffset)
+                continue;
+
+            c.score = Score(grid, childLevel, cellX, cellY, numPoints, c.dx, c.dy);
+            numScored++;
+            children[numChildren++] = c;
+        }
+    }
+
+    std::sort(children, children + numChildren);
+
+    for(int iChild = 0; iChild < numChildren; iChild++)
+    {
+        //sorted, so none of the rest can beat it either.
+        if(children[iChild].score <= best.score)
+            break;
+
+        Search(grid, childLevel, children[iChild], maxOffset, cellX, cellY, numPoints, best, numScored);
+    }
+}
+
+bool CorrelativeScanMatcher::Match(const LikelihoodGrid& grid, const std::vector<ScanPoint>& points,
+    const ScanPose& guess, ScanMatchResult& result)
+{
+    return Match(grid, points, guess, m_LinearWindowMM, m_AngularWindowDeg, m_MinScore, result);
+}
+
+bool CorrelativeScanMatcher::Match(const LikelihoodGrid& grid, const std::vector<ScanPoint>& points,
+    const ScanPose& guess, float linearWindowMM, float angularWindowDeg, float minScore,
+    ScanMatchResult& result)
+{
+    const int numPoints = (int)points.size();
+    const float res = grid.GetResolution();
+
+    result.pose = guess;
+    result.score = 0.0f;
+    result.numCandidates = 0;
+    memset(result.cov, 0, sizeof(result.cov));
+
+    if(numPoints == 0 || grid.GetWidth() == 0)
+        return false;
+
+    //angular step that moves the furthest point about one cell.
+    float maxRange = 0.0f;
+
+    for(int iPt = 0; iPt < numPoints; iPt++)
+        maxRange = std::max(maxRange, sqrtf(points[iPt].x * points[iPt].x + points[iPt].y * points[iPt].y));
+
+    float angleStepDeg = 1.0f;
+
+    if(maxRange > res)
+        angleStepDeg = TMath::RadToDeg(acosf(1.0f - (res * res) / (2.0f * maxRange * maxRange)));
+
+    angleStepDeg = std::min(std::max(angleStepDeg, 0.25f), 2.0f);
+
+    const int halfAngles = (int)ceilf(angularWindowDeg / angleStepDeg);
+    const int numAngles = 2 * halfAngles + 1;
+    const int windowCells = (int)ceilf(linearWindowMM / res);
+    const int numLevels = std::min(m_NumLevels, grid.GetNumLevels());
+    const int topLevel = numLevels - 1;
+    const int topStep = 1 << topLevel;
+
+    //discretize the scan at every angle once, relative to the guessed position.
+    m_CellX.resize(numAngles);
+    m_CellY.resize(numAngles);
+
+    #pragma omp parallel for
+    for(int iAngle = 0; iAngle < numAngles; iAngle++)
+    {
+        ScanPose pose(guess.x_mm, guess.y_mm, guess.theta_deg + (iAngle - halfAngles) * angleStepDeg);
+        std::vector<ScanPoint> world;
+        TransformPoints(points, pose, world);
+
+        m_CellX[iAngle].resize(numPoints);
+        m_CellY[iAngle].resize(numPoints);
+
+        for(int iPt = 0; iPt < numPoints; iPt++)
+        {
+            //shift the window so offsets run 0 to 2 * window, which keeps the
+            //children of a coarse candidate inside the window.
+            m_CellX[iAngle][iPt] = (int)floorf((world[iPt].x - grid.GetOriginX()) / res) - windowCells;
+            m_CellY[iAngle][iPt] = (int)floorf((world[iPt].y - grid.GetOriginY()) / res) - windowCells;
+        }
+    }
+
+    //score the coarsest level everywhere. This is most of the work, and
+    //every angle is independent.
+    const int span = 2 * windowCells;
+    const int numSteps = span / topStep + 1;
+    std::vector<Candidate> top(numAngles * numSteps * numSteps);
+
+    #pragma omp parallel for
+    for(int iAngle = 0; iAngle < numAngles; iAngle++)
+    {
+        const int* cellX = &m_CellX[iAngle][0];
+        const int* cellY = &m_CellY[iAngle][0];
+
+        for(int iy = 0; iy < numSteps; iy++)
+        {
+            for(int ix = 0; ix < numSteps; ix++)
+            {
+                Candidate& c = top[(iAngle * numSteps + iy) * numSteps + ix];
+                c.iAngle = iAngle;
+                c.dx = ix * topStep;
+                c.dy = iy * topStep;
+                c.score = Score(grid, topLevel, cellX, cellY, numPoints, c.dx, c.dy);
+            }
+        }
+    }
+
+    std::sort(top.begin(), top.end());
+
+    Candidate best;
+    best.iAngle = halfAngles;
+    best.dx = windowCells;
+    best.dy = windowCells;
+    best.score = minScore;
+
+    int numScored = (int)top.size();
+
+    //refine the coarse candidates in parallel. Each thread prunes against the
+    //best found by any thread so far.
+    #pragma omp parallel
+    {
+        Candidate localBest = best;
+        int localScored = 0;
+
+        #pragma omp for schedule(dynamic, 1)
+        for(int iTop = 0; iTop < (int)top.size(); iTop++)
+        {
+            float bestScore;
+
+            #pragma omp atomic read
+            bestScore = best.score;
+
+            if(bestScore > localBest.score)
+                localBest.score = bestScore;
+
+            if(top[iTop].score <= localBest.score)
+                continue;
+
+            Search(grid, topLevel, top[iTop], span, &m_CellX[top[iTop].iAngle][0],
+                &m_CellY[top[iTop].iAngle][0], numPoints, localBest, localScored);
+
+            #pragma omp critical
+            {
+                if(localBest.score > best.score)
+                    best = localBest;
+            }
+        }
+
+        #pragma omp atomic
+        numScored += localScored;
+    }
+
+    result.numCandidates = numScored;
+
+    if(best.score <= minScore)
+        return false;
+
+    result.pose.x_mm = guess.x_mm + (best.dx - windowCells) * res;
+    result.pose.y_mm = guess.y_mm + (best.dy - windowCells) * res;
+    result.pose.theta_deg = guess.theta_deg + (best.iAngle - halfAngles) * angleStepDeg;
+    result.score = best.score;
+
+    EstimateCovariance(grid, points, result.pose, angleStepDeg, result);
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Treat exp(k * (score - best)) as the likelihood of each pose near the best,
+// and take the covariance of that distribution. A sharp peak, like in a
+// corridor corner, gives a small covariance. A flat one, like driving along a
+// featureless wall, is long in the direction we can't tell apart.
+
+void CorrelativeScanMatcher::EstimateCovariance(const LikelihoodGrid& grid, const std::vector<ScanPoint>& points,
+    const ScanPose& best, float angleStepDeg, ScanMatchResult& result) const
+{
+    const int R = 2;
+    const float k = 50.0f;
+    const float res = grid.GetResolution();
+    const int numPoints = (int)points.size();
+
+    float sumW = 0.0f;
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    float sq[3][3];
+    memset(sq, 0, sizeof(sq));
+
+    std::vector<ScanPoint> world;
+    std::vector<int> cellX(numPoints), cellY(numPoints);
+
+    for(int iA = -R; iA <= R; iA++)
+    {
+        ScanPose pose(best.x_mm, best.y_mm, best.theta_deg + iA * angleStepDeg);
+        TransformPoints(points, pose, world);
+
+        for(int iPt = 0; iPt < numPoints; iPt++)
+        {
+            cellX[iPt] = (int)floorf((world[iPt].x - grid.GetOriginX()) / res);
+            cellY[iPt] = (int)floorf((world[iPt].y - grid.GetOriginY()) / res);
+        }
+
+        for(int iy = -R; iy <= R; iy++)
+        {
+            for(int ix = -R; ix <= R; ix++)
+            {
+                float s = Score(grid, 0, &cellX[0], &cellY[0], numPoints, ix, iy);
+                float w = expf(k * (s - result.score));
+                float d[3] = { ix * res, iy * res, iA * angleStepDeg };
+
+                sumW += w;
+
+                for(int i = 0; i < 3; i++)
+                {
+                    mean[i] += w * d[i];
+
+                    for(int j = 0; j < 3; j++)
+                        sq[i][j] += w * d[i] * d[j];
+                }
+            }
+        }
+    }
+
+    //we can't resolve better than a cell, or an angle step.
+    const float floor[3] = { res * res / 12.0f, res * res / 12.0f, angleStepDeg * angleStepDeg / 12.0f };
+
+    for(int i = 0; i < 3; i++)
+    {
+        for(int j = 0; j < 3; j++)
+        {
+            result.cov[i][j] = sq[i][j] / sumW - (mean[i] / sumW) * (mean[j] / sumW);
+
+            if(i == j)
+                result.cov[i][j] += floor[i];
+        }
+    }
+}
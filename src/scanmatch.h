@@ -0,0 +1,164 @@
+// scanmatch.h
+//
+// Correlative scan matching. A scan is scored against a likelihood field, a
+// grid where each cell holds how likely a return is to land there. Rather than
+// hill climb from a guess, we search every pose in a window around it, using
+// branch and bound over a pyramid of coarser grids to skip most of the work.
+// The search finds the best pose in the window, so it doesn't get stuck in a
+// local minimum when the car turns fast.
+//
+// Frames are the usual counter clockwise ones. x forward, y to the left, theta
+// in degrees. Distances are in mm.
+
+#ifndef __SCAN_MATCH_H__
+#define __SCAN_MATCH_H__
+
+#include <vector>
+#include "scanfilter.h"
+
+struct ScanPoint
+{
+    float x;
+    float y;
+};
+
+struct ScanPose
+{
+    ScanPose() : x_mm(0.0f), y_mm(0.0f), theta_deg(0.0f) {}
+    ScanPose(float x, float y, float theta) : x_mm(x), y_mm(y), theta_deg(theta) {}
+
+    float x_mm;
+    float y_mm;
+    float theta_deg;
+};
+
+//Points of the binned scan in the car frame. The rplidar sweeps clockwise, so
+//its angles are flipped here. Bins further than maxRangeMM are skipped.
+void BinnedScanToPoints(const LidarBinnedScan& scan, float maxRangeMM, std::vector<ScanPoint>& points);
+
+//points moved from the car frame into the frame of pose.
+void TransformPoints(const std::vector<ScanPoint>& points, const ScanPose& pose, std::vector<ScanPoint>& out);
+
+///////////////////////////////////////////////////////////////////////////////
+// Level 0 holds the likelihood at full resolution. Each cell of level k holds
+// the max of the 2^k by 2^k block of level 0 cells starting at that cell. So a
+// scan scored at level k is an upper bound on its score for any offset within
+// that block, which is what lets branch and bound prune.
+
+class LikelihoodGrid
+{
+  public:
+
+    LikelihoodGrid();
+
+    //resolution in mm per cell. The grid covers width x height cells
+    //with cell 0, 0 at originX, originY.
+    void Init(float originX, float originY, float resolution, int width, int height);
+
+    void Clear();
+
+    //raise the likelihood around a return at x, y. Cells take the max of the
+    //current value and a gaussian of the distance to the hit.
+    void AddHit(float x, float y, float sigmaMM);
+
+    //raise a cell directly, when the caller has its own model.
+    void SetMax(int ix, int iy, float value)
+    {
+        if(ix >= 0 && iy >= 0 && ix < m_Width && iy < m_Height)
+        {
+            float& cell = m_Levels[0][iy * m_Width + ix];
+
+            if(value > cell)
+                cell = value;
+        }
+    }
+
+    //fill in the coarse levels from level 0. Call after the hits are added.
+    void BuildPyramid(int numLevels);
+
+    float GetResolution() const { return m_Resolution; }
+    float GetOriginX() const { return m_OriginX; }
+    float GetOriginY() const { return m_OriginY; }
+    int GetWidth() const { return m_Width; }
+    int GetHeight() const { return m_Height; }
+    int GetNumLevels() const { return (int)m_Levels.size(); }
+
+    const float* GetLevel(int iLevel) const { return &m_Levels[iLevel][0]; }
+
+    float At(int iLevel, int ix, int iy) const
+    {
+        if(ix < 0 || iy < 0 || ix >= m_Width || iy >= m_Height)
+            return 0.0f;
+
+        return m_Levels[iLevel][iy * m_Width + ix];
+    }
+
+  protected:
+
+    float m_OriginX;
+    float m_OriginY;
+    float m_Resolution;
+    int m_Width;
+    int m_Height;
+
+    std::vector< std::vector<float> > m_Levels;
+};
+
+struct ScanMatchResult
+{
+    ScanPose pose;
+    float score;            //mean likelihood of the points, 0 to 1
+    float cov[3][3];        //x, y in mm, theta in degrees
+    int numCandidates;      //poses scored, for profiling
+};
+
+class CorrelativeScanMatcher
+{
+  public:
+
+    CorrelativeScanMatcher();
+
+    void Init(Config* conf);
+
+    //search the window around guess for the pose that best lines points up
+    //with the grid. Returns false when nothing scores above the minimum.
+    bool Match(const LikelihoodGrid& grid, const std::vector<ScanPoint>& points,
+        const ScanPose& guess, ScanMatchResult& result);
+
+    //same, with an explicit search window. For relocalization and loop closure.
+    bool Match(const LikelihoodGrid& grid, const std::vector<ScanPoint>& points,
+        const ScanPose& guess, float linearWindowMM, float angularWindowDeg, float minScore,
+        ScanMatchResult& result);
+
+    float m_LinearWindowMM;
+    float m_AngularWindowDeg;
+    float m_MinScore;
+    int m_NumLevels;
+
+  protected:
+
+    struct Candidate
+    {
+        int iAngle;
+        int dx;
+        int dy;
+        float score;
+
+        bool operator<(const Candidate& other) const { return score > other.score; }
+    };
+
+    float Score(const LikelihoodGrid& grid, int iLevel, const int* cellX, const int* cellY,
+        int numPoints, int dx, int dy) const;
+
+    void Search(const LikelihoodGrid& grid, int iLevel, const Candidate& parent, int maxOffset,
+        const int* cellX, const int* cellY, int numPoints, Candidate& best, int& numScored) const;
+
+    void EstimateCovariance(const LikelihoodGrid& grid, const std::vector<ScanPoint>& points,
+        const ScanPose& best, float angleStepDeg, ScanMatchResult& result) const;
+
+    //rotated scans, discretized to cells. One set per angle.
+    std::vector< std::vector<int> > m_CellX;
+    std::vector< std::vector<int> > m_CellY;
+};
+
+#endif //__SCAN_MATCH_H__
@@ -0,0 +1,225 @@
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include "scanslam.h"
+#include "timing.h"
+#include "tmath.h"
+
+ScanMatchSLAM::ScanMatchSLAM()
+{
+    m_pMap = NULL;
+    m_NumScans = 0;
+    m_MaxRangeMM = 8000.0f;
+    m_SigmaMM = 60.0f;
+    m_KeyDistanceMM = 100.0f;
+    m_KeyAngleDeg = 5.0f;
+    m_RelocWindowMM = 1000.0f;
+    m_RelocMinScore = 0.5f;
+    m_RelocAcceptScore = 0.7f;
+}
+
+void ScanMatchSLAM::Init(Config* conf, OccupancyMap* pMap)
+{
+    m_pMap = pMap;
+    m_Matcher.Init(conf);
+
+    m_MaxRangeMM = conf->GetFloat("slam_cs_max_range_mm", 8000.0f);
+    m_SigmaMM = conf->GetFloat("slam_cs_sigma_mm", 60.0f);
+    m_KeyDistanceMM = conf->GetFloat("slam_cs_key_distance_mm", 100.0f);
+    m_KeyAngleDeg = conf->GetFloat("slam_cs_key_angle_deg", 5.0f);
+
+    m_RelocWindowMM = conf->GetFloat("slam_reloc_window_mm", 1000.0f);
+    m_RelocMinScore = conf->GetFloat("slam_reloc_min_score", 0.5f);
+    m_RelocAcceptScore = conf->GetFloat("slam_reloc_accept_score", 0.7f);
+}
+
+//order the search windows by distance from the hint.
+struct RelocWindow
+{
+    float x_mm;
+    float y_mm;
+    float dist2;
+
+    bool operator<(const RelocWindow& other) const { return dist2 < other.dist2; }
+};
+
+bool ScanMatchSLAM::Relocalize(const LidarBinnedScan& scan, const ScanPose& hint, float budgetMS,
+    ScanMatchResult& result)
+{
+    uint64_t start = get_time_usec();
+
+    result.pose = hint;
+    result.score = 0.0f;
+    result.numCandidates = 0;
+
+    int minCx, minCy, maxCx, maxCy;
+
+    if(!m_pMap->GetBounds(minCx, minCy, maxCx, maxCy))
+        return false;
+
+    BinnedScanToPoints(scan, m_MaxRangeMM, m_Points);
+
+    //the likelihood of the whole map, built once for every window.
+    const float res = m_pMap->GetResolution();
+    const float minX = minCx * res, minY = minCy * res;
+    const float maxX = (maxCx + 1) * res, maxY = (maxCy + 1) * res;
+    const float halfWindow = std::max(maxX - minX, maxY - minY) * 0.5f;
+
+    m_pMap->BuildLikelihood((minX + maxX) * 0.5f, (minY + maxY) * 0.5f, halfWindow, m_SigmaMM,
+        m_Matcher.m_NumLevels, m_Grid);
+
+    //tile the map with search windows. Each covers +/- m_RelocWindowMM.
+    std::vector<RelocWindow> windows;
+    const float step = std::max(m_RelocWindowMM * 2.0f, res);
+
+    for(float y = minY + step * 0.5f; y < maxY + step * 0.5f; y += step)
+    {
+        for(float x = minX + step * 0.5f; x < maxX + step * 0.5f; x += step)
+        {
+            RelocWindow w;
+            w.x_mm = x;
+            w.y_mm = y;
+            w.dist2 = (x - hint.x_mm) * (x - hint.x_mm) + (y - hint.y_mm) * (y - hint.y_mm);
+            windows.push_back(w);
+        }
+    }
+
+    std::sort(windows.begin(), windows.end());
+
+    ScanMatchResult candidate;
+    int numSearched = 0;
+    bool bOutOfTime = false;
+
+    //a whole turn in one match can take far longer than the budget. Search
+    //each window a slice of headings at a time, nearest the hint first, and
+    //check the time between slices.
+    const float sliceDeg = 30.0f;
+    const int numSlices = (int)(360.0f / sliceDeg);
+
+    for(size_t iWindow = 0; iWindow < windows.size() && !bOutOfTime; iWindow++)
+    {
+        for(int iSlice = 0; iSlice < numSlices; iSlice++)
+        {
+            if(get_sec_diff_usec(get_time_usec(), start) * 1000.0 > budgetMS)
+            {
+                bOutOfTime = true;
+                break;
+            }
+
+            //0, +1, -1, +2, -2 ... slices from the hint's heading.
+            int offset = (iSlice + 1) / 2 * ((iSlice & 1) ? 1 : -1);
+            ScanPose guess(windows[iWindow].x_mm, windows[iWindow].y_mm, hint.theta_deg + offset * sliceDeg);
+
+            m_Matcher.Match(m_Grid, m_Points, guess, m_RelocWindowMM, sliceDeg * 0.5f, m_RelocMinScore, candidate);
+
+            if(candidate.score > result.score)
+                result = candidate;
+
+            if(result.score >= m_RelocAcceptScore)
+                break;
+        }
+
+        numSearched++;
+
+        if(result.score >= m_RelocAcceptScore)
+            break;
+    }
+
+    printf("relocalize searched %d of %d windows in %.0f ms, best score %.2f at %.0f, %.0f, %.1f\n",
+        numSearched, (int)windows.size(), get_sec_diff_usec(get_time_usec(), start) * 1000.0,
+        result.score, result.pose.x_mm, result.pose.y_mm, result.pose.theta_deg);
+
+    if(result.score < m_RelocMinScore)
+        return false;
+
+    //carry on tracking from here, as if this were the first scan.
+    m_Pose = result.pose;
+    m_LastKeyPose = m_Pose;
+    m_NumScans = 1;
+
+    RebuildGrid();
+
+    return true;
+}
+
+bool ScanMatchSLAM::Update(const LidarBinnedScan& scan, const MotionEstimate& motion, float dt, ScanMatchResult& result)
+{
+    BinnedScanToPoints(scan, m_MaxRangeMM, m_Points);
+
+    //predict from odometry, moving along the heading half way through the turn.
+    float dtheta = motion.yaw_rate_deg_s * dt;
+    float heading = TMath::DegToRad(m_Pose.theta_deg + dtheta * 0.5f);
+    float dist = motion.speed_mm_s * dt;
+
+    ScanPose predicted(m_Pose.x_mm + cosf(heading) * dist,
+        m_Pose.y_mm + sinf(heading) * dist,
+        m_Pose.theta_deg + dtheta);
+
+    m_NumScans++;
+
+    //the first scan defines the origin.
+    if(m_NumScans == 1)
+    {
+        m_Pose = predicted;
+        result.pose = m_Pose;
+        result.score = 1.0f;
+        result.numCandidates = 0;
+
+        for(int i = 0; i < 3; i++)
+            for(int j = 0; j < 3; j++)
+                result.cov[i][j] = 0.0f;
+
+        AddKeyScan();
+        return true;
+    }
+
+    bool bMatched = m_Matcher.Match(m_Grid, m_Points, predicted, result);
+
+    if(!bMatched)
+    {
+        //keep going on odometry. Don't add to the map what we can't place.
+        m_Pose = predicted;
+        result.pose = predicted;
+        return false;
+    }
+
+    m_Pose = result.pose;
+
+    //keep theta from winding up, so it matches what RMHC reports.
+    while(m_Pose.theta_deg > 180.0f)
+        m_Pose.theta_deg -= 360.0f;
+
+    while(m_Pose.theta_deg < -180.0f)
+        m_Pose.theta_deg += 360.0f;
+
+    result.pose = m_Pose;
+
+    //only add scans taken from somewhere new, rather than pile up the same view.
+    float dx = m_Pose.x_mm - m_LastKeyPose.x_mm;
+    float dy = m_Pose.y_mm - m_LastKeyPose.y_mm;
+    float da = fabsf(m_Pose.theta_deg - m_LastKeyPose.theta_deg);
+
+    if(da > 180.0f)
+        da = 360.0f - da;
+
+    if(dx * dx + dy * dy > m_KeyDistanceMM * m_KeyDistanceMM || da > m_KeyAngleDeg)
+        AddKeyScan();
+
+    return true;
+}
+
+void ScanMatchSLAM::AddKeyScan()
+{
+    m_pMap->InsertScan(m_Pose, m_Points);
+    m_LastKeyPose = m_Pose;
+
+    RebuildGrid();
+}
+
+void ScanMatchSLAM::RebuildGrid()
+{
+    //everything the next scans could see, from anywhere in the search window.
+    float halfWindow = m_MaxRangeMM + m_Matcher.m_LinearWindowMM + m_KeyDistanceMM;
+
+    m_pMap->BuildLikelihood(m_Pose.x_mm, m_Pose.y_mm, halfWindow, m_SigmaMM, m_Matcher.m_NumLevels, m_Grid);
+}
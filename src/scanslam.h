@@ -0,0 +1,66 @@
+// scanslam.h
+//
+// Built in SLAM, as an alternative to BreezySLAM's RMHC_SLAM. Each scan is
+// matched with the correlative scan matcher, starting from the odometry
+// prediction, against a likelihood field taken from the occupancy map around
+// the car. Key scans are added to the map.
+
+#ifndef __SCAN_SLAM_H__
+#define __SCAN_SLAM_H__
+
+#include <vector>
+#include "config.h"
+#include "odometry.h"
+#include "scanmatch.h"
+#include "occupancy.h"
+
+class ScanMatchSLAM
+{
+  public:
+
+    ScanMatchSLAM();
+
+    //the map is owned by the caller, so it can be shared with other threads.
+    void Init(Config* conf, OccupancyMap* pMap);
+
+    //Track the car through one more scan. motion is the odometry estimate and
+    //dt the time since the last scan. Returns false when the match failed and
+    //the pose is just the odometry prediction.
+    bool Update(const LidarBinnedScan& scan, const MotionEstimate& motion, float dt, ScanMatchResult& result);
+
+    //Find the car in a map loaded from disk, before tracking starts. Windows
+    //of the map are searched at every heading, nearest hint first, until one
+    //scores well or budgetMS runs out. Returns false when nothing scored
+    //above slam_reloc_min_score. Call again with the next scan to retry.
+    bool Relocalize(const LidarBinnedScan& scan, const ScanPose& hint, float budgetMS, ScanMatchResult& result);
+
+    const ScanPose& GetPose() const { return m_Pose; }
+
+    //the last scan, in the car frame.
+    const std::vector<ScanPoint>& GetPoints() const { return m_Points; }
+
+  protected:
+
+    void AddKeyScan();
+    void RebuildGrid();
+
+    CorrelativeScanMatcher m_Matcher;
+    LikelihoodGrid m_Grid;
+    OccupancyMap* m_pMap;
+
+    std::vector<ScanPoint> m_Points;
+    ScanPose m_Pose;
+    ScanPose m_LastKeyPose;
+    int m_NumScans;
+
+    float m_MaxRangeMM;
+    float m_SigmaMM;
+    float m_KeyDistanceMM;
+    float m_KeyAngleDeg;
+
+    float m_RelocWindowMM;
+    float m_RelocMinScore;
+    float m_RelocAcceptScore;
+};
+
+#endif //__SCAN_SLAM_H__
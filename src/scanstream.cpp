@@ -0,0 +1,126 @@
+#include <string.h>
+#include "scanstream.h"
+
+ScanStreamEncoder::ScanStreamEncoder()
+{
+    m_Seq = 0;
+    m_RangeQuantMM = 10;
+    m_KeyframeInterval = 10;
+    m_SinceKeyframe = 0;
+
+    memset(m_Range, 0, sizeof(m_Range));
+    memset(m_PrevRange, 0, sizeof(m_PrevRange));
+    memset(m_Quality, 0, sizeof(m_Quality));
+}
+
+void ScanStreamEncoder::SetParams(int rangeQuantMM, int keyframeInterval)
+{
+    m_RangeQuantMM = rangeQuantMM < 1 ? 1 : rangeQuantMM;
+    m_KeyframeInterval = keyframeInterval < 1 ? 1 : keyframeInterval;
+
+    //force a keyframe on the next scan.
+    m_SinceKeyframe = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The scan filter has already binned the returns, one per half degree, so we
+// just quantize the ranges down to the stream's resolution.
+
+void ScanStreamEncoder::QuantizeScan(const LidarBinnedScan& scan)
+{
+    for(int iBin = 0; iBin < NUM_BINS; iBin++)
+    {
+        if(scan.m_Range[iBin] <= 0.0f)
+        {
+            m_Range[iBin] = 0;
+            m_Quality[iBin] = 0;
+            continue;
+        }
+
+        int range = (int)(scan.m_Range[iBin] / m_RangeQuantMM + 0.5f);
+
+        if(range < 1)
+            range = 1;
+        else if(range > 0xffff)
+            range = 0xffff;
+
+        m_Range[iBin] = (unsigned short)range;
+        m_Quality[iBin] = (unsigned char)(scan.m_Quality[iBin] >> 2);
+    }
+}
+
+static void write_bytes(std::vector<unsigned char>& msg, const void* data, int len)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    msg.insert(msg.end(), p, p + len);
+}
+
+static void write_varint(std::vector<unsigned char>& msg, int value)
+{
+    //zigzag so small negative numbers stay small
+    uint32_t v = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+
+    while(v >= 0x80)
+    {
+        msg.push_back((unsigned char)(v | 0x80));
+        v >>= 7;
+    }
+
+    msg.push_back((unsigned char)v);
+}
+
+int ScanStreamEncoder::Encode(const LidarBinnedScan& scan, uint64_t tick_usec, const ScanStreamPose* pPose,
+    std::vector<unsigned char>& msg)
+{
+    QuantizeScan(scan);
+
+    bool bKeyframe = (m_SinceKeyframe == 0);
+
+    m_SinceKeyframe++;
+
+    if(m_SinceKeyframe >= m_KeyframeInterval)
+        m_SinceKeyframe = 0;
+
+    unsigned char flags = 0;
+
+    if(bKeyframe)
+        flags |= FLAG_KEYFRAME;
+
+    if(pPose != NULL)
+        flags |= FLAG_POSE;
+
+    uint32_t tick_ms = (uint32_t)(tick_usec / 1000);
+    uint16_t num_bins = NUM_BINS;
+    uint16_t quant = (uint16_t)m_RangeQuantMM;
+
+    msg.clear();
+    msg.push_back('L');
+    msg.push_back('S');
+    msg.push_back(VERSION);
+    msg.push_back(flags);
+    write_bytes(msg, &m_Seq, sizeof(m_Seq));
+    write_bytes(msg, &tick_ms, sizeof(tick_ms));
+    write_bytes(msg, &num_bins, sizeof(num_bins));
+    write_bytes(msg, &quant, sizeof(quant));
+
+    if(pPose != NULL)
+    {
+        write_bytes(msg, &pPose->x_mm, sizeof(float));
+        write_bytes(msg, &pPose->y_mm, sizeof(float));
+        write_bytes(msg, &pPose->theta_deg, sizeof(float));
+    }
+
+    for(int iBin = 0; iBin < NUM_BINS; iBin++)
+    {
+        int prev = bKeyframe ? 0 : m_PrevRange[iBin];
+        write_varint(msg, (int)m_Range[iBin] - prev);
+    }
+
+    for(int iBin = 0; iBin < NUM_BINS; iBin += 2)
+        msg.push_back((unsigned char)(m_Quality[iBin] | (m_Quality[iBin + 1] << 4)));
+
+    memcpy(m_PrevRange, m_Range, sizeof(m_Range));
+    m_Seq++;
+
+    return (int)msg.size();
+}
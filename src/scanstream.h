@@ -0,0 +1,76 @@
+// scanstream.h
+//
+// Compact binary encoding of a lidar scan for the web ui. Instead of rendering
+// a 512x512 image on the robot, we send the quantized polar scan and let the
+// browser draw it.
+//
+// Message layout, little endian:
+//
+//   offset  size  field
+//   0       2     magic 'L' 'S'
+//   2       1     version
+//   3       1     flags. 1: keyframe, 2: pose present
+//   4       4     sequence number, increments by one per scan
+//   8       4     time stamp of the scan, milliseconds
+//   12      2     number of bins, one per half degree
+//   14      2     range quantization in mm
+//   16      12    optional pose: float x_mm, float y_mm, float theta_deg
+//   ..      ..    ranges: one zigzag varint per bin. On a keyframe this is the
+//                 quantized range. Otherwise it's the change from the same bin
+//                 in the previous scan. 0 means no return.
+//   ..      n/2   quality: 4 bits per bin, low nibble first.
+//
+// A client that misses a sequence number must wait for the next keyframe.
+
+#ifndef __SCAN_STREAM_H__
+#define __SCAN_STREAM_H__
+
+#include <stdint.h>
+#include <vector>
+#include "scanfilter.h"
+
+struct ScanStreamPose
+{
+    float x_mm;
+    float y_mm;
+    float theta_deg;
+};
+
+class ScanStreamEncoder
+{
+  public:
+
+    enum Constants
+    {
+        NUM_BINS = LidarBinnedScan::NUM_BINS,
+        VERSION = 1,
+        FLAG_KEYFRAME = 1,
+        FLAG_POSE = 2,
+    };
+
+    ScanStreamEncoder();
+
+    // rangeQuantMM sets the resolution ranges are sent at. Coarser values give
+    // smaller deltas. A keyframe is sent every keyframeInterval scans.
+    void SetParams(int rangeQuantMM, int keyframeInterval);
+
+    // encode the scan into msg, replacing its contents. pPose may be NULL.
+    // returns the number of bytes in the message.
+    int Encode(const LidarBinnedScan& scan, uint64_t tick_usec, const ScanStreamPose* pPose,
+        std::vector<unsigned char>& msg);
+
+  protected:
+
+    void QuantizeScan(const LidarBinnedScan& scan);
+
+    unsigned short m_Range[NUM_BINS];
+    unsigned short m_PrevRange[NUM_BINS];
+    unsigned char m_Quality[NUM_BINS];
+
+    uint32_t m_Seq;
+    int m_RangeQuantMM;
+    int m_KeyframeInterval;
+    int m_SinceKeyframe;
+};
+
+#endif //__SCAN_STREAM_H__
@@ -0,0 +1,27 @@
+// timing.h
+//
+// Monotonic time stamps shared by all the sensor and control threads.
+
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <stdint.h>
+#include <time.h>
+
+//Monotonic clock in micro seconds. Unlike clock(), which measures cpu time of the
+//process, this advances with real time and is comparable across threads. Use this
+//for any tick that another thread may want to match against.
+inline uint64_t get_time_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)(ts.tv_nsec / 1000);
+}
+
+//time in seconds between two calls to get_time_usec()
+inline double get_sec_diff_usec(uint64_t a, uint64_t b)
+{
+    return (double)(int64_t)(a - b) * (1.0 / 1000000.0);
+}
+
+#endif //__TIMING_H__
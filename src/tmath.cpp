@@ -1712,3 +1712,43 @@ void LineSeg::Construct(const Vector3& from, const Vector3& to)
 	m_dir = to - from;
 	m_dir.Normalize();
 }
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+// 3x3 arrays
+
+template <class T>
+static bool Invert33T(const T m[3][3], T out[3][3], T minDet)
+{
+	T c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+	T c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+	T c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+	T det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+
+	if(det < minDet && det > -minDet)
+		return false;
+
+	T inv = (T)1 / det;
+
+	out[0][0] = c00 * inv;
+	out[1][0] = c01 * inv;
+	out[2][0] = c02 * inv;
+	out[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv;
+	out[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv;
+	out[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv;
+	out[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv;
+	out[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv;
+	out[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv;
+
+	return true;
+}
+
+bool TMath::Invert33(const float m[3][3], float out[3][3])
+{
+	return Invert33T(m, out, 1e-12f);
+}
+
+bool TMath::Invert33(const double m[3][3], double out[3][3])
+{
+	return Invert33T(m, out, 1e-30);
+}
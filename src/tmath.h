@@ -39,6 +39,26 @@ namespace TMath
 	inline double	RadToDeg(double x)	{ return ((x) / dPI * 180.0f); }
 	inline double	DegToRad(double x)	{ return ((x) / 180.0f * dPI); }
 
+	//angles back into -180 to 180 degrees, or -PI to PI radians
+	inline float	WrapDeg(float x)
+	{
+		while(x > 180.0f) x -= 360.0f;
+		while(x < -180.0f) x += 360.0f;
+		return x;
+	}
+
+	inline float	WrapRad(float x)
+	{
+		while(x > PI) x -= 2.0f * PI;
+		while(x < -PI) x += 2.0f * PI;
+		return x;
+	}
+
+	//3x3 inverse by cofactors, for covariances kept as plain arrays. false
+	//when singular.
+	bool	Invert33(const float m[3][3], float out[3][3]);
+	bool	Invert33(const double m[3][3], double out[3][3]);
+
 	//Misc
 	template <class T>
 	void swap(T& a, T& b)
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "trace.h"
+#include "timing.h"
+
+volatile int g_TraceLevel = TRACE_OFF;
+
+//single writer, the thread that owns it. Single reader, the drainer.
+struct TraceRing
+{
+    char m_Name[16];
+    std::atomic<uint32_t> m_Head;
+    std::atomic<uint32_t> m_Tail;
+    std::atomic<uint64_t> m_Dropped;
+    uint64_t m_DroppedReported;
+    TraceRecord m_Records[TRACE_RING_RECORDS];
+};
+
+//a record on its way out, with the ring it came from.
+struct TraceEntry
+{
+    const TraceRecord* pRecord;
+    const TraceRing* pRing;
+
+    bool operator<(const TraceEntry& other) const { return pRecord->tick < other.pRecord->tick; }
+};
+
+static __thread TraceRing* t_pRing = NULL;
+
+//rings live until exit, so a thread that's gone can still be drained.
+static pthread_mutex_t s_RingMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TraceRing*> s_Rings;
+
+static FILE* s_fp = NULL;
+static bool s_bCloseFile = false;
+static uint64_t s_StartTick = 0;
+static int s_DrainUsec = 20000;
+static volatile bool s_bRunning = false;
+static pthread_t s_Thread;
+
+static TraceRing* get_thread_ring()
+{
+    if(t_pRing != NULL)
+        return t_pRing;
+
+    TraceRing* pRing = new TraceRing();
+    pRing->m_Head = 0;
+    pRing->m_Tail = 0;
+    pRing->m_Dropped = 0;
+    pRing->m_DroppedReported = 0;
+
+    pthread_mutex_lock(&s_RingMutex);
+    snprintf(pRing->m_Name, sizeof(pRing->m_Name), "thread %d", (int)s_Rings.size());
+    s_Rings.push_back(pRing);
+    pthread_mutex_unlock(&s_RingMutex);
+
+    t_pRing = pRing;
+
+    return pRing;
+}
+
+void TraceSetThreadName(const char* name)
+{
+    TraceRing* pRing = get_thread_ring();
+
+    pthread_mutex_lock(&s_RingMutex);
+    strncpy(pRing->m_Name, name, sizeof(pRing->m_Name) - 1);
+    pRing->m_Name[sizeof(pRing->m_Name) - 1] = 0;
+    pthread_mutex_unlock(&s_RingMutex);
+}
+
+void TraceSetLevel(int level)
+{
+    if(level < TRACE_OFF)
+        level = TRACE_OFF;
+    else if(level > TRACE_DEBUG)
+        level = TRACE_DEBUG;
+
+    g_TraceLevel = level;
+}
+
+void TraceWrite(int level, const char* fmt, const TraceArg* args, int numArgs)
+{
+    TraceRing* pRing = get_thread_ring();
+
+    uint32_t head = pRing->m_Head.load(std::memory_order_relaxed);
+
+    if(head - pRing->m_Tail.load(std::memory_order_acquire) >= TRACE_RING_RECORDS)
+    {
+        pRing->m_Dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TraceRecord& rec = pRing->m_Records[head & (TRACE_RING_RECORDS - 1)];
+    rec.tick = get_time_usec();
+    rec.fmt = fmt;
+    rec.level = level;
+    rec.numArgs = numArgs;
+
+    for(int iArg = 0; iArg < numArgs; iArg++)
+        rec.args[iArg] = args[iArg];
+
+    pRing->m_Head.store(head + 1, std::memory_order_release);
+}
+
+//printf one conversion at a time, each with the type it asks for.
+static void format_record(const TraceRecord& rec, std::string& out)
+{
+    const char* p = rec.fmt;
+    int iArg = 0;
+    char spec[32];
+    char buf[256];
+
+    while(*p != 0)
+    {
+        if(*p != '%')
+        {
+            out += *p++;
+            continue;
+        }
+
+        if(p[1] == '%')
+        {
+            out += '%';
+            p += 2;
+            continue;
+        }
+
+        const char* start = p++;
+
+        while(*p != 0 && strchr("diouxXcfFeEgGaAs", *p) == NULL)
+            p++;
+
+        if(*p == 0 || p + 1 - start >= (int)sizeof(spec) || iArg >= rec.numArgs)
+        {
+            out.append(start, *p == 0 ? p - start : p + 1 - start);
+            p += *p == 0 ? 0 : 1;
+            continue;
+        }
+
+        const char conv = *p++;
+        memcpy(spec, start, p - start);
+        spec[p - start] = 0;
+
+        const TraceArg& arg = rec.args[iArg++];
+        int64_t i = arg.type == TraceArg::eDouble ? (int64_t)arg.d : arg.i;
+        double d = arg.type == TraceArg::eDouble ? arg.d : (double)arg.i;
+
+        if(conv == 's')
+            snprintf(buf, sizeof(buf), spec, arg.type == TraceArg::eString && arg.s != NULL ? arg.s : "?");
+        else if(strchr("fFeEgGaA", conv) != NULL)
+            snprintf(buf, sizeof(buf), spec, d);
+        else if(strstr(spec, "ll") != NULL)
+            snprintf(buf, sizeof(buf), spec, (long long)i);
+        else if(strchr(spec, 'l') != NULL)
+            snprintf(buf, sizeof(buf), spec, (long)i);
+        else if(strchr(spec, 'z') != NULL)
+            snprintf(buf, sizeof(buf), spec, (size_t)i);
+        else
+            snprintf(buf, sizeof(buf), spec, (int)i);
+
+        out += buf;
+    }
+}
+
+static void trace_drain()
+{
+    std::vector<TraceRing*> rings;
+
+    pthread_mutex_lock(&s_RingMutex);
+    rings = s_Rings;
+    pthread_mutex_unlock(&s_RingMutex);
+
+    //take what's there now from every ring, and write it out in time order.
+    std::vector<TraceEntry> entries;
+    std::vector<uint32_t> heads(rings.size());
+
+    for(size_t iRing = 0; iRing < rings.size(); iRing++)
+    {
+        TraceRing* pRing = rings[iRing];
+        uint32_t tail = pRing->m_Tail.load(std::memory_order_relaxed);
+        heads[iRing] = pRing->m_Head.load(std::memory_order_acquire);
+
+        for(uint32_t iRec = tail; iRec != heads[iRing]; iRec++)
+        {
+            TraceEntry e;
+            e.pRecord = &pRing->m_Records[iRec & (TRACE_RING_RECORDS - 1)];
+            e.pRing = pRing;
+            entries.push_back(e);
+        }
+    }
+
+    std::stable_sort(entries.begin(), entries.end());
+
+    std::string line;
+
+    for(size_t iEntry = 0; iEntry < entries.size(); iEntry++)
+    {
+        const TraceRecord& rec = *entries[iEntry].pRecord;
+        char prefix[64];
+
+        snprintf(prefix, sizeof(prefix), "[%10.3f %s] ", get_sec_diff_usec(rec.tick, s_StartTick),
+            entries[iEntry].pRing->m_Name);
+
+        line = prefix;
+        format_record(rec, line);
+
+        if(line.empty() || line[line.size() - 1] != '\n')
+            line += '\n';
+
+        fputs(line.c_str(), s_fp);
+    }
+
+    //hand the slots back only once they're written.
+    for(size_t iRing = 0; iRing < rings.size(); iRing++)
+    {
+        TraceRing* pRing = rings[iRing];
+        pRing->m_Tail.store(heads[iRing], std::memory_order_release);
+
+        uint64_t dropped = pRing->m_Dropped.load(std::memory_order_relaxed);
+
+        if(dropped != pRing->m_DroppedReported)
+        {
+            fprintf(s_fp, "trace: %s dropped %llu records\n", pRing->m_Name,
+                (unsigned long long)(dropped - pRing->m_DroppedReported));
+            pRing->m_DroppedReported = dropped;
+        }
+    }
+
+    if(!entries.empty())
+        fflush(s_fp);
+}
+
+static void* ProcessTraceDrain(void* args)
+{
+    while(s_bRunning)
+    {
+        usleep(s_DrainUsec);
+        trace_drain();
+    }
+
+    trace_drain();
+
+    return NULL;
+}
+
+void TraceInit(Config* conf)
+{
+    const char* filename = conf->GetStr("trace_file", "");
+
+    s_fp = stdout;
+    s_bCloseFile = false;
+
+    if(filename[0] != '\0')
+    {
+        FILE* fp = fopen(filename, "w");
+
+        if(fp != NULL)
+        {
+            s_fp = fp;
+            s_bCloseFile = true;
+        }
+        else
+        {
+            printf("couldn't open trace file %s, tracing to the console.\n", filename);
+        }
+    }
+
+    s_StartTick = get_time_usec();
+    s_DrainUsec = (int)(conf->GetFloat("trace_drain_ms", 20.0f) * 1000.0f);
+
+    if(s_DrainUsec < 1000)
+        s_DrainUsec = 1000;
+
+    s_bRunning = true;
+    pthread_create(&s_Thread, NULL, ProcessTraceDrain, NULL);
+
+    TraceSetLevel(conf->GetInt("trace_level", TRACE_INFO));
+}
+
+void TraceShutdown()
+{
+    if(!s_bRunning)
+        return;
+
+    g_TraceLevel = TRACE_OFF;
+    s_bRunning = false;
+    pthread_join(s_Thread, NULL);
+
+    if(s_bCloseFile)
+        fclose(s_fp);
+
+    s_fp = NULL;
+}
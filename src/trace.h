@@ -0,0 +1,107 @@
+// trace.h
+//
+// Logging cheap enough for the control loops. TRACE copies a pointer to the
+// format and the arguments into a ring owned by the calling thread. There's
+// no lock, no formatting and no system call. A background thread drains the
+// rings every trace_drain_ms, formats the records in time order, and writes
+// them to the console or to trace_file.
+//
+// Records above the trace level cost a load and a compare. When a ring is
+// full, records are dropped and counted, rather than hold up the thread.
+//
+// The format is printf's, but must be a string literal, and %s arguments
+// must outlive the drain, so are literals too. No * widths. Up to
+// TRACE_MAX_ARGS arguments.
+//
+//   TRACE(TRACE_DEBUG, "pid: steer: %0.3f throttle: %0.3f\n", steering, throttle);
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include "config.h"
+
+enum TraceLevel
+{
+    TRACE_OFF = 0,
+    TRACE_ERROR,
+    TRACE_INFO,
+    TRACE_DEBUG,
+};
+
+enum TraceConstants
+{
+    TRACE_MAX_ARGS = 6,
+    TRACE_RING_RECORDS = 1024,  //per thread, a power of two
+};
+
+struct TraceArg
+{
+    enum Type
+    {
+        eInt,
+        eDouble,
+        eString,
+    };
+
+    TraceArg() : i(0), type(eInt) {}
+    TraceArg(int v) : i(v), type(eInt) {}
+    TraceArg(unsigned int v) : i(v), type(eInt) {}
+    TraceArg(long v) : i(v), type(eInt) {}
+    TraceArg(unsigned long v) : i((int64_t)v), type(eInt) {}
+    TraceArg(long long v) : i(v), type(eInt) {}
+    TraceArg(unsigned long long v) : i((int64_t)v), type(eInt) {}
+    TraceArg(double v) : d(v), type(eDouble) {}
+    TraceArg(const char* v) : s(v), type(eString) {}
+
+    union
+    {
+        int64_t i;
+        double d;
+        const char* s;
+    };
+
+    int type;
+};
+
+struct TraceRecord
+{
+    uint64_t tick;
+    const char* fmt;
+    int level;
+    int numArgs;
+    TraceArg args[TRACE_MAX_ARGS];
+};
+
+//records at this level and below are kept. Set from trace_level.
+extern volatile int g_TraceLevel;
+
+//start the drainer. Until then the level is TRACE_OFF and TRACE does nothing.
+void TraceInit(Config* conf);
+
+//stop the drainer, after writing out what's left.
+void TraceShutdown();
+
+//safe from a signal handler.
+void TraceSetLevel(int level);
+
+//label for the calling thread's records.
+void TraceSetThreadName(const char* name);
+
+void TraceWrite(int level, const char* fmt, const TraceArg* args, int numArgs);
+
+template<typename... Args>
+inline void TraceArgs(int level, const char* fmt, Args... args)
+{
+    static_assert(sizeof...(Args) <= TRACE_MAX_ARGS, "too many trace arguments");
+
+    //one spare, so there's an array with no arguments too.
+    const TraceArg packed[] = { TraceArg(), TraceArg(args)... };
+
+    TraceWrite(level, fmt, packed + 1, (int)sizeof...(Args));
+}
+
+#define TRACE(level, ...) \
+    do { if((level) <= g_TraceLevel) TraceArgs((level), __VA_ARGS__); } while(0)
+
+#endif //__TRACE_H__
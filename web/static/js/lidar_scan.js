@@ -0,0 +1,185 @@
+
+// Draws the compact lidar scan stream published by shark. See src/scanstream.h
+// for the message layout. Messages arrive length prefixed over a streaming
+// http response.
+
+function lidar_scan_decoder()
+{
+    var prev = null;
+    var lastSeq = -1;
+
+    return function(msg)
+    {
+        if(msg.length < 16 || msg[0] != 76 || msg[1] != 83)
+            return null;
+
+        var dv = new DataView(msg.buffer, msg.byteOffset, msg.byteLength);
+        var flags = msg[3];
+        var seq = dv.getUint32(4, true);
+        var tick = dv.getUint32(8, true);
+        var numBins = dv.getUint16(12, true);
+        var quant = dv.getUint16(14, true);
+        var keyframe = (flags & 1) != 0;
+        var off = 16;
+        var pose = null;
+
+        if(flags & 2)
+        {
+            pose = { x : dv.getFloat32(off, true),
+                     y : dv.getFloat32(off + 4, true),
+                     theta : dv.getFloat32(off + 8, true) };
+            off += 12;
+        }
+
+        //deltas are only good against the scan right before them.
+        var inSync = keyframe || (prev != null && prev.length == numBins && seq == lastSeq + 1);
+        lastSeq = seq;
+
+        if(!inSync)
+        {
+            prev = null;
+            return null;
+        }
+
+        var ranges = new Uint16Array(numBins);
+
+        for(var i = 0; i < numBins; i++)
+        {
+            var v = 0, shift = 0, b;
+
+            do {
+                b = msg[off++];
+                v += (b & 0x7f) * Math.pow(2, shift);
+                shift += 7;
+            } while(b & 0x80);
+
+            //undo zigzag
+            var delta = (v % 2) ? -(v + 1) / 2 : v / 2;
+            ranges[i] = (keyframe ? 0 : prev[i]) + delta;
+        }
+
+        var quality = new Uint8Array(numBins);
+
+        for(var i = 0; i < numBins; i += 2)
+        {
+            var q = msg[off++];
+            quality[i] = q & 0x0f;
+            quality[i + 1] = q >> 4;
+        }
+
+        prev = ranges;
+
+        return { seq : seq, tick : tick, quant : quant, pose : pose,
+                 ranges : ranges, quality : quality };
+    };
+}
+
+function lidar_scan_draw(canvas, scan)
+{
+    var ctx = canvas.getContext("2d");
+    var cx = canvas.width / 2;
+    var cy = canvas.height / 2;
+    var numBins = scan.ranges.length;
+    var longest = 0;
+
+    for(var i = 0; i < numBins; i++)
+        if(scan.ranges[i] > longest)
+            longest = scan.ranges[i];
+
+    //keep a slowly adapting scale so the image doesn't pulse each scan.
+    var scale = cx / (longest * scan.quant + 1.0);
+
+    if(canvas.lidarScale == undefined)
+        canvas.lidarScale = scale;
+    else
+        canvas.lidarScale = canvas.lidarScale * 0.95 + scale * 0.05;
+
+    scale = canvas.lidarScale * scan.quant;
+
+    ctx.fillStyle = "#000000";
+    ctx.fillRect(0, 0, canvas.width, canvas.height);
+
+    //forward returns up in the image, not to the right.
+    var binToRad = (360.0 / numBins) * Math.PI / 180.0;
+    var thetaOffset = -Math.PI / 2.0;
+
+    for(var i = 0; i < numBins; i++)
+    {
+        var r = scan.ranges[i];
+
+        if(r == 0)
+            continue;
+
+        var theta = i * binToRad + thetaOffset;
+        var x = cx + Math.cos(theta) * r * scale;
+        var y = cy + Math.sin(theta) * r * scale;
+        var c = 80 + scan.quality[i] * 11;
+
+        ctx.fillStyle = "rgb(" + c + "," + c + "," + c + ")";
+        ctx.fillRect(x - 1, y - 1, 2, 2);
+    }
+
+    ctx.fillStyle = "#ff0000";
+    ctx.fillRect(cx - 2, cy - 2, 4, 4);
+}
+
+function lidar_scan_view(canvasId, statusId, url)
+{
+    var canvas = document.getElementById(canvasId);
+    var status = document.getElementById(statusId);
+    var decode = lidar_scan_decoder();
+    var pending = new Uint8Array(0);
+
+    function on_message(msg)
+    {
+        var scan = decode(msg);
+
+        if(scan == null)
+            return;
+
+        lidar_scan_draw(canvas, scan);
+
+        if(status && scan.pose)
+        {
+            status.innerHTML = "x: " + scan.pose.x.toFixed(0) + " mm  y: " +
+                scan.pose.y.toFixed(0) + " mm  theta: " + scan.pose.theta.toFixed(1);
+        }
+    }
+
+    function on_chunk(chunk)
+    {
+        var joined = new Uint8Array(pending.length + chunk.length);
+        joined.set(pending, 0);
+        joined.set(chunk, pending.length);
+
+        var off = 0;
+
+        while(joined.length - off >= 4)
+        {
+            var len = new DataView(joined.buffer, off, 4).getUint32(0, true);
+
+            if(joined.length - off - 4 < len)
+                break;
+
+            on_message(joined.subarray(off + 4, off + 4 + len));
+            off += 4 + len;
+        }
+
+        pending = joined.slice(off);
+    }
+
+    fetch(url).then(function(response) {
+        var reader = response.body.getReader();
+
+        function pump() {
+            return reader.read().then(function(result) {
+                if(result.done)
+                    return;
+                on_chunk(result.value);
+                return pump();
+            });
+        }
+
+        return pump();
+    });
+}
@@ -10,6 +10,7 @@ import os
 import sys
 import time
 import signal
+import struct
 from subprocess import Popen, PIPE, STDOUT
 import multiprocessing as mp
 from io import BytesIO
@@ -295,47 +296,37 @@ class WebSite(object):
         cherrypy.response.headers["Content-Type"] = "multipart/x-mixed-replace;boundary=--boundarydonotcross"
         boundary = "--boundarydonotcross"
         def content():
-            iImage = 0
-            delay  = 1.0 / 30.0
+            #shark publishes each camera frame once, already jpeg encoded.
+            #each viewer gets its own subscriber that only keeps the latest
+            #frame, and its own rate limit, so a slow client only slows itself.
             context = zmq.Context()
-            socket = context.socket(zmq.REQ)
+            socket = context.socket(zmq.SUB)
+            socket.setsockopt(zmq.CONFLATE, 1)
+            socket.setsockopt(zmq.SUBSCRIBE, b"")
             connect_str = "tcp://127.0.0.1:%d" % conf.web_image_port
-            print( "connecting to live image at:", connect_str)
+            print( "subscribing to live image at:", connect_str)
             socket.connect(connect_str)
-            command = "hi"
-            row, col, ch = conf.row, conf.col, conf.ch
-            font = ImageFont.truetype("./static/fonts/BADABB__.TTF", 16)
-            while True:
-                if conf.debug_test_web:
-                    print("sending request for image")
-                socket.send(command)
-                img_str = socket.recv()
-                
-                if conf.debug_test_web:
-                    print("got image data")
-                
-                lin_arr = np.fromstring(img_str, dtype=np.uint8)
-                img_arr = lin_arr.reshape(row, col, ch)
-                img = Image.fromarray(img_arr, "RGB")
-                '''
-                if self.model is not None:
-                    try:
-                        pred = self.model.predict(img_arr[None, :, :, :])[0][0]
-                        draw = ImageDraw.Draw(img)
-                        pred_str = '%0.2f' % pred
-                        draw.text((0, 0),pred_str,(128,128,255),font=font)
-                    except:
-                        pass
-                '''
-                with BytesIO() as output:
-                    img.save(output, "JPEG")
-                    jpg_img = output.getvalue()
-                yield(boundary)
-                yield("Content-type: image/jpeg\r\n")
-                yield("Content-length: %s\r\n\r\n" % len(jpg_img))
-                yield(jpg_img)
-                #time.sleep(delay)
-                
+            min_interval = 1.0 / getattr(conf, 'web_stream_client_max_fps', 15)
+            try:
+                while True:
+                    start = time.time()
+                    jpg_img = socket.recv()
+
+                    if conf.debug_test_web:
+                        print("got image data")
+
+                    yield(boundary)
+                    yield("Content-type: image/jpeg\r\n")
+                    yield("Content-length: %s\r\n\r\n" % len(jpg_img))
+                    yield(jpg_img)
+
+                    remaining = min_interval - (time.time() - start)
+                    if remaining > 0:
+                        time.sleep(remaining)
+            finally:
+                socket.close(linger=0)
+                context.term()
+
         return content()
     img_live.exposed = True
     img_live._cp_config = {'response.stream': True}
@@ -346,10 +337,44 @@ class WebSite(object):
         res.append("<br>")
         res.append('<a href="/manage_robot">robot</a><br>')
         res.append("<br>")      
-        res.append('<img src="/lidar_live"></img><br>')
+        if getattr(conf, 'web_lidar_stream_mode', 'image') == 'scan':
+            #the robot sends the raw scan, and we draw it here in the browser.
+            res.append('<canvas id="lidar_canvas" width="512" height="512"></canvas><br>')
+            res.append('<div id="lidar_status"></div>')
+            res.append('<script src="static/js/lidar_scan.js"></script>')
+            res.append('<script>lidar_scan_view("lidar_canvas", "lidar_status", "/lidar_scan_stream");</script>')
+        else:
+            res.append('<img src="/lidar_live"></img><br>')
         return self.easy_page("".join(res))
     lidar.exposed = True
 
+    def lidar_scan_stream(self):
+        '''
+        forward the compact scan messages published by shark to the browser,
+        each prefixed with its 4 byte little endian length.
+        '''
+        cherrypy.response.headers["Content-Type"] = "application/octet-stream"
+        cherrypy.response.headers["Cache-Control"] = "no-cache"
+        def content():
+            context = zmq.Context()
+            socket = context.socket(zmq.SUB)
+            socket.setsockopt(zmq.RCVHWM, 32)
+            socket.setsockopt(zmq.SUBSCRIBE, b"")
+            connect_str = "tcp://127.0.0.1:%d" % conf.web_lidar_port
+            print ("subscribing to lidar scans at:", connect_str)
+            socket.connect(connect_str)
+            try:
+                while True:
+                    msg = socket.recv()
+                    yield(struct.pack('<I', len(msg)) + msg)
+            finally:
+                socket.close(linger=0)
+                context.term()
+
+        return content()
+    lidar_scan_stream.exposed = True
+    lidar_scan_stream._cp_config = {'response.stream': True}
+
     def lidar_live(self):
         cherrypy.response.headers["Content-Type"] = "multipart/x-mixed-replace;boundary=--boundarydonotcross"
         boundary = "--boundarydonotcross"